@@ -0,0 +1,75 @@
+/*
+ * FlightRecorder.cpp - always on record of recent input and USB events, kept
+ *                      over a watchdog reboot and readable from the host
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <cstring>
+
+#include "hardware/watchdog.h"
+
+#include "FlightRecorder.h"
+
+static_assert((RECORDER_LENGTH & (RECORDER_LENGTH - 1)) == 0, "RECORDER_LENGTH must be a power of 2");
+
+recorderRing __uninitialized_ram(recorderRings)[2];
+
+FlightRecorder::FlightRecorder() {
+}
+
+void FlightRecorder::begin() {
+    // keep what's there if it looks like it was left by this firmware
+    for (uint8_t c = 0; c < 2; c++) {
+        recorderRing *r = &recorderRings[c];
+        if (r->magic != RECORDER_MAGIC || r->size != sizeof(recorderRing)) {
+            memset(r, 0, sizeof(recorderRing));
+            r->magic = RECORDER_MAGIC;
+            r->size = sizeof(recorderRing);
+        }
+    }
+
+    // mark where this boot starts in both rings, the timer starts again from 0
+    // so this is the only way to tell boots apart. core1 isn't running yet so
+    // its ring can be written from here
+    uint32_t boots = ++recorderRings[0].boots;
+    bool watchdog = watchdog_caused_reboot();
+    for (uint8_t c = 0; c < 2; c++) {
+        recorderRing *r = &recorderRings[c];
+        eventRecord *e = &r->records[r->head & (RECORDER_LENGTH - 1)];
+        e->time = time_us_32();
+        e->data = EVENT_BOOT | (watchdog << 8) | ((boots & 0xFFFF) << 16);
+        r->head++;
+    }
+}
+
+const eventRecord* FlightRecorder::getRecord(uint8_t core, uint32_t n) {
+    uint32_t head = recorderRings[core].head;
+    if (n >= head || head - n > RECORDER_LENGTH) {
+        return NULL;
+    }
+    return &recorderRings[core].records[n & (RECORDER_LENGTH - 1)];
+}
+
+FlightRecorder Recorder;
@@ -0,0 +1,216 @@
+/*
+ * KeyResolver.cpp - dual role (tap-hold) keys and combos, decided as soon as
+ *                   the keys pressed so far allow it
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <cstring>
+
+#include "usb.h"
+
+#include "pico/time.h"
+
+#include "KeyResolver.h"
+#include "USBKeyboard.h"
+#include "FlightRecorder.h"
+
+KeyResolver::KeyResolver() {
+}
+
+void KeyResolver::keyChanged(uint8_t down, uint8_t across, bool pressed, uint8_t scancode) {
+    resolverEvent e = {down, across, scancode, pressed, to_us_since_boot(get_absolute_time())};
+    change(&e);
+}
+
+void KeyResolver::change(const resolverEvent *e) {
+    uint8_t down = e->down, across = e->across, scancode = e->scancode;
+    bool pressed = e->pressed;
+    if (pending) {
+        held[heldcount++] = *e;
+        heldevents++;
+        decide(e->time);
+        return;
+    }
+
+    if (!pressed) {
+        for (uint8_t c = 0; c < engagedcount; c++) {
+            if (engaged[c].down == down && engaged[c].across == across) {
+                uint8_t k = engaged[c].scancode;
+                uint8_t b = engaged[c].binding;
+                engaged[c] = engaged[--engagedcount];
+                if (k == HID_KEY_NONE) {
+                    return; // the other half of a combo that's already been let go of
+                }
+                // the rest of a combo has nothing left to let go of
+                for (uint8_t d = 0; d < engagedcount; d++) {
+                    if (engaged[d].binding == b) {
+                        engaged[d].scancode = HID_KEY_NONE;
+                    }
+                }
+                handleKey(down, across, false, k);
+                return;
+            }
+        }
+    }
+    else if (findBinding(down, across)) {
+        held[0] = *e;
+        heldcount = 1;
+        heldevents++;
+        pending = true;
+        // the time runs from when the key was pressed, even if it was held back behind something else
+        uint8_t time = binding.type == SPECIAL_TAP_HOLD ? binding.topress[2] : binding.topress[1];
+        uint32_t ms = time * 10u < maxdelay ? time * 10u : maxdelay;
+        deadline = e->time + ms * 1000ull;
+        return;
+    }
+    handleKey(down, across, pressed, scancode);
+}
+
+void KeyResolver::task() {
+    if (pending) {
+        decide(to_us_since_boot(get_absolute_time()));
+    }
+}
+
+void KeyResolver::reset() {
+    pending = false;
+    heldcount = 0;
+    engagedcount = 0;
+}
+
+bool KeyResolver::findBinding(uint8_t down, uint8_t across) {
+    const keymapImage *image = Keymaps.active();
+    for (uint8_t c = 0; c < image->numspecials; c++) {
+        const specialEntry *s = &image->specials[c];
+        bool here = s->down == down && s->across == across;
+        if ((s->type == SPECIAL_TAP_HOLD && here) ||
+                (s->type == SPECIAL_COMBO && (here || (s->down2 == down && s->across2 == across)))) {
+            memcpy(&binding, s, sizeof(specialEntry));
+            pendingindex = c;
+            return true;
+        }
+    }
+    return false;
+}
+
+// see if what's been held back so far settles it, now is the time of the
+// latest key change, or the time if it's from task()
+void KeyResolver::decide(uint64_t now) {
+    const resolverEvent *first = &held[0];
+    if (binding.type == SPECIAL_TAP_HOLD) {
+        for (uint8_t c = 1; c < heldcount; c++) {
+            const resolverEvent *e = &held[c];
+            if (e->time >= deadline) {
+                finish(RESOLVE_HOLD, 0); // it was a hold before this happened
+                return;
+            }
+            if (e->down == first->down && e->across == first->across) {
+                finish(RESOLVE_TAP, 0);
+                return;
+            }
+            if (e->pressed && (binding.topress[3] & TAP_HOLD_ON_OTHER_KEY)) {
+                finish(RESOLVE_HOLD, 0);
+                return;
+            }
+            if (!e->pressed && (binding.topress[3] & TAP_HOLD_PERMISSIVE)) {
+                for (uint8_t d = 1; d < c; d++) {
+                    if (held[d].pressed && held[d].down == e->down && held[d].across == e->across) {
+                        finish(RESOLVE_HOLD, 0);
+                        return;
+                    }
+                }
+            }
+        }
+        if (now >= deadline || heldcount == RESOLVER_QUEUE_LENGTH) {
+            finish(RESOLVE_HOLD, 0);
+        }
+    }
+    else {
+        // the first thing after the first key is all that matters
+        if (heldcount > 1) {
+            const resolverEvent *e = &held[1];
+            bool partner = first->down == binding.down && first->across == binding.across ?
+                e->down == binding.down2 && e->across == binding.across2 :
+                e->down == binding.down && e->across == binding.across;
+            finish(e->pressed && partner && e->time < deadline ? RESOLVE_COMBO : RESOLVE_NO_COMBO, 1);
+        }
+        else if (now >= deadline) {
+            finish(RESOLVE_NO_COMBO, 0);
+        }
+    }
+}
+
+void KeyResolver::finish(resolveOutcome outcome, uint8_t partner) {
+    // how long the first key was actually held back for
+    uint32_t delay = to_us_since_boot(get_absolute_time()) - held[0].time;
+    if (delay > maxheld) {
+        maxheld = delay;
+    }
+    Recorder.record(EVENT_RESOLVE, pendingindex, outcome, delay / 1000 < 255 ? delay / 1000 : 255);
+
+    // what was held back is sent on from a copy, as it can start something else
+    resolverEvent events[RESOLVER_QUEUE_LENGTH];
+    uint8_t count = heldcount;
+    memcpy(events, held, count * sizeof(resolverEvent));
+    heldcount = 0;
+    pending = false;
+
+    uint8_t next = 1;
+    switch (outcome) {
+        case RESOLVE_TAP:
+            engage(events[0].down, events[0].across, binding.topress[0]);
+            handleKey(events[0].down, events[0].across, true, binding.topress[0]);
+            break;
+        case RESOLVE_HOLD:
+            engage(events[0].down, events[0].across, binding.topress[1]);
+            handleKey(events[0].down, events[0].across, true, binding.topress[1]);
+            break;
+        case RESOLVE_COMBO:
+            engage(events[0].down, events[0].across, binding.topress[0]);
+            engage(events[partner].down, events[partner].across, binding.topress[0]);
+            handleKey(events[0].down, events[0].across, true, binding.topress[0]);
+            next = partner + 1;
+            break;
+        case RESOLVE_NO_COMBO:
+            handleKey(events[0].down, events[0].across, true, events[0].scancode);
+            break;
+    }
+    for (uint8_t c = next; c < count; c++) {
+        // a report for each, newer keys go first in a report so two in one
+        // could come out in the wrong order (and a tap's press and release
+        // would cancel out)
+        Keyboard.sendReport();
+        change(&events[c]);
+    }
+}
+
+void KeyResolver::engage(uint8_t down, uint8_t across, uint8_t scancode) {
+    if (engagedcount == RESOLVER_MAX_ENGAGED) {
+        return; // let go of as the key in the keymap, better than nothing
+    }
+    engaged[engagedcount++] = {down, across, scancode, pendingindex};
+}
+
+KeyResolver Resolver;
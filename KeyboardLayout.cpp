@@ -29,33 +29,74 @@
 #include "usb.h"
 
 #include "KeyboardLayout.h"
+#include "KeymapStore.h"
+#include "KeyResolver.h"
 
-// GPIO pins for the membrane
-uint8_t across[NUM_ACROSS] = {20, 19, 18, 17, 13, 14, 15, 16, 12, 10, 11, 9, 8, 6, 4, 2, 1, 3, 5, 7};
-uint8_t down[NUM_DOWN] = {28, 26, 27, 21, 23, 25, 22, 24};
+// GPIO pins for the membrane are in boards/model-m-122.pins and the mapping
+// of matrix row/column to scan code is in boards/model-m-122.keymap, the
+// keymap and specials below are the defaults loaded into KeymapStore
 
-// https://deskthority.net/wiki/Scancode
+uint8_t LayerState::active() {
+    uint8_t a = 1 | toggled | oneshot;
+    for (uint8_t n = 1; n < MAX_LAYERS; n++) {
+        if (held[n]) {
+            a |= 1 << n;
+        }
+    }
+    return a;
+}
 
-// 0xFF -> special function to be handed differently
-// mapping of matrix row/column to scan code
-uint8_t keyboardlayout[NUM_DOWN][NUM_ACROSS] = {
-//                          0 (pin 1)             1 (pin 2)              2 (pin 3)            3 (pin 4)          4 (pin 5)     5 (pin 6)     6 (pin 7)  7 (pin 8)  8 (pin 9)      9 (pin 10)   10 (pin 11)  11 (pin 12)             12 (pin 13)      13 (pin 14)           14 (pin 15)         15 (pin 16)        16 (pin 17)            17 (pin 18)              18 (pin 19)           19 (pin 20)
-/*0 (pin 1)*/{   HID_KEY_CONTROL_LEFT,  HID_KEY_APPLICATION,      HID_KEY_GUI_LEFT,   HID_KEY_ALT_RIGHT,      HID_KEY_NONE, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_G, HID_KEY_H, HID_KEY_ESCAPE,   HID_KEY_F1,  HID_KEY_F2,          HID_KEY_NONE,     HID_KEY_NONE,   HID_KEY_APOSTROPHE, HID_KEY_ARROW_DOWN,  HID_KEY_ARROW_UP,          HID_KEY_NONE,            HID_KEY_NONE,                 0xFF},
-/*1 (pin 2)*/{                   0xFF, HID_KEY_PRINT_SCREEN,                  0xFF,        HID_KEY_NONE,         HID_KEY_A,    HID_KEY_S,    HID_KEY_D, HID_KEY_F, HID_KEY_J,           0xFF,         0xFF,  HID_KEY_F3,             HID_KEY_K,        HID_KEY_L,    HID_KEY_SEMICOLON,   HID_KEY_KEYPAD_4,    HID_KEY_DELETE,      HID_KEY_KEYPAD_5,        HID_KEY_KEYPAD_6,  HID_KEY_ARROW_RIGHT},
-/*2 (pin 3)*/{HID_KEY_KEYPAD_SUBTRACT,        HID_KEY_PAUSE,          HID_KEY_NONE,        HID_KEY_NONE,         HID_KEY_1,    HID_KEY_2,    HID_KEY_3, HID_KEY_4, HID_KEY_7,           0xFF,   HID_KEY_F4,  HID_KEY_F5,             HID_KEY_8,        HID_KEY_9,            HID_KEY_0,   HID_KEY_NUM_LOCK,   HID_KEY_PAGE_UP, HID_KEY_KEYPAD_DIVIDE, HID_KEY_KEYPAD_MULTIPLY,         HID_KEY_NONE},
-/*3 (pin 4)*/{           HID_KEY_NONE,       HID_KEY_ESCAPE,                  0xFF,        HID_KEY_NONE,     HID_KEY_GRAVE, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_5, HID_KEY_6,           0xFF,         0xFF,  HID_KEY_F6,         HID_KEY_EQUAL,     HID_KEY_NONE,        HID_KEY_MINUS,  HID_KEY_BACKSPACE,    HID_KEY_INSERT,          HID_KEY_HOME,            HID_KEY_NONE,         HID_KEY_NONE},
-/*4 (pin 5)*/{     HID_KEY_KEYPAD_ADD,                 0xFF,           HID_KEY_TAB,        HID_KEY_NONE,         HID_KEY_Q,    HID_KEY_W,    HID_KEY_E, HID_KEY_R, HID_KEY_U,           0xFF,   HID_KEY_F7,  HID_KEY_F8,             HID_KEY_I,        HID_KEY_O,            HID_KEY_P,   HID_KEY_KEYPAD_7, HID_KEY_PAGE_DOWN,      HID_KEY_KEYPAD_8,        HID_KEY_KEYPAD_9,         HID_KEY_NONE},
-/*5 (pin 6)*/{           HID_KEY_NONE,  HID_KEY_SCROLL_LOCK,                  0xFF,        HID_KEY_NONE,      HID_KEY_NONE, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_T, HID_KEY_Y,           0xFF,         0xFF,  HID_KEY_F9, HID_KEY_BRACKET_RIGHT,     HID_KEY_NONE, HID_KEY_BRACKET_LEFT,       HID_KEY_NONE,       HID_KEY_END,          HID_KEY_NONE,            HID_KEY_NONE,         HID_KEY_NONE},
-/*6 (pin 7)*/{     HID_KEY_ARROW_LEFT,     HID_KEY_KEYPAD_1,     HID_KEY_CAPS_LOCK, HID_KEY_SHIFT_RIGHT,         HID_KEY_Z,    HID_KEY_X,    HID_KEY_C, HID_KEY_V, HID_KEY_M,           0xFF,  HID_KEY_F10, HID_KEY_F11,         HID_KEY_COMMA,   HID_KEY_PERIOD,     HID_KEY_EUROPE_1,      HID_KEY_ENTER,      HID_KEY_NONE,      HID_KEY_KEYPAD_2,        HID_KEY_KEYPAD_3,         HID_KEY_NONE},
-/*7 (pin 8)*/{       HID_KEY_ALT_LEFT,        HID_KEY_SPACE, HID_KEY_CONTROL_RIGHT,  HID_KEY_SHIFT_LEFT, HID_KEY_BACKSLASH, HID_KEY_NONE, HID_KEY_NONE, HID_KEY_B, HID_KEY_N,           0xFF,         0xFF, HID_KEY_F12,          HID_KEY_NONE,     HID_KEY_NONE,        HID_KEY_SLASH,       HID_KEY_NONE,      HID_KEY_NONE,      HID_KEY_KEYPAD_0,  HID_KEY_KEYPAD_DECIMAL, HID_KEY_KEYPAD_ENTER}
-};
+uint8_t LayerState::press(uint8_t down, uint8_t across) {
+    // look down from the top active layer until something that isn't transparent
+    const keymapImage *image = Keymaps.active();
+    uint8_t a = active();
+    uint8_t k = HID_KEY_NONE;
+    for (int8_t n = image->numlayers-1; n >= 0; n--) {
+        if (a & (1 << n)) {
+            k = image->keymap[n][down][across];
+            if (k != KEY_TRANSPARENT) {
+                break;
+            }
+        }
+    }
+
+    if (k >= KEY_LAYER_MOMENTARY(0) && k < KEY_LAYER_TOGGLE(0)) {
+        held[k - KEY_LAYER_MOMENTARY(0)]++;
+    }
+    else if (k >= KEY_LAYER_TOGGLE(0) && k < KEY_LAYER_ONESHOT(0)) {
+        toggled ^= 1 << (k - KEY_LAYER_TOGGLE(0));
+    }
+    else if (k >= KEY_LAYER_ONESHOT(0) && k < 0xFC) {
+        oneshot |= 1 << (k - KEY_LAYER_ONESHOT(0));
+    }
+    else if (k != HID_KEY_NONE) {
+        // the one shot layer has been used up by this key
+        oneshot = 0;
+    }
+    return k;
+}
+
+void LayerState::release(uint8_t k) {
+    if (k >= KEY_LAYER_MOMENTARY(0) && k < KEY_LAYER_TOGGLE(0) && held[k - KEY_LAYER_MOMENTARY(0)]) {
+        held[k - KEY_LAYER_MOMENTARY(0)]--;
+    }
+}
+
+void LayerState::reset() {
+    for (uint8_t n = 0; n < MAX_LAYERS; n++) {
+        held[n] = 0;
+    }
+    toggled = 0;
+    oneshot = 0;
+}
 
 // F14-F23 are what I'm calling Magic 1 through Magic 9, these are used to execute special functions (see below)
 // magic1: 9, 1 - magic2: 10, 1 - magic3: 9, 2
 // magic4: 9, 3 - magic5: 10, 3 - magic6: 9, 4 
 // magic7: 9, 5 - magic8: 10, 5 - magic9: 9, 6 - magic10: 9, 7
 
-std::vector<specialFunctionDefinition> specials = {
+// constexpr so a special that's too long is a build error (see specialTooLong)
+constexpr specialFunctionDefinition specials[] = {
     specialFunctionDefinition(0, 1, SPECIAL_TYPE, "^"), // keypad carrot (extra key above keypad enter)
     specialFunctionDefinition(2, 5, SPECIAL_PRESS, {HID_KEY_CONTROL_LEFT, HID_KEY_X, 0x00}), // cut   on the
     specialFunctionDefinition(1, 4, SPECIAL_PRESS, {HID_KEY_CONTROL_LEFT, HID_KEY_C, 0x00}), // copy  left hand
@@ -96,4 +137,15 @@ std::vector<specialFunctionDefinition> specials = {
     specialFunctionDefinition(9, 1, SPECIAL_MACRO_SELECT, {0x01, 0x00}), // ctrl again - record 0x01
     specialFunctionDefinition(10, 1, SPECIAL_MACRO_SELECT, {0x02, 0x00}), // ctrl again - record 0x02
     specialFunctionDefinition(9, 2, SPECIAL_MACRO_SELECT, {0x03, 0x00}), // ctrl again - record 0x03
+
+    // tap-hold keys and combos are found by position, whatever the keymap has there (see KeyResolver.h),
+    // these are switched on for modelm-replay-resolver (sim/CMakeLists.txt) and sim/traces/resolver
+#ifdef PICO_MODEL_M_RESOLVER_EXAMPLES
+    specialFunctionDefinition(2, 6, SPECIAL_TAP_HOLD, {HID_KEY_ESCAPE, HID_KEY_CONTROL_LEFT, RESOLVE_TIME(200), TAP_HOLD_ON_OTHER_KEY}), // caps lock, escape or ctrl
+    specialFunctionDefinition(2, 4, SPECIAL_TAP_HOLD, {HID_KEY_TAB, HID_KEY_ALT_LEFT, RESOLVE_TIME(200), 0}), // tab, tab or alt
+    specialFunctionDefinition(15, 6, SPECIAL_TAP_HOLD, {HID_KEY_ENTER, HID_KEY_CONTROL_RIGHT, RESOLVE_TIME(200), TAP_HOLD_PERMISSIVE}), // enter, enter or ctrl
+    specialFunctionDefinition(8, 1, 12, 1, SPECIAL_COMBO, {HID_KEY_ESCAPE, RESOLVE_TIME(50)}), // j + k, escape
+#endif
 };
+const uint8_t numspecials = sizeof(specials) / sizeof(specials[0]);
+static_assert(numspecials <= KEYMAP_MAX_SPECIALS, "more specials than fit in a keymap image, see KeymapStore.h");
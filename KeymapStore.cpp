@@ -0,0 +1,226 @@
+/*
+ * KeymapStore.cpp - RAM copy of the keymap and special functions that can be
+ *                   changed while running and saved to flash
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <cstring>
+
+#include "usb.h"
+
+#include "pico/multicore.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+
+#include "KeymapStore.h"
+#include "FlightRecorder.h"
+
+static_assert(KEYMAP_BUFFER_SIZE <= FLASH_SECTOR_SIZE, "keymap doesn't fit in a flash sector");
+
+KeymapStore::KeymapStore() {
+}
+
+void KeymapStore::begin() {
+    // the flash is memory mapped, so the saved keymap can be checked in place.
+    // a keymap saved before the built in one was changed would hide the
+    // change for good, so it's only used if it started from the same defaults
+    const keymapImage *saved = (const keymapImage*)(XIP_BASE + KEYMAP_FLASH_OFFSET);
+    loadDefaults(&buffers[0].image);
+    if (validate(saved)) {
+        if (saved->defaults == buffers[0].image.defaults) {
+            memcpy(&buffers[0].image, saved, sizeof(keymapImage));
+        }
+        else {
+            Recorder.record(EVENT_KEYMAP_STALE);
+        }
+    }
+    pack(0);
+    activebuffer = 0;
+    swappending = false;
+}
+
+void KeymapStore::pack(uint8_t buffer) {
+    const keymapImage *image = &buffers[buffer].image;
+    for (uint8_t c = 0; c < image->numspecials; c++) {
+        const specialEntry *s = &image->specials[c];
+        packedText *p = &packed[buffer][c];
+        p->length = 0;
+        if (s->type == SPECIAL_TYPE || s->type == SPECIAL_RUN) {
+            char text[SPECIAL_MAX_LENGTH + 1];
+            memcpy(text, s->topress, s->length);
+            uint8_t length = s->length;
+            if (s->type == SPECIAL_RUN) {
+                text[length++] = '\n'; // to run the command
+            }
+            p->length = USBKeyboard::packText(text, length, p->data, SPECIAL_PACKED_SIZE);
+        }
+    }
+}
+
+// build an image from the keymap generated from boards/*.keymap and specials
+// from KeyboardLayout.cpp
+void KeymapStore::loadDefaults(keymapImage *image) {
+    memset(image, 0, sizeof(keymapImage));
+    image->magic = KEYMAP_MAGIC;
+    image->version = KEYMAP_VERSION;
+    image->size = sizeof(keymapImage);
+    image->numlayers = NUM_LAYERS;
+    memcpy(image->keymap, keymap, sizeof(keymap));
+
+    image->numspecials = 0;
+    for (uint8_t c = 0; c < numspecials; c++) {
+        specialEntry *s = &image->specials[image->numspecials++];
+        s->across = specials[c].across;
+        s->down = specials[c].down;
+        s->across2 = specials[c].across2;
+        s->down2 = specials[c].down2;
+        s->twokey = specials[c].twokey;
+        s->type = specials[c].type;
+        s->length = specials[c].length;
+        memcpy(s->topress, specials[c].topress, s->length);
+    }
+    // with defaults still 0, so it's the same for every copy of these defaults
+    image->defaults = crc32((const uint8_t*)image, offsetof(keymapImage, crc));
+    image->crc = crc32((const uint8_t*)image, offsetof(keymapImage, crc));
+}
+
+// check everything that could make the firmware misbehave, so a bad keymap
+// is refused rather than used
+bool KeymapStore::validate(const keymapImage *image) {
+    if (image->magic != KEYMAP_MAGIC || image->version != KEYMAP_VERSION || image->size != sizeof(keymapImage)) {
+        return false;
+    }
+    if (image->numlayers < 1 || image->numlayers > MAX_LAYERS || image->numspecials > KEYMAP_MAX_SPECIALS) {
+        return false;
+    }
+    if (image->crc != crc32((const uint8_t*)image, offsetof(keymapImage, crc))) {
+        return false;
+    }
+
+    for (uint8_t n = 0; n < image->numlayers; n++) {
+        for (uint8_t j = 0; j < NUM_DOWN; j++) {
+            for (uint8_t i = 0; i < NUM_ACROSS; i++) {
+                uint8_t k = image->keymap[n][j][i];
+                if (k == KEY_TRANSPARENT && n == 0) {
+                    return false; // nothing below the base layer
+                }
+                if (isLayerKey(k) && ((k - KEY_LAYER_MOMENTARY(0)) % MAX_LAYERS == 0 || (k - KEY_LAYER_MOMENTARY(0)) % MAX_LAYERS >= image->numlayers)) {
+                    return false; // layer keys must go to a layer above 0 that exists
+                }
+            }
+        }
+    }
+
+    for (uint8_t c = 0; c < image->numspecials; c++) {
+        const specialEntry *s = &image->specials[c];
+        if (s->across >= NUM_ACROSS || s->down >= NUM_DOWN || s->type > SPECIAL_COMBO || s->length > SPECIAL_MAX_LENGTH) {
+            return false;
+        }
+        if (s->twokey && (s->across2 >= NUM_ACROSS || s->down2 >= NUM_DOWN)) {
+            return false;
+        }
+        if ((s->type == SPECIAL_MACRO || s->type == SPECIAL_MACRO_RECORD || s->type == SPECIAL_MACRO_SELECT) &&
+                (s->length < 1 || s->topress[0] < 1 || s->topress[0] > NUM_MACROS)) {
+            return false; // the macro number is used as an index
+        }
+        if (s->type == SPECIAL_TAP_HOLD && (s->twokey || s->length < 4 || s->topress[0] == HID_KEY_NONE || s->topress[0] >= KEY_TRANSPARENT ||
+                s->topress[1] == HID_KEY_NONE || s->topress[1] >= KEY_TRANSPARENT)) {
+            return false; // tap and hold have to be keys the computer knows
+        }
+        if (s->type == SPECIAL_COMBO && (!s->twokey || s->length < 2 || s->topress[0] == HID_KEY_NONE || s->topress[0] >= KEY_TRANSPARENT)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+activeKeymap KeymapStore::current() {
+    uint8_t b = activebuffer; // read once, so both halves are from the same copy
+    __mem_fence_acquire();
+    return {&buffers[b].image, packed[b]};
+}
+
+keymapImage* KeymapStore::stage() {
+    if (swappending) {
+        return NULL;
+    }
+    keymapImage *staged = &buffers[activebuffer ^ 1].image;
+    memcpy(staged, active(), sizeof(keymapImage));
+    return staged;
+}
+
+bool KeymapStore::commit() {
+    if (swappending) {
+        return false;
+    }
+    keymapImage *staged = &buffers[activebuffer ^ 1].image;
+    staged->crc = crc32((const uint8_t*)staged, offsetof(keymapImage, crc));
+    if (!validate(staged)) {
+        return false;
+    }
+    pack(activebuffer ^ 1);
+    __mem_fence_release(); // make sure the whole image is written before core1 can see it
+    swappending = true;
+    return true;
+}
+
+bool KeymapStore::swap() {
+    if (!swappending) {
+        return false;
+    }
+    __mem_fence_acquire();
+    activebuffer ^= 1;
+    __mem_fence_release();
+    swappending = false;
+    return true;
+}
+
+bool KeymapStore::save() {
+    if (swappending) {
+        return false;
+    }
+    // nothing can run from flash while it's being written, so core1 is paused
+    // and interrupts are off (this takes some tens of ms for the erase)
+    multicore_lockout_start_blocking();
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_erase(KEYMAP_FLASH_OFFSET, FLASH_SECTOR_SIZE);
+    flash_range_program(KEYMAP_FLASH_OFFSET, buffers[activebuffer].bytes, KEYMAP_BUFFER_SIZE);
+    restore_interrupts(ints);
+    multicore_lockout_end_blocking();
+    return memcmp((const void*)(XIP_BASE + KEYMAP_FLASH_OFFSET), active(), sizeof(keymapImage)) == 0;
+}
+
+uint32_t KeymapStore::crc32(const uint8_t *data, uint32_t length) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint32_t c = 0; c < length; c++) {
+        crc ^= data[c];
+        for (uint8_t b = 0; b < 8; b++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+KeymapStore Keymaps;
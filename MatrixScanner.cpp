@@ -34,72 +34,286 @@
 #include "pico/sync.h"
 #include "pico/time.h"
 #include "hardware/gpio.h"
+#include "hardware/sync.h"
 
 #include "MatrixScanner.h"
 #include "KeyboardLayout.h"
+#include "KeymapStore.h"
+#include "MatrixStream.h"
+#include "FlightRecorder.h"
+#include "ReportBuilder.h"
 
-// debounce delay (ms)
-#define DEBOUNCE_DELAY 5
-
-MatrixScanner::MatrixScanner() {
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+MatrixScanner<NumDown, NumAcross, PinMap>::MatrixScanner(const uint8_t l[NumDown][NumAcross]) : layout(l) {
 }
 
-void MatrixScanner::begin() {
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::begin() {
     // Initise GPIO pins
     // Send pins
-    for (uint8_t i = 0; i < NUM_ACROSS; i++) {
-        gpio_init(across[i]);
-        setpininput(across[i]);
+    for (uint8_t i = 0; i < NumAcross; i++) {
+        gpio_init(PinMap::across[i]);
+        setpininput(PinMap::across[i]);
     }
-    sleep_ms(2);
     // Read pins
-    for (uint8_t i = 0; i < NUM_DOWN; i++) {
-        gpio_init(down[i]);
-        setpininput(down[i]);
+    for (uint8_t i = 0; i < NumDown; i++) {
+        gpio_init(PinMap::down[i]);
+        setpininput(PinMap::down[i]);
     }
-    sleep_ms(2);
+    // no need to wait for the pins to settle here, the pull downs take effect
+    // well within the settle delay of the first column scanned
+
+    resetState();
+    clearKeyStats();
+
+    // setup for running on the second core
+    mutex_init(&mx1);
+    watchscans = scancount;
+    watchtime = watchlast = time_us_32();
+    multicore_launch_core1(core1_entry);
+}
 
-    // Initialise variables for detecting key press
-    for (uint8_t i = 0; i < NUM_ACROSS; i++) {
-        for (uint8_t j = 0; j < NUM_DOWN; j++) {
+// Initialise variables for detecting key press
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::resetState() {
+    for (uint8_t i = 0; i < NumAcross; i++) {
+        for (uint8_t j = 0; j < NumDown; j++) {
             pinstate[j][i] = 0;
             lastpinstate[j][i] = 0;
             lastpinchangetime[j][i] = 0;
+            keycodes[j][i] = HID_KEY_NONE;
+            resolvedstate[j][i] = 0;
+            waiting[j][i] = 0;
         }
+        debounced[i] = 0;
+        raw[i] = 0;
+        ghosted[i] = 0;
     }
-    sleep_ms(2);
+    layers.reset();
+    Reports.reset();
+}
 
-    // setup for running on the second core
+// core0 checks core1 is still getting through scans, scancount is the heartbeat
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+bool MatrixScanner<NumDown, NumAcross, PinMap>::stalled() {
+    uint32_t now = time_us_32();
+    uint32_t scans = scancount;
+    if (parked || parkrequested) { // not scanning on purpose
+        watchscans = scans;
+        watchtime = now;
+    }
+    else if (scans != watchscans) {
+        watchscans = scans;
+        watchtime = now;
+    }
+    else if (now - watchlast > SCAN_DEADLINE*1000/2) {
+        // core0 has been busy elsewhere (e.g. writing flash, which pauses core1)
+        // so it can't say how long core1 has really been stuck, start again
+        watchtime = now;
+    }
+    watchlast = now;
+    return now - watchtime > SCAN_DEADLINE*1000;
+}
+
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::requestPark(bool park) {
+    parkrequested = park;
+    if (!park) {
+        __sev(); // core1 waits for an event, wake it up to notice
+    }
+}
+
+// with every column driven high, pressing any key will pull its row high, so
+// instead of scanning core1 can sleep until there's a rising edge on a row
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::park() {
+    parked = true;
+    for (uint8_t i = 0; i < NumAcross; i++) {
+        gpio_disable_pulls(PinMap::across[i]); // or each column wastes current into its pull down
+        gpio_set_dir(PinMap::across[i], GPIO_OUT);
+        gpio_put(PinMap::across[i], 1);
+    }
+    sleep_us(settledelay);
+
+    // keys already held down don't count, only new presses
+    for (uint8_t j = 0; j < NumDown; j++) {
+        gpio_set_irq_enabled_with_callback(PinMap::down[j], GPIO_IRQ_EDGE_RISE, true, matrix_wake_callback);
+    }
+    while (parkrequested && !keywake) {
+        __wfe(); // the GPIO interrupt or __sev() from core0
+    }
+    for (uint8_t j = 0; j < NumDown; j++) {
+        gpio_set_irq_enabled(PinMap::down[j], GPIO_IRQ_EDGE_RISE, false);
+    }
+
+    for (uint8_t i = 0; i < NumAcross; i++) {
+        setpininput(PinMap::across[i]);
+    }
+    parked = false;
+}
+
+// reset core1 and start scanning again from nothing pressed, whatever it was
+// doing. the main loop needs to release everything on the computer
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::restart() {
+    multicore_reset_core1();
+    restarts++;
+    Recorder.record(EVENT_CORE1_RESTART, restarts & 0xFF, scancount & 0xFF);
+
+    // core1 could have been stopped part way through a column, or while it
+    // had a spin lock, the mutex's or one of the SDK's (sleep_us sets a timer
+    // alarm under the timer lock and the alarm pool's, which is one of the
+    // striped ones like the mutex's). core0 only takes these inside critical
+    // sections it's not in now, so they're all let go of or core0 would hang
+    // on them. whatever they were protecting could still be half updated, a
+    // restart can't fix that, if core1 gets stuck again the watchdog resets
+    // everything (see RESTART_HOLDOFF)
+    for (uint8_t i = 0; i < NumAcross; i++) {
+        setpininput(PinMap::across[i]);
+    }
+    spin_unlock_unsafe(mx1.core.spin_lock);
+    spin_unlock_unsafe(spin_lock_instance(PICO_SPINLOCK_ID_TIMER));
+    for (uint8_t c = PICO_SPINLOCK_ID_STRIPED_FIRST; c <= PICO_SPINLOCK_ID_STRIPED_LAST; c++) {
+        spin_unlock_unsafe(spin_lock_instance(c));
+    }
     mutex_init(&mx1);
+    resetState();
+
+    watchscans = scancount;
+    watchtime = watchlast = time_us_32();
     multicore_launch_core1(core1_entry);
 }
 
-void MatrixScanner::scan() {
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::scan() {
     uint64_t now;
-    bool temp;
 
     // loop through each send pin and then check each read pin
-    for (uint8_t i = 0; i < NUM_ACROSS; i++) {
+    for (uint8_t i = 0; i < NumAcross; i++) {
 
-        gpio_set_dir(across[i], GPIO_OUT);
-        gpio_put(across[i], 1);
-        sleep_us(30); // delay for changes to GPIO to settle
+        gpio_set_dir(PinMap::across[i], GPIO_OUT);
+        gpio_put(PinMap::across[i], 1);
+        sleep_us(settledelay); // delay for changes to GPIO to settle
         uint32_t readings = gpio_get_all();
-        setpininput(across[i]); // so that the send pin floats and won't cause a bus conflict
+        setpininput(PinMap::across[i]); // so that the send pin floats and won't cause a bus conflict
+
+        // pack the read pins into a byte of rows (see PinMap::extractRows) and only look
+        // at the rows that are different to their debounced state
+        uint8_t rows = PinMap::extractRows(readings);
+        uint8_t edges = rows ^ raw[i]; // for the flight recorder
+        raw[i] = rows;
+        uint8_t changed = rows ^ debounced[i];
+        if (changed == 0 && edges == 0) {
+            continue;
+        }
+
+        now = to_us_since_boot(get_absolute_time());
+        for (uint8_t j = 0; j < NumDown; j++) {
+            if (edges & (1 << j)) {
+                Recorder.record(EVENT_RAW, j, i, (rows >> j) & 1);
+            }
+            if (changed & (1 << j)) {
+                uint64_t since = now - lastpinchangetime[j][i];
+                if (since > (adaptive ? stats[j][i].debouncetime : debouncedelay*1000)) { // X ms debounce time
+                    debounced[i] ^= (1 << j);
+                    lastpinchangetime[j][i] = now;
+                    Recorder.record(EVENT_DEBOUNCE_ACCEPT, j, i, (rows >> j) & 1);
+                    keyAccepted(j, i, since < 0xFFFFFFFF ? since : 0xFFFFFFFF);
+                }
+                else if (edges & (1 << j)) {
+                    Recorder.record(EVENT_DEBOUNCE_REJECT, j, i, (rows >> j) & 1);
+                    keyRejected(j, i, since);
+                }
+            }
+        }
+    }
+}
 
-        for (uint8_t j = 0; j < NUM_DOWN; j++) {
-            now = to_us_since_boot(get_absolute_time());
-            temp = readings & (1 << down[j]);
+// a change got through debounce, since is how long after the last one
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::keyAccepted(uint8_t j, uint8_t i, uint32_t since) {
+    keyStats *s = &stats[j][i];
+    if (since < CHATTER_TIME) {
+        if (s->chatter < 0xFFFF) s->chatter++;
+        s->cleancount = 0;
+        if (adaptive) {
+            setKeyDebounce(j, i, s->debouncetime + DEBOUNCE_GROW);
+        }
+    }
+    else if (s->bounced) {
+        s->cleancount = 0;
+    }
+    else if (++s->cleancount >= DEBOUNCE_CLEAN_COUNT) { // a well behaved key can be quicker
+        s->cleancount = 0;
+        if (adaptive) {
+            setKeyDebounce(j, i, s->debouncetime - DEBOUNCE_SHRINK);
+        }
+    }
+    s->bounced = false;
+}
 
-           if (temp != pinstate[j][i] && (now - lastpinchangetime[j][i]) > DEBOUNCE_DELAY*1000) { // X ms debounce time
-                pinstate[j][i] = temp;
-                lastpinchangetime[j][i] = now;
+// a change was ignored because it was too soon after the last one
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::keyRejected(uint8_t j, uint8_t i, uint32_t since) {
+    keyStats *s = &stats[j][i];
+    if (s->rejected < 0xFFFF) s->rejected++;
+    uint8_t b = 0;
+    while (since > bouncebuckets[b] && b < BOUNCE_BUCKETS - 1) b++;
+    if (s->histogram[b] < 0xFFFF) s->histogram[b]++;
+    s->bounced = true;
+    // bouncing this late means next time it might get through
+    if (adaptive && since > s->debouncetime*3/4) {
+        setKeyDebounce(j, i, s->debouncetime + DEBOUNCE_GROW);
+    }
+}
+
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::setKeyDebounce(uint8_t j, uint8_t i, int32_t us) {
+    // the limits are read once so they can't change part way through
+    int32_t lo = debouncemin*1000, hi = debouncemax*1000;
+    us = us < lo ? lo : us > hi ? hi : us;
+    if (us != stats[j][i].debouncetime) {
+        stats[j][i].debouncetime = us;
+        Recorder.record(EVENT_DEBOUNCE_TIME, j, i, us / 500);
+    }
+}
+
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::setAdaptiveDebounce(bool on) {
+    if (on && !adaptive) { // start everything off from the fixed time
+        for (uint8_t i = 0; i < NumAcross; i++) {
+            for (uint8_t j = 0; j < NumDown; j++) {
+                setKeyDebounce(j, i, debouncedelay*1000);
             }
         }
     }
+    adaptive = on;
+}
+
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::setDebounceLimits(uint16_t minms, uint16_t maxms) {
+    debouncemin = minms;
+    debouncemax = maxms;
+    for (uint8_t i = 0; i < NumAcross; i++) {
+        for (uint8_t j = 0; j < NumDown; j++) {
+            setKeyDebounce(j, i, stats[j][i].debouncetime);
+        }
+    }
+}
+
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::clearKeyStats() {
+    for (uint8_t i = 0; i < NumAcross; i++) {
+        for (uint8_t j = 0; j < NumDown; j++) {
+            uint16_t t = stats[j][i].debouncetime; // the debounce time isn't a statistic
+            memset(&stats[j][i], 0, sizeof(keyStats));
+            stats[j][i].debouncetime = t ? t : debouncedelay*1000;
+        }
+    }
 }
 
-void MatrixScanner::preventGhosting() {
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::preventGhosting() {
     // do ghost detection, if there's a ghosted key detected that's newly pressed, ignore it
     // if there is ghosting, but the ghosted key is an impossible key (HID_KEY_NONE) allow it
 
@@ -117,40 +331,26 @@ void MatrixScanner::preventGhosting() {
     // there are some clever tricks we can use though. if there's no key switch at a 
     // location in the matrix, e.g. the 2 key didn't exist we would know it had to be 3
     // that was actually pressed. this, keys with no mapping should never be pressed
-    for (uint8_t i = 0; i < NUM_ACROSS; i++) {
-        for (uint8_t j = 0; j < NUM_DOWN; j++) {
-            if (pinstate[j][i] && keyboardlayout[j][i] == HID_KEY_NONE) {
-                pinstate[j][i] = 0;
-            }
+    // (ghosting is worked out fresh each scan starting from the debounced state)
+    for (uint8_t i = 0; i < NumAcross; i++) {
+        for (uint8_t j = 0; j < NumDown; j++) {
+            pinstate[j][i] = (debounced[i] & (1 << j)) && layout[j][i] != HID_KEY_NONE;
         }
     }
 
     // due to unfortanate matrixing, ctrl alt shift combos can result in ghosting. luckily,
     // since in almost all cases pressing one mod key means the other one wouldn't do anything,
     // we can ignore the second modifier that was pressed. this is needed to be able to do
-    // l_ctrl, l_alt, l_shift as a key combo
-    if (pinstate[7][0] && pinstate[0][3]) { // l_alt, r_alt
-        if (lastpinstate[7][0]) {
-            pinstate[0][3] = false;
-        }
-        else if (lastpinstate[0][3]) {
-            pinstate[7][0] = false;
-        }
-    }
-    if (pinstate[7][3] && pinstate[6][3]) { // l_shift, r_shift
-        if (lastpinstate[7][3]) {
-            pinstate[6][3] = false;
-        }
-        else if (lastpinstate[6][3]) {
-            pinstate[7][3] = false;
-        }
-    }
-    if (pinstate[0][0] && pinstate[7][2]) { // l_ctrl, r_ctrl
-        if (lastpinstate[0][0]) {
-            pinstate[7][2] = false;
-        }
-        else if (lastpinstate[7][2]) {
-            pinstate[0][0] = false;
+    // l_ctrl, l_alt, l_shift as a key combo (the pairs are listed in the board's .pins file)
+    for (uint8_t c = 0; c < PinMap::numghostpairs; c++) {
+        const uint8_t *p = PinMap::ghostpairs[c];
+        if (pinstate[p[0]][p[1]] && pinstate[p[2]][p[3]]) {
+            if (resolvedstate[p[0]][p[1]]) {
+                pinstate[p[2]][p[3]] = false;
+            }
+            else if (resolvedstate[p[2]][p[3]]) {
+                pinstate[p[0]][p[1]] = false;
+            }
         }
     }
 
@@ -158,49 +358,48 @@ void MatrixScanner::preventGhosting() {
 
     // now that the easy logical exclusions are done, check through each activated key to see if it's
     // a real key press or if it's been caused by ghosting
-    bool newpinstate[NUM_DOWN][NUM_ACROSS];
-    memcpy(newpinstate, pinstate, NUM_DOWN*NUM_ACROSS*sizeof(bool));
-    for (uint8_t i = 0; i < NUM_ACROSS; i++) {
-        for (uint8_t j = 0; j < NUM_DOWN; j++) {
+    bool newpinstate[NumDown][NumAcross];
+    memcpy(newpinstate, pinstate, NumDown*NumAcross*sizeof(bool));
+    for (uint8_t i = 0; i < NumAcross; i++) {
+        for (uint8_t j = 0; j < NumDown; j++) {
             if (pinstate[j][i]) {
-                k1.clear();
-                k2.clear();
+                uint8_t nk1 = 0, nk2 = 0;
                 // find other keys activated in the same row and column, to indicate where potential ghosting would be
-                for (uint8_t i2 = 0; i2 < NUM_ACROSS; i2++) {
+                for (uint8_t i2 = 0; i2 < NumAcross; i2++) {
                     if (pinstate[j][i2] && i2 != i) {
-                        k1.push_back(i2);
+                        k1[nk1++] = i2;
                     }
                 }
-                for (uint8_t j2 = 0; j2 < NUM_DOWN; j2++) {
+                for (uint8_t j2 = 0; j2 < NumDown; j2++) {
                     if (pinstate[j2][i] && j2 != j) {
-                        k2.push_back(j2);
+                        k2[nk2++] = j2;
                     }
                 }
 
                 // if there's nothing across on the same row there's definetely
                 // no ghosting, as ghosting is evidenced by 4 corners being
                 // highlighted
-                if (k1.size() == 0 || k2.size() == 0) {
+                if (nk1 == 0 || nk2 == 0) {
                     continue;
                 }
 
                 // need to check if all 4 corners are pressed for every possible
                 // combination of them
-                for (uint8_t i2 = 0; i2 < k1.size(); i2++) {
-                    for (uint8_t j2 = 0; j2 < k2.size(); j2++) {
+                for (uint8_t i2 = 0; i2 < nk1; i2++) {
+                    for (uint8_t j2 = 0; j2 < nk2; j2++) {
                         if (pinstate[j][i] && pinstate[k2[j2]][i] && pinstate[j][k1[i2]] && pinstate[k2[j2]][k1[i2]]) {
                             // 4 corners will register with three corners pressed, so 
                             // legitimately detecting this is impossible, definitely ghosting happening
-                            if (!lastpinstate[j][i]) {
+                            if (!resolvedstate[j][i]) {
                                 newpinstate[j][i] = 0;
                             }
-                            if (!lastpinstate[k2[j2]][i]) {
+                            if (!resolvedstate[k2[j2]][i]) {
                                 newpinstate[k2[j2]][i] = 0;
                             }
-                            if (!lastpinstate[j][k1[i2]]) {
+                            if (!resolvedstate[j][k1[i2]]) {
                                 newpinstate[j][k1[i2]] = 0;
                             }
-                            if (!lastpinstate[k2[j2]][k1[i2]]) {
+                            if (!resolvedstate[k2[j2]][k1[i2]]) {
                                 newpinstate[k2[j2]][k1[i2]] = 0;
                             }
                         }
@@ -213,43 +412,178 @@ void MatrixScanner::preventGhosting() {
             }
         }
     }
-    memcpy(pinstate, newpinstate, NUM_DOWN*NUM_ACROSS*sizeof(bool));
+
+    // a new key could be part of a box that hasn't all shown up yet, the
+    // columns are read one after another and the membrane doesn't always close
+    // all of it on the same scan. that's when there are other keys down in its
+    // row and its column, or there's a key down in its row or column that has
+    // another key down across from it. a key that was being ignored and isn't
+    // any more could be real, or it could be a ghost left over while the keys
+    // making the box are let go of. any of these has to stay down for a few
+    // scans to count
+    uint8_t inrow[NumDown], incolumn[NumAcross];
+    bool counted = false; // only worked out once there's a new key
+    for (uint8_t i = 0; i < NumAcross; i++) {
+        for (uint8_t j = 0; j < NumDown; j++) {
+            if (!newpinstate[j][i] || resolvedstate[j][i]) {
+                waiting[j][i] = 0;
+                continue;
+            }
+            if (!counted) {
+                memset(inrow, 0, sizeof(inrow));
+                memset(incolumn, 0, sizeof(incolumn));
+                for (uint8_t i2 = 0; i2 < NumAcross; i2++) {
+                    for (uint8_t j2 = 0; j2 < NumDown; j2++) {
+                        inrow[j2] += pinstate[j2][i2];
+                        incolumn[i2] += pinstate[j2][i2];
+                    }
+                }
+                counted = true;
+            }
+            bool unsure = (ghosted[i] & (1 << j)) || (inrow[j] > 1 && incolumn[i] > 1);
+            for (uint8_t j2 = 0; j2 < NumDown && !unsure; j2++) {
+                unsure = j2 != j && pinstate[j2][i] && inrow[j2] > 1;
+            }
+            for (uint8_t i2 = 0; i2 < NumAcross && !unsure; i2++) {
+                unsure = i2 != i && pinstate[j][i2] && incolumn[i2] > 1;
+            }
+            if (unsure && waiting[j][i] < GHOST_WAIT_SCANS) {
+                waiting[j][i]++;
+                newpinstate[j][i] = 0;
+            }
+        }
+    }
+    memcpy(pinstate, newpinstate, NumDown*NumAcross*sizeof(bool));
+
+    // keep track of what's being ignored (pressed, has a key switch, but taken
+    // out above) for the flight recorder and StateStream
+    for (uint8_t i = 0; i < NumAcross; i++) {
+        uint8_t g = 0;
+        for (uint8_t j = 0; j < NumDown; j++) {
+            if ((debounced[i] & (1 << j)) && layout[j][i] != HID_KEY_NONE && !pinstate[j][i]) {
+                g |= (1 << j);
+            }
+        }
+        if (g != ghosted[i]) {
+            for (uint8_t j = 0; j < NumDown; j++) {
+                if ((g ^ ghosted[i]) & (1 << j)) {
+                    Recorder.record(EVENT_GHOST, j, i, (g >> j) & 1);
+                }
+            }
+            ghosted[i] = g;
+        }
+    }
+}
+
+// look up what newly pressed keys do in the active layers of the keymap, the
+// result is kept until the key is released again so layer changes in between
+// won't leave anything stuck down
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::resolveKeys() {
+    for (uint8_t i = 0; i < NumAcross; i++) {
+        for (uint8_t j = 0; j < NumDown; j++) {
+            if (pinstate[j][i] != resolvedstate[j][i]) {
+                resolvedstate[j][i] = pinstate[j][i];
+                if (pinstate[j][i]) {
+                    keycodes[j][i] = layers.press(j, i);
+                }
+                else {
+                    layers.release(keycodes[j][i]);
+                }
+                Reports.keyChanged(j, i, pinstate[j][i], keycodes[j][i]);
+            }
+        }
+    }
+}
+
+// record the columns that have changed since they were last streamed, does
+// nothing unless the host has asked for the stream
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::streamChanges() {
+    if (StateStream.isEnabled()) {
+        bool all = StateStream.takeSnapshot();
+        for (uint8_t i = 0; i < NumAcross; i++) {
+            if (all || raw[i] != streamed[i][0] || debounced[i] != streamed[i][1] || ghosted[i] != streamed[i][2]) {
+                StateStream.record(scancount, i, raw[i], debounced[i], ghosted[i]);
+                streamed[i][0] = raw[i];
+                streamed[i][1] = debounced[i];
+                streamed[i][2] = ghosted[i];
+            }
+        }
+    }
+    StateStream.flush(time_us_32());
 }
 
 // the main loop uses this to copy the state of the matrix and check if it's changed
-bool MatrixScanner::getPinState(bool outpinstate[NUM_DOWN][NUM_ACROSS], bool outlastpinstate[NUM_DOWN][NUM_ACROSS]) {
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+bool MatrixScanner<NumDown, NumAcross, PinMap>::getPinState(bool outpinstate[NumDown][NumAcross], bool outlastpinstate[NumDown][NumAcross], uint8_t outkeycodes[NumDown][NumAcross]) {
     // a mutex is used here to lockout changes to pinstate and lastpinstate so that
     // we don't try and update in the middle of scanning
     bool locked = mutex_enter_timeout_ms(&mx1, 1); // request lock
     if (locked) {
         // we got the lock so we can update
 
-        memcpy(outpinstate, pinstate, NUM_DOWN*NUM_ACROSS*sizeof(bool));
-        memcpy(outlastpinstate, lastpinstate, NUM_DOWN*NUM_ACROSS*sizeof(bool));
+        memcpy(outpinstate, pinstate, NumDown*NumAcross*sizeof(bool));
+        memcpy(outlastpinstate, lastpinstate, NumDown*NumAcross*sizeof(bool));
+        memcpy(outkeycodes, keycodes, NumDown*NumAcross*sizeof(uint8_t));
+        Reports.snapshot(); // which of these core1 has already sent
 
         // the pin state has been fetched meaning changes have officially been registered
         // thus, the current pinstate is now the former pinstate
-        memcpy(lastpinstate, pinstate, NUM_DOWN*NUM_ACROSS*sizeof(bool));
+        memcpy(lastpinstate, pinstate, NumDown*NumAcross*sizeof(bool));
 
         mutex_exit(&mx1); // unlock
     }
+    else {
+        lockmisses++;
+        Recorder.record(EVENT_LOCK_MISS);
+    }
     return locked;
 }
 
 // set the pin to input so that it doesn't "drive the bus"
-void MatrixScanner::setpininput(uint8_t pin) {
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
+void MatrixScanner<NumDown, NumAcross, PinMap>::setpininput(uint8_t pin) {
     gpio_set_dir(pin, GPIO_IN);
     gpio_pull_down(pin);
 }
 
-MatrixScanner KeyMatrix;
+// only the board being built for is instantiated, with its own unrolled scan and ghosting
+template class MatrixScanner<NUM_DOWN, NUM_ACROSS, BoardPinMap>;
+
+BoardMatrixScanner KeyMatrix(keymap[0]);
 
 void core1_entry() {
+    // let core0 pause this core while it writes to flash
+    multicore_lockout_victim_init();
+    KeyMatrix.setLayout(Keymaps.active()->keymap[0]);
+    Reports.keymapChanged();
+
     while (1) {
         mutex_enter_blocking(KeyMatrix.getMutex()); // lock
+        uint32_t start = time_us_32();
+        if (Keymaps.swap()) { // a new keymap was committed, switch to it between scans
+            KeyMatrix.setLayout(Keymaps.active()->keymap[0]);
+            Reports.keymapChanged();
+            Recorder.record(EVENT_KEYMAP_SWAP);
+        }
         KeyMatrix.scan();
         KeyMatrix.preventGhosting();
+        KeyMatrix.streamChanges();
+        KeyMatrix.resolveKeys();
+        Reports.publish(); // plain keys go straight out (see ReportBuilder)
+        KeyMatrix.countScan(time_us_32() - start);
         mutex_exit(KeyMatrix.getMutex()); // unlock
-        sleep_us(100);
+        if (KeyMatrix.parkRequested()) { // the computer is asleep (see PowerHandler)
+            KeyMatrix.park();
+        }
+        sleep_us(KeyMatrix.getScanInterval());
     }
 }
+
+// the GPIO interrupt on core1 while parked
+void matrix_wake_callback(uint gpio, uint32_t events) {
+    (void) gpio;
+    (void) events;
+    KeyMatrix.wakeFromPark();
+}
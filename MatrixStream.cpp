@@ -0,0 +1,125 @@
+/*
+ * MatrixStream.cpp - raw, debounced, and ghosting state of the matrix sent to the
+ *                    host as it changes, for diagnosing misbehaving keys
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <cstring>
+
+#include "pico/time.h"
+#include "hardware/sync.h"
+
+#include "MatrixStream.h"
+
+MatrixStream::MatrixStream() {
+}
+
+void MatrixStream::enable(bool on) {
+    if (on && !enabled) {
+        snapshot = true; // start the host off with the whole matrix
+    }
+    enabled = on;
+    if (!on) {
+        tail = head; // anything not sent yet is dropped
+    }
+}
+
+const uint8_t* MatrixStream::peek() {
+    if (tail == head) {
+        return NULL;
+    }
+    __mem_fence_acquire(); // see the packet as it was when head moved past it
+    return slots[tail];
+}
+
+void MatrixStream::release() {
+    tail = (tail + 1) % STREAM_SLOTS;
+}
+
+bool MatrixStream::takeSnapshot() {
+    if (!snapshot) {
+        return false;
+    }
+    snapshot = false;
+    return true;
+}
+
+void MatrixStream::record(uint32_t scan, uint8_t column, uint8_t raw, uint8_t debounced, uint8_t ghosted) {
+    // the scan offset in a record is a byte, so a long gap starts a new packet
+    if (filling != NULL && scan - fillingscan > 255) {
+        publish();
+    }
+    if (filling == NULL) {
+        if ((head + 1) % STREAM_SLOTS == tail) { // full, core0 hasn't caught up
+            lost = true;
+            lostrecords++;
+            snapshot = true;
+            return;
+        }
+        filling = slots[head];
+        memset(filling, 0, VENDOR_REPORT_SIZE);
+        filling[0] = VENDOR_STREAM_DATA;
+        filling[1] = sequence++;
+        for (uint8_t c = 0; c < 4; c++) {
+            filling[2 + c] = (scan >> (8*c)) & 0xFF;
+        }
+        filling[6] = lost ? STREAM_LOST : 0;
+        lost = false;
+        fillingscan = scan;
+        fillingtime = time_us_32();
+    }
+
+    uint8_t count = filling[6] & ~STREAM_LOST;
+    uint8_t *r = &filling[STREAM_HEADER_SIZE + count*STREAM_RECORD_SIZE];
+    r[0] = scan - fillingscan;
+    r[1] = column;
+    r[2] = raw;
+    r[3] = debounced;
+    r[4] = ghosted;
+    filling[6]++;
+    if (count + 1 == STREAM_RECORDS) {
+        publish();
+    }
+}
+
+void MatrixStream::flush(uint32_t now) {
+    if (filling == NULL) {
+        return;
+    }
+    if (!enabled) {
+        filling = NULL; // turned off part way through
+    }
+    else if (now - fillingtime > STREAM_FLUSH_TIME) {
+        publish();
+    }
+}
+
+void MatrixStream::publish() {
+    __mem_fence_release(); // the packet has to be written before core0 can see it
+    head = (head + 1) % STREAM_SLOTS;
+    filling = NULL;
+}
+
+MatrixStream StateStream;
@@ -0,0 +1,208 @@
+/*
+ * PowerHandler.cpp - low power while the computer is asleep, and waking it up
+ *                    again when a key is pressed
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "usb.h"
+#include "Adafruit_TinyUSB.h"
+
+#include "pico/time.h"
+#include "hardware/clocks.h"
+#include "hardware/pll.h"
+#include "hardware/sync.h"
+#include "hardware/vreg.h"
+
+#include "PowerHandler.h"
+#include "MatrixScanner.h"
+#include "RGBHandler.h"
+#include "FlightRecorder.h"
+
+// the flash is clocked from clk_sys too, it has to stay inside what the chip is rated for
+#ifdef PICO_FLASH_SPI_CLKDIV
+static_assert(FAST_CLOCK_KHZ / PICO_FLASH_SPI_CLKDIV <= 133000, "FAST_CLOCK_KHZ is too fast for the flash");
+#endif
+
+static const clockProfileDefinition profiles[CLOCK_PROFILE_COUNT] = {
+    {LOW_CLOCK_KHZ, VREG_VOLTAGE_DEFAULT},
+    {NORMAL_CLOCK_KHZ, VREG_VOLTAGE_DEFAULT},
+    {FAST_CLOCK_KHZ, FAST_CLOCK_VOLTAGE}
+};
+
+PowerHandler::PowerHandler() {
+}
+
+void PowerHandler::begin() {
+    uint vco, postdiv1, postdiv2;
+    for (uint8_t c = 0; c < CLOCK_PROFILE_COUNT; c++) {
+        available[c] = c == CLOCK_NORMAL || check_sys_clock_khz(profiles[c].khz, &vco, &postdiv1, &postdiv2);
+    }
+    profile = CLOCK_NORMAL;
+}
+
+void PowerHandler::task() {
+    if (wakingup) {
+        // give the computer a while to resume, if it doesn't go back to sleep
+        if (!hostsuspended || to_us_since_boot(get_absolute_time()) - wakeuptime > WAKEUP_TIMEOUT*1000) {
+            wakingup = false;
+        }
+        return;
+    }
+
+    if (hostsuspended && !suspended) {
+        enterSuspend();
+    }
+    else if (!hostsuspended && suspended) {
+        exitSuspend();
+    }
+    else if (suspended && KeyMatrix.takeKeyWake()) {
+        Recorder.record(EVENT_KEY_WAKE, remotewakeup);
+        if (remotewakeup) {
+            TinyUSBDevice.remoteWakeup();
+            keywakes++;
+            exitSuspend();
+            wakingup = true;
+            wakeuptime = to_us_since_boot(get_absolute_time());
+        }
+        // otherwise core1 parks again after scanning once
+    }
+
+    if (!suspended) {
+        governor();
+    }
+}
+
+void PowerHandler::activity() {
+    uint64_t now = to_us_since_boot(get_absolute_time());
+    lastactivity = now;
+    if (now - burststart > BURST_WINDOW*1000) {
+        burststart = now;
+        burstcount = 0;
+    }
+    if (burstcount < BURST_KEYS) {
+        burstcount++;
+    }
+    if (burstcount >= BURST_KEYS) {
+        fastuntil = now + FAST_HOLD*1000;
+    }
+}
+
+void PowerHandler::boost() {
+    fastuntil = to_us_since_boot(get_absolute_time()) + FAST_HOLD*1000;
+    if (!suspended) {
+        governor();
+    }
+}
+
+// going up is straight away, going down waits for the keyboard to be quiet
+void PowerHandler::governor() {
+    uint64_t now = to_us_since_boot(get_absolute_time());
+    clockProfile target = CLOCK_NORMAL;
+    if (governing && (busy || now < fastuntil)) {
+        target = CLOCK_FAST;
+    }
+    else if (governing && now - lastactivity > IDLE_TIMEOUT*1000) {
+        target = CLOCK_LOW;
+    }
+    if (!available[target]) {
+        target = CLOCK_NORMAL;
+    }
+
+    if (target != profile && !setProfile(target)) {
+        available[target] = false;
+    }
+}
+
+bool PowerHandler::setProfile(clockProfile to) {
+    const clockProfileDefinition *oldp = &profiles[profile], *newp = &profiles[to];
+
+    // the voltage goes up before the clock does and down after
+    enum vreg_voltage voltage = oldp->voltage;
+    if (newp->voltage > voltage) {
+        voltage = newp->voltage;
+        vreg_set_voltage(voltage);
+        busy_wait_us_32(VREG_SETTLE_US);
+    }
+
+    // nothing else on this core gets a look in while the LED's PIO is running
+    // at the wrong speed
+    uint32_t ints = save_and_disable_interrupts();
+    RGB.flush();
+    bool ok = set_sys_clock_khz(newp->khz, false);
+    RGB.clockChanged();
+    restore_interrupts(ints);
+
+    // make sure it's actually running at the new speed (the counter is
+    // accurate to a few kHz)
+    if (ok) {
+        uint32_t measured = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_SYS);
+        ok = measured + newp->khz/100 >= newp->khz && measured <= newp->khz + newp->khz/100;
+        if (!ok) {
+            ints = save_and_disable_interrupts();
+            RGB.flush();
+            set_sys_clock_khz(oldp->khz, true);
+            RGB.clockChanged();
+            restore_interrupts(ints);
+        }
+    }
+
+    if (ok) {
+        profile = to;
+        clockchanges++;
+    }
+    if (profiles[profile].voltage != voltage) {
+        vreg_set_voltage(profiles[profile].voltage);
+    }
+    Recorder.record(EVENT_CLOCK, to, profiles[to].khz / 1000, ok);
+    return ok;
+}
+
+void PowerHandler::enterSuspend() {
+    suspended = true;
+    suspends++;
+    RGB.suspend();
+    KeyMatrix.requestPark(true);
+
+    // clk_peri runs straight off the system PLL, move it over first
+    clock_configure(clk_peri, 0, CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB, 48*MHZ, 48*MHZ);
+    clock_configure(clk_sys, CLOCKS_CLK_SYS_CTRL_SRC_VALUE_CLKSRC_CLK_SYS_AUX, CLOCKS_CLK_SYS_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB,
+            48*MHZ, SUSPEND_CLOCK_KHZ*KHZ);
+    pll_deinit(pll_sys);
+    vreg_set_voltage(VREG_VOLTAGE_DEFAULT);
+}
+
+void PowerHandler::exitSuspend() {
+    // starts the system PLL again and puts clk_sys and clk_peri back on it, the
+    // timer runs from clk_ref so sleeps and timestamps aren't affected
+    set_sys_clock_khz(NORMAL_CLOCK_KHZ, true);
+    profile = CLOCK_NORMAL;
+    lastactivity = to_us_since_boot(get_absolute_time());
+    RGB.clockChanged(); // from whichever profile it was on before suspending
+    RGB.resume();
+    KeyMatrix.requestPark(false);
+    suspended = false;
+}
+
+PowerHandler Power;
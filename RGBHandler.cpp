@@ -26,36 +26,118 @@
  *
  */
 
+#include <cstring>
+
 #include "pico/time.h"
 #include "hardware/pio.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
 #include "ws2812.pio.h"
 
 #include "USBKeyboard.h"
 #include "RGBHandler.h"
 
+// gamma 2.2, round(255*(i/255)^2.2), so fades and breathing look even
+static const uint8_t gamma8[256] = {
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+      3,   3,   3,   3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+      6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  11,  11,  11,  12,
+     12,  13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+     20,  20,  21,  22,  22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+     30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,  39,  39,  40,  41,
+     42,  43,  43,  44,  45,  46,  47,  48,  49,  49,  50,  51,  52,  53,  54,  55,
+     56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+     73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,  87,  88,  89,  90,
+     91,  93,  94,  95,  97,  98,  99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+    113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+    137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+    163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+    192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+    223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255,
+};
+
 RGBHandler::RGBHandler() {
 }
 
 void RGBHandler::begin() {
     // register and init ws2812 pio program (see pico-examples)
     uint offset = pio_add_program(LED_PIO, &ws2812_program);
-    ws2812_program_init(LED_PIO, LED_SM, offset, WS2812_PIN, 800000, IS_RGBW);
+    ws2812_program_init(LED_PIO, LED_SM, offset, WS2812_PIN, WS2812_FREQ, IS_RGBW);
+
+    // the DMA writes a frame a word at a time into the PIO's FIFO, as fast as
+    // the PIO takes them
+    dmachannel = dma_claim_unused_channel(true);
+    dma_channel_config c = dma_channel_get_default_config(dmachannel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, pio_get_dreq(LED_PIO, LED_SM, true));
+    dma_channel_configure(dmachannel, &c, &LED_PIO->txf[LED_SM], dmabuffer, NUM_PIXELS, false);
+
+    // start with LED off to avoid
+    memset(framebuffer, 0, sizeof(framebuffer));
+    show();
 
     // timer for udating the RGB nicely
-    add_repeating_timer_ms(10, RGBloopTask, NULL, &RGBtimer);
+    add_repeating_timer_ms(RGB_TICK, RGBloopTask, NULL, &RGBtimer);
+}
+
+// the copy is a few cycles a pixel, which is nothing next to the 30 us each
+// takes to go down the strip, and leaves the framebuffer free to draw in
+bool RGBHandler::show() {
+    if (dma_channel_is_busy(dmachannel) || time_us_32() - laststart < FRAME_US) {
+        return false;
+    }
+    memcpy(dmabuffer, framebuffer, sizeof(dmabuffer));
+    laststart = time_us_32();
+    dma_channel_set_read_addr(dmachannel, dmabuffer, true);
+    return true;
+}
+
+void RGBHandler::suspend() {
+    cancel_repeating_timer(&RGBtimer);
+    flush();
+    memset(framebuffer, 0, sizeof(framebuffer));
+    show();
+    flush();
+    pio_sm_set_enabled(LED_PIO, LED_SM, false);
+    for (uint8_t c = 0; c < 3; c++) {
+        currentColor[c] = 0;
+        lastout[c] = 0;
+    }
+}
+
+void RGBHandler::resume() {
+    pio_sm_set_enabled(LED_PIO, LED_SM, true);
+    statuschanged = true;
+    add_repeating_timer_ms(RGB_TICK, RGBloopTask, NULL, &RGBtimer);
+}
+
+// this can be called with interrupts off so it busy waits, for up to FRAME_US
+void RGBHandler::flush() {
+    while (time_us_32() - laststart < FRAME_US) {
+        tight_loop_contents();
+    }
+}
 
-    put_pixel(0); // start with LED off to avoid
+// same divider as ws2812_program_init works out
+void RGBHandler::clockChanged() {
+    int cycles_per_bit = ws2812_T1 + ws2812_T2 + ws2812_T3;
+    pio_sm_set_clkdiv(LED_PIO, LED_SM, clock_get_hz(clk_sys) / ((float)WS2812_FREQ * cycles_per_bit));
+    pio_sm_clkdiv_restart(LED_PIO, LED_SM);
 }
 
-void RGBHandler::updateTargetColor(float r, float g, float b) {
+void RGBHandler::updateTargetColor(uint8_t r, uint8_t g, uint8_t b, rgbAnimation a) {
     targetColor[0] = r;
     targetColor[1] = g;
     targetColor[2] = b;
+    animation = a;
 }
 
-// this function is called by a timer to change the on-board LED to flash
-// differently depending on USB state and change it nicely
-bool RGBHandler::loopTask(repeating_timer_t *rt) {
+// the status LED shows the lock state, or if USB isn't set up yet, this is
+// only looked at when one of those changes
+void RGBHandler::updateStatus() {
     if (Keyboard.getNumLock() && !Keyboard.getCapsLock()) {
         setGreen();
     }
@@ -67,19 +149,53 @@ bool RGBHandler::loopTask(repeating_timer_t *rt) {
     }
     else {
         if ( !TinyUSBDevice.mounted() ) { // || !usb_hid.ready() ?
-            setBlue();
+            setBlue(ANIMATION_BREATHE);
         }
         else {
             setOrange();
         }
     }
+}
 
-    // smoothly change between current color and target color
-    for (uint8_t c; c < 3; c++) {
-        currentColor[c] += (targetColor[c] - currentColor[c]) / 5.0f;
+// this function is called by a timer to change the on-board LED to flash
+// differently depending on USB state and change it nicely. it's in an
+// interrupt, so it's all integer maths and the same amount of it every tick
+bool RGBHandler::loopTask(repeating_timer_t *rt) {
+    if (statuschanged) {
+        statuschanged = false;
+        updateStatus();
+    }
+
+    // smoothly change between current color and target color, the last bit
+    // of the way in one go so it gets there
+    for (uint8_t c = 0; c < 3; c++) {
+        int32_t diff = ((int32_t)targetColor[c] << 8) - currentColor[c];
+        int32_t step = diff >> FADE_SHIFT;
+        currentColor[c] += step != 0 ? step : diff;
+    }
+
+    // a triangle wave from BREATHE_MIN to 256
+    uint16_t scale = 256;
+    if (animation == ANIMATION_BREATHE) {
+        phase += BREATHE_STEP;
+        uint8_t p = phase >> 8;
+        uint8_t level = p < 128 ? p*2 : (255 - p)*2;
+        scale = BREATHE_MIN + ((level * (256 - BREATHE_MIN)) >> 8);
+    }
+
+    uint8_t out[3];
+    for (uint8_t c = 0; c < 3; c++) {
+        out[c] = gamma8[((uint32_t)currentColor[c] * scale) >> 16];
+    }
+    if (out[0] != lastout[0] || out[1] != lastout[1] || out[2] != lastout[2]) {
+        // note this is in g r b, not r g b because my dodgy led has r and g reversed
+        setPixel(0, out[1], out[0], out[2]);
+        if (show()) {
+            for (uint8_t c = 0; c < 3; c++) {
+                lastout[c] = out[c];
+            }
+        }
     }
-    // note this is in g r b, not r g b because my dodgy led has r and g reversed
-    put_pixel(urgb_u32(currentColor[1], currentColor[0], currentColor[2]));
 
     return true;
 }
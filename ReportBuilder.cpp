@@ -0,0 +1,139 @@
+/*
+ * ReportBuilder.cpp - keys that are only keys put into reports on core1, the
+ *                     rest left to the main loop
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <cstring>
+
+#include "usb.h"
+
+#include "hardware/sync.h"
+
+#include "ReportBuilder.h"
+#include "KeymapStore.h"
+
+ReportBuilder::ReportBuilder() {
+}
+
+void ReportBuilder::reset() {
+    keys.clear();
+    memset(fast, 0, sizeof(fast));
+    memset(fasttaken, 0, sizeof(fasttaken));
+    slowheld = 0;
+    changed = false;
+    slowchanges = 0;
+    slowtaken = 0;
+    slowdone = 0;
+    holding = false;
+    deciding = false;
+    head = 0;
+    tail = 0;
+}
+
+// KeyResolver finds tap-hold keys and combos by position, whatever the keymap
+// has there, so those positions can't ever be fast
+void ReportBuilder::keymapChanged() {
+    const keymapImage *image = Keymaps.active();
+    memset(resolved, 0, sizeof(resolved));
+    for (uint8_t c = 0; c < image->numspecials; c++) {
+        const specialEntry *s = &image->specials[c];
+        if (s->type == SPECIAL_TAP_HOLD || s->type == SPECIAL_COMBO) {
+            resolved[s->down][s->across] = true;
+            if (s->twokey) {
+                resolved[s->down2][s->across2] = true;
+            }
+        }
+    }
+}
+
+void ReportBuilder::keyChanged(uint8_t down, uint8_t across, bool pressed, uint8_t scancode) {
+    if (pressed) {
+        bool caughtup = slowdone == slowchanges;
+        __mem_fence_acquire(); // holding is set before slowdone moves on
+        fast[down][across] = scancode != 0xFF && !resolved[down][across] && slowheld == 0 && caughtup && !holding;
+    }
+    if (!fast[down][across]) {
+        if (pressed) {
+            slowheld++;
+        }
+        else if (slowheld > 0) {
+            slowheld--;
+        }
+        slowchanges++;
+        return;
+    }
+    if (scancode == HID_KEY_NONE || isLayerKey(scancode)) {
+        return; // layers are already taken care of, there's nothing to send
+    }
+    if (pressed) {
+        keys.press(scancode);
+    }
+    else {
+        keys.release(scancode);
+    }
+    changed = true;
+}
+
+void ReportBuilder::publish() {
+    if (!changed) {
+        return;
+    }
+    bool caughtup = slowdone == slowchanges;
+    __mem_fence_acquire(); // deciding is set before slowdone moves on
+    if (!caughtup || deciding) {
+        return; // something slow came first, it has to reach the host before this
+    }
+    if ((head + 1) % LIVE_SLOTS == tail) {
+        return; // full, core0 hasn't caught up, whatever's down goes after the next scan
+    }
+    keys.snapshot(&slots[head]);
+    __mem_fence_release(); // the keys have to be written before core0 can see them
+    head = (head + 1) % LIVE_SLOTS;
+    changed = false;
+    published++;
+}
+
+void ReportBuilder::snapshot() {
+    memcpy(fasttaken, fast, sizeof(fast));
+    slowtaken = slowchanges;
+}
+
+void ReportBuilder::slowDone() {
+    __mem_fence_release(); // so core1 sees holding and deciding first
+    slowdone = slowtaken;
+}
+
+bool ReportBuilder::take(keySnapshot *s) {
+    if (tail == head) {
+        return false;
+    }
+    __mem_fence_acquire(); // see the keys as they were when head moved past them
+    memcpy(s, &slots[tail], sizeof(keySnapshot));
+    tail = (tail + 1) % LIVE_SLOTS;
+    return true;
+}
+
+ReportBuilder Reports;
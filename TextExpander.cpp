@@ -0,0 +1,76 @@
+/*
+ * TextExpander.cpp - typing a trigger like ;fn replaces it with longer text
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "usb.h"
+
+#include "TextExpander.h"
+#include "TextQueue.h"
+
+static_assert(EXPANSION_MAX_STEPS <= TEXT_QUEUE_LENGTH, "an expansion doesn't fit in TextQueue");
+
+TextExpander::TextExpander() {
+}
+
+void TextExpander::keyChanged(uint8_t k, bool pressed) {
+    if (k >= HID_KEY_CONTROL_LEFT && k <= HID_KEY_GUI_RIGHT) {
+        if (pressed) {
+            modifiers |= 1 << (k - HID_KEY_CONTROL_LEFT);
+        }
+        else {
+            modifiers &= ~(1 << (k - HID_KEY_CONTROL_LEFT));
+        }
+        return;
+    }
+    if (!pressed) {
+        return;
+    }
+    // triggers are typed without shift, so ;FN or :fn aren't ;fn, and the
+    // other modifiers mean a shortcut
+    if (!enabled || modifiers) {
+        state = 0;
+        return;
+    }
+    // anything that isn't in a trigger (including backspace) goes back to the start
+    state = expansionnext[state][expansionsymbol[k]];
+    if (expansionmatch[state] != 0) {
+        expand(expansionmatch[state] - 1);
+        state = 0;
+    }
+}
+
+void TextExpander::expand(uint8_t n) {
+    const expansionDefinition *e = &expansions[n];
+    const uint8_t backspace = HID_KEY_BACKSPACE;
+    Typing.startJob();
+    for (uint8_t c = 0; c < e->triggerlength; c++) {
+        Typing.queueKeys(&backspace, 1);
+    }
+    Typing.queueText(e->text, e->length);
+    Typing.endJob();
+}
+
+TextExpander Expander;
@@ -0,0 +1,208 @@
+/*
+ * TextQueue.cpp - text and key presses typed out a report at a time from the
+ *                 main loop, alongside whatever is being typed live
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <cstring>
+
+#include "usb.h"
+
+#include "pico/time.h"
+
+#include "TextQueue.h"
+
+TextQueue::TextQueue() {
+}
+
+// this goes before the main loop's sendReport(), which sends whatever is set
+// up here along with any live typing, so there's a report of text each time
+// round and the main loop never waits for the computer any more than it did
+void TextQueue::task() {
+    if (!Keyboard.injectionSent()) {
+        // the main loop didn't send last time round (core1 had the mutex)
+        if (Keyboard.ready()) {
+            Keyboard.sendReport();
+        }
+        return;
+    }
+    if (!busy()) {
+        if (Keyboard.isInjecting()) {
+            Keyboard.endInjection(); // the user's modifiers go back with the next report
+        }
+        return;
+    }
+
+    textStep *s = &steps[first];
+    if (s->type == TEXT_DELAY) {
+        uint64_t now = to_us_since_boot(get_absolute_time());
+        if (waituntil == 0) {
+            waituntil = now + s->delay*1000ull;
+        }
+        if (now >= waituntil) {
+            waituntil = 0;
+            next();
+        }
+        return;
+    }
+
+    // nothing is typed while reports are being queued up for the computer
+    if (!Keyboard.ready()) {
+        return;
+    }
+    if (pressed) {
+        Keyboard.inject(NULL, 0, 0);
+        pressed = false;
+        if (done >= s->count) {
+            next();
+        }
+        return;
+    }
+    // no more than there's room for alongside the keys the user is holding,
+    // with every slot taken the text waits for one to be let go
+    uint8_t room = Keyboard.getFreeSlots();
+    if (room == 0) {
+        return;
+    }
+    uint8_t n = s->count - done < room ? s->count - done : room;
+    // a key the user is holding can't be pressed again until they let go of it
+    for (uint8_t c = 0; c < n; c++) {
+        if (Keyboard.isPressed(s->keys[done + c])) {
+            return;
+        }
+    }
+    Keyboard.inject(s->keys + done, n, s->modifiers);
+    done += n;
+    pressed = true;
+}
+
+// move on to the next step
+void TextQueue::next() {
+    first = (first + 1) % TEXT_QUEUE_LENGTH;
+    count--;
+    done = 0;
+}
+
+textStep* TextQueue::add() {
+    if (count == TEXT_QUEUE_LENGTH) {
+        jobfailed = true;
+        return NULL;
+    }
+    textStep *s = &steps[(first + count) % TEXT_QUEUE_LENGTH];
+    memset(s, 0, sizeof(textStep));
+    count++;
+    return s;
+}
+
+void TextQueue::startJob() {
+    jobstart = count;
+    jobfailed = false;
+}
+
+bool TextQueue::endJob() {
+    if (jobfailed) {
+        count = jobstart;
+    }
+    return !jobfailed;
+}
+
+void TextQueue::queueKeys(const uint8_t *k, uint8_t length) {
+    textStep *s = add();
+    if (s == NULL) {
+        return;
+    }
+    s->type = TEXT_KEYS;
+    for (uint8_t c = 0; c < length; c++) {
+        if (k[c] >= HID_KEY_CONTROL_LEFT && k[c] <= HID_KEY_GUI_RIGHT) {
+            s->modifiers |= 1 << (k[c] - HID_KEY_CONTROL_LEFT);
+        }
+        else if (k[c] != HID_KEY_NONE && s->count < MAX_KEYS) {
+            s->keys[s->count++] = k[c];
+        }
+    }
+}
+
+void TextQueue::queuePacked(const uint8_t *packed, size_t length) {
+    size_t pos = 0;
+    while (pos < length) {
+        uint8_t n = packed[pos] & ~TYPED_SHIFT;
+        if (n == 0 || n > MAX_KEYS || pos + 1 + n > length) {
+            break;
+        }
+        // a step for each key if packing has been turned off since this was packed
+        uint8_t each = USBKeyboard::getPacking() ? n : 1;
+        for (uint8_t c = 0; c < n; c += each) {
+            textStep *s = add();
+            if (s == NULL) {
+                return;
+            }
+            s->type = TEXT_KEYS;
+            s->modifiers = packed[pos] & TYPED_SHIFT ? 1 << (HID_KEY_SHIFT_LEFT - HID_KEY_CONTROL_LEFT) : 0;
+            s->count = each;
+            memcpy(s->keys, packed + pos + 1 + c, each);
+        }
+        pos += 1 + n;
+    }
+}
+
+void TextQueue::queueText(const char *text, size_t length) {
+    size_t pos = 0;
+    uint8_t k[MAX_KEYS], n;
+    bool shift = false;
+    while ((n = USBKeyboard::nextPacked(text, length, &pos, k, &shift)) > 0) {
+        textStep *s = add();
+        if (s == NULL) {
+            return;
+        }
+        s->type = TEXT_KEYS;
+        s->modifiers = shift ? 1 << (HID_KEY_SHIFT_LEFT - HID_KEY_CONTROL_LEFT) : 0;
+        s->count = n;
+        memcpy(s->keys, k, n);
+    }
+}
+
+void TextQueue::queueDelay(uint16_t ms) {
+    textStep *s = add();
+    if (s == NULL) {
+        return;
+    }
+    s->type = TEXT_DELAY;
+    s->delay = ms;
+}
+
+void TextQueue::cancel() {
+    if (!busy()) {
+        return;
+    }
+    count = 0;
+    done = 0;
+    waituntil = 0;
+    pressed = false;
+    // let go of anything still down and give the user their modifiers back,
+    // with the next report
+    Keyboard.endInjection();
+}
+
+TextQueue Typing;
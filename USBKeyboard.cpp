@@ -28,13 +28,19 @@
  */
 
 #include <algorithm>
+#include <cstring>
 
 #include "usb.h"
+
+#include "hardware/watchdog.h"
+
 //#include "Adafruit_USBD_CDC-stub.h"
-#include "Adafruit_TinyUSB_Arduino/src/Adafruit_TinyUSB.h"
+#include "Adafruit_TinyUSB.h"
 #include "USBKeyboard.h"
-
-#define MAX_KEYS 6
+#include "VendorHID.h"
+#include "FlightRecorder.h"
+#include "RGBHandler.h"
+#include "ReportBuilder.h"
 
 // we're going to present to the computer as both a keyboard and mouse (the latter so we can scroll)
 uint8_t const desc_hid_report[] =
@@ -62,12 +68,26 @@ void USBKeyboard::begin() {
     usb_hid.setReportCallback(NULL, hid_report_callback); // for status LEDs
 //    usb_hid.setBootProtocol(true); // we implement 6KRO, (but we don't play nice and allow multiple modifiers) so we probably shouldn't claim we're using boot protocol
     usb_hid.begin();
-    while ( !TinyUSBDevice.mounted() ) {
-        sleep_us(1000);
+    Vendor.begin(); // the configuration interface has to be added before mounting
+}
+
+void USBKeyboard::task() {
+    if (!TinyUSBDevice.mounted() || TinyUSBDevice.suspended()) {
+        return;
     }
+    if (mountedtime == 0) {
+        mountedtime = to_us_since_boot(get_absolute_time());
+    }
+    // one at a time, so the main loop never waits on the computer here
+    if (queuecount > 0 && usb_hid.ready()) {
+        send(&queue[queuefirst]);
+        queuefirst = (queuefirst + 1) % REPORT_QUEUE_LENGTH;
+        queuecount--;
+    }
+    publish();
 }
 
-void USBKeyboard::pressScancode(uint8_t k) {
+void keySet::press(uint8_t k) {
     if (k == HID_KEY_NONE) {
         return;
     }
@@ -76,25 +96,19 @@ void USBKeyboard::pressScancode(uint8_t k) {
         modifiers |= (1 << k); // store modifers in the format they'll be sent
     }
     else { // regular keys
-        // assume there is no overflowing
-        overflowing = false;
-        // put the pressed key at the start of keys
-        keys.insert(keys.begin(), k);
-        // this makes keys 7 long, if there is no overflowing then value at the end should be 0
-        if (keys[MAX_KEYS] == HID_KEY_NONE) {
-            // in which case remove that value so that keys is the correct length
-            while (keys.size() > MAX_KEYS) keys.pop_back();
-        }
-        else {
-            // if the key at the end isn't 0, we're overflowing and should report that
-            // we also shouldn't change keys anymore. releasing a key will remove it and
-            // and keys should shrink
-            overflowing = true;
+        if (count == MAX_HELD_KEYS) {
+            ignored++; // overflowing anyway, and the anti-ghosting won't let this many through
+            return;
         }
+        // put the pressed key at the start of keys, if there's more than fits
+        // in a report we're overflowing, releasing keys will bring it back down
+        memmove(keys + 1, keys, count);
+        keys[0] = k;
+        count++;
     }
 }
 
-void USBKeyboard::releaseScancode(uint8_t k) {
+void keySet::release(uint8_t k) {
     if (k == HID_KEY_NONE) {
         return;
     }
@@ -104,67 +118,285 @@ void USBKeyboard::releaseScancode(uint8_t k) {
     }
     else { // regular keys
         // remove the key wherever it is from keys, which will shrink keys
-        keys.erase(std::remove(keys.begin(), keys.end(), k), keys.end());
-
-        if (keys.size() > MAX_KEYS) {
-            // still overflowing :(
-            overflowing = true;
+        uint8_t n = 0;
+        for (uint8_t c = 0; c < count; c++) {
+            if (keys[c] != k) {
+                keys[n++] = keys[c];
+            }
         }
-        else {
-            // add back onto the end of keys to ensure it's the proper size
-            while (keys.size() < MAX_KEYS) keys.push_back(HID_KEY_NONE);
+        // what's left over is HID_KEY_NONE, so the start of keys is always a report
+        memset(keys + n, HID_KEY_NONE, count - n);
+        count = n;
+    }
+}
 
-            // yay we've released enough keys to not be overflowing,
-            // we can continue with normal operation
-            overflowing = false;
+void keySet::clear() {
+    memset(keys, HID_KEY_NONE, sizeof(keys));
+    count = 0;
+    modifiers = 0;
+}
+
+void keySet::snapshot(keySnapshot *s) {
+    s->modifiers = modifiers;
+    s->count = count;
+    memcpy(s->keys, keys, MAX_KEYS);
+}
+
+void USBKeyboard::pressScancode(uint8_t k) {
+    held.press(k);
+}
+
+void USBKeyboard::releaseScancode(uint8_t k) {
+    held.release(k);
+}
+
+// put together what core1 and core0 have down
+void USBKeyboard::build(keyboardReport *report) {
+    // while text is being typed the user's modifiers are left out, or
+    // holding ctrl would turn it into shortcuts
+    report->modifiers = injecting ? injectedmodifiers : (held.modifiers | live.modifiers);
+
+    // the typed keys first, then core1's, then core0's
+    uint8_t livecount = live.count < MAX_KEYS ? live.count : MAX_KEYS;
+    uint8_t n = 0;
+    for (uint8_t c = 0; c < injectedcount; c++) {
+        report->keys[n++] = injected[c];
+    }
+    for (uint8_t c = 0; c < livecount && n < MAX_KEYS; c++) {
+        if (std::find(injected, injected + injectedcount, live.keys[c]) == injected + injectedcount) {
+            report->keys[n++] = live.keys[c];
         }
     }
+    uint8_t pressed = live.count;
+    for (uint8_t c = 0; c < held.count; c++) {
+        if (std::find(live.keys, live.keys + livecount, held.keys[c]) != live.keys + livecount) {
+            continue; // down on both cores
+        }
+        pressed++;
+        if (n < MAX_KEYS && std::find(injected, injected + injectedcount, held.keys[c]) == injected + injectedcount) {
+            report->keys[n++] = held.keys[c];
+        }
+    }
+    // the typed keys push the user's out of the report, so they count too
+    for (uint8_t c = 0; c < injectedcount; c++) {
+        if (std::find(live.keys, live.keys + livecount, injected[c]) == live.keys + livecount &&
+            std::find(held.keys, held.keys + held.count, injected[c]) == held.keys + held.count) {
+            pressed++;
+        }
+    }
+    while (n < MAX_KEYS) {
+        report->keys[n++] = HID_KEY_NONE;
+    }
+
+    if (pressed > MAX_KEYS) {
+        // if too many keys are pressed, we need to send the overflow code
+        // https://wiki.osdev.org/USB_Human_Interface_Devices
+        memcpy(report->keys, overflow, MAX_KEYS);
+    }
+    injectedsent = true;
+}
+
+// core1's reports as soon as the computer can take them, so a key that's
+// only a key doesn't wait for the rest of the main loop or the matrix mutex
+void USBKeyboard::publish() {
+    keyboardReport report;
+    if (queuecount == 0 && TinyUSBDevice.mounted() && !TinyUSBDevice.suspended() &&
+            usb_hid.ready() && Reports.take(&live)) {
+        build(&report);
+        send(&report);
+    }
 }
 
 // send a message to the computer about what keys are currently pressed
 void USBKeyboard::sendReport() {
-    if ( TinyUSBDevice.suspended() )  {
-        TinyUSBDevice.remoteWakeup();
+    keyboardReport report;
+    // anything core1 has done goes first, in order, and already has
+    // everything from core0 with it
+    bool caughtup = false;
+    while (Reports.take(&live)) {
+        build(&report);
+        deliver(&report);
+        caughtup = true;
+    }
+    if (!caughtup) {
+        build(&report);
+        deliver(&report);
+    }
+}
+
+void USBKeyboard::deliver(const keyboardReport *report) {
+    // nothing can be sent before the computer has set up USB or while it's
+    // asleep (PowerHandler wakes it), and once it can anything from before
+    // then goes first
+    if (queuecount > 0 || !TinyUSBDevice.mounted() || TinyUSBDevice.suspended()) {
+        queueReport(report);
+        return;
     }
+
     while( !usb_hid.ready() ) {
+        if (!TinyUSBDevice.mounted() || TinyUSBDevice.suspended()) {
+            // it went to sleep while we were waiting, it won't be ready until it wakes
+            queueReport(report);
+            return;
+        }
+        watchdog_update(); // waiting on the computer isn't being stuck
         sleep_us(100);
     }
-    if (!overflowing) {
-        usb_hid.keyboardReport(RID_KEYBOARD, modifiers, keys.data());
+    send(report);
+    sleep_us(500);
+}
+
+// the endpoint has to be ready
+void USBKeyboard::send(const keyboardReport *report) {
+    usb_hid.keyboardReport(RID_KEYBOARD, report->modifiers, report->keys);
+    // the main loop sends the same report over and over, only changes are
+    // worth counting or taking up room in the flight recorder
+    if (memcmp(&lastsent, report, sizeof(keyboardReport)) != 0) {
+        bool overflowing = memcmp(report->keys, overflow, MAX_KEYS) == 0;
+        uint8_t n = MAX_KEYS - std::count(report->keys, report->keys + MAX_KEYS, HID_KEY_NONE);
+        overflowcount += overflowing;
+        Recorder.record(EVENT_REPORT, report->modifiers, report->keys[0], n | (overflowing << 7));
     }
-    else {
-        // if too many keys are pressed, we need to send the overflow code
-        // https://wiki.osdev.org/USB_Human_Interface_Devices
-        usb_hid.keyboardReport(RID_KEYBOARD, modifiers, (uint8_t*)overflow);
+    memcpy(&lastsent, report, sizeof(keyboardReport));
+    reportcount++;
+    // the empty reports the main loop sends from the start don't count
+    if (firstreporttime == 0 && (report->modifiers != 0 || report->keys[0] != HID_KEY_NONE)) {
+        firstreporttime = to_us_since_boot(get_absolute_time());
     }
-    sleep_us(500);
+}
+
+void USBKeyboard::queueReport(const keyboardReport *report) {
+    // the main loop sends a report every time round, only changes need keeping
+    const keyboardReport *last = queuecount > 0 ? &queue[(queuefirst + queuecount - 1) % REPORT_QUEUE_LENGTH] : &lastsent;
+    if (memcmp(last, report, sizeof(keyboardReport)) == 0) {
+        return;
+    }
+    if (queuecount == REPORT_QUEUE_LENGTH) {
+        // out of room, overwrite the newest so the last report is always the
+        // current state and nothing is left held down
+        memcpy(&queue[(queuefirst + queuecount - 1) % REPORT_QUEUE_LENGTH], report, sizeof(keyboardReport));
+        return;
+    }
+    memcpy(&queue[(queuefirst + queuecount) % REPORT_QUEUE_LENGTH], report, sizeof(keyboardReport));
+    queuecount++;
+}
+
+bool USBKeyboard::ready() {
+    return queuecount == 0 && TinyUSBDevice.mounted() && !TinyUSBDevice.suspended();
+}
+
+uint8_t USBKeyboard::getFreeSlots() {
+    uint8_t down = held.count + live.count;
+    return down < MAX_KEYS ? MAX_KEYS - down : 0;
+}
+
+bool USBKeyboard::isPressed(uint8_t k) {
+    uint8_t livecount = live.count < MAX_KEYS ? live.count : MAX_KEYS;
+    return held.contains(k) || std::find(live.keys, live.keys + livecount, k) != live.keys + livecount;
+}
+
+void USBKeyboard::inject(const uint8_t *k, uint8_t count, uint8_t modifiers) {
+    injectedcount = count < MAX_KEYS ? count : MAX_KEYS;
+    if (injectedcount > 0) {
+        memcpy(injected, k, injectedcount);
+    }
+    injectedmodifiers = modifiers;
+    injecting = true;
+    injectedsent = false;
+}
+
+void USBKeyboard::endInjection() {
+    injectedcount = 0;
+    injectedmodifiers = 0;
+    injecting = false;
+    injectedsent = false;
+}
+
+void USBKeyboard::releaseAll() {
+    held.clear();
+    memset(&live, 0, sizeof(live));
+    sendReport();
 }
 
 // see tinyusb hid.h
 uint8_t const conv_table[128][2] =  { HID_ASCII_TO_KEYCODE };
 
-// write out text through the keyboard
-void USBKeyboard::type(std::string line) {
-    uint8_t k;
+volatile bool USBKeyboard::packing = true;
 
-    for (int i = 0; i < line.length(); i++) {
-        if (line[i] > 127) {
-            // not valid ASCII
+// several characters can go in one report, as long as none of them need the
+// same key or a different shift. they're pressed in the order they are in
+// the report, so "continue" takes 4 reports (c o n t i pressed together and
+// released, then n u e) rather than 16
+uint8_t USBKeyboard::nextPacked(const char *text, size_t length, size_t *pos, uint8_t keys[MAX_KEYS], bool *shift) {
+    uint8_t count = 0;
+    for (; *pos < length; (*pos)++) {
+        if (text[*pos] > 127) {
+            continue; // not valid ASCII
+        }
+        uint8_t k = conv_table[(uint8_t)text[*pos]][1];
+        bool s = conv_table[(uint8_t)text[*pos]][0];
+        if (k == HID_KEY_NONE) {
             continue;
         }
+        if (count > 0 && (!packing || s != *shift || count == MAX_KEYS || std::find(keys, keys + count, k) != keys + count)) {
+            break; // the next report
+        }
+        *shift = s;
+        keys[count++] = k;
+    }
+    return count;
+}
 
-        // convert to scan code
-        k = conv_table[line[i]][1];
+size_t USBKeyboard::packText(const char *text, size_t length, uint8_t *packed, size_t size) {
+    size_t pos = 0, used = 0;
+    uint8_t keys[MAX_KEYS], count;
+    bool shift = false;
+    while ((count = nextPacked(text, length, &pos, keys, &shift)) > 0) {
+        if (used + 1 + count > size) {
+            break;
+        }
+        packed[used++] = count | (shift ? TYPED_SHIFT : 0);
+        memcpy(packed + used, keys, count);
+        used += count;
+    }
+    return used;
+}
 
-        pressScancode(k);
-        if (conv_table[line[i]][0]) // shift
+// press some keys at once and let go of them, alongside anything else that's
+// held down, only as many at once as there's room for in a report
+void USBKeyboard::typeKeys(const uint8_t *k, uint8_t count, bool shift) {
+    uint8_t room = getFreeSlots();
+    if (room == 0) {
+        room = 1; // overflowing anyway
+    }
+    while (count > 0) {
+        uint8_t n = count < room ? count : room;
+        // the newest key goes at the front of keys, so backwards to keep them in order
+        for (int8_t c = n-1; c >= 0; c--) {
+            pressScancode(k[c]);
+        }
+        if (shift)
             pressScancode(HID_KEY_SHIFT_LEFT);
         sendReport();
 
-        releaseScancode(k);
-        if (conv_table[line[i]][0]) // shift
+        for (uint8_t c = 0; c < n; c++) {
+            releaseScancode(k[c]);
+        }
+        if (shift)
             releaseScancode(HID_KEY_SHIFT_LEFT);
         sendReport();
+        k += n;
+        count -= n;
+    }
+}
+
+// write out text through the keyboard
+void USBKeyboard::type(const char *line, size_t length) {
+    size_t pos = 0;
+    uint8_t k[MAX_KEYS], count;
+    bool shift = false;
+    while ((count = nextPacked(line, length, &pos, k, &shift)) > 0) {
+        typeKeys(k, count, shift);
     }
 }
 
@@ -185,6 +417,7 @@ void USBKeyboard::uk_hid_report_callback(uint8_t report_id, hid_report_type_t re
     numLock = ledIndicator & KEYBOARD_LED_NUMLOCK;
     capsLock = ledIndicator & KEYBOARD_LED_CAPSLOCK;
     scrollLock = ledIndicator & KEYBOARD_LED_SCROLLLOCK;
+    RGB.statusChanged();
 }
 
 USBKeyboard Keyboard;
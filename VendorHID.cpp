@@ -0,0 +1,461 @@
+/*
+ * VendorHID.cpp - a vendor defined HID interface for changing the configuration
+ *                 and reading counters while the keyboard is running
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <cstring>
+#include <cstddef>
+
+#include "usb.h"
+
+#include "pico/time.h"
+#include "hardware/clocks.h"
+
+#include "VendorHID.h"
+#include "MatrixScanner.h"
+#include "USBKeyboard.h"
+#include "MatrixStream.h"
+#include "FlightRecorder.h"
+#include "PowerHandler.h"
+#include "TextExpander.h"
+#include "KeyResolver.h"
+#include "ReportBuilder.h"
+
+static_assert(VENDOR_REPORT_SIZE <= CFG_TUD_HID_EP_BUFSIZE, "vendor reports don't fit in the HID endpoint buffer");
+static_assert(6 + 2*BOUNCE_BUCKETS <= VENDOR_REPORT_SIZE - 3, "key stats don't fit in a vendor report");
+
+// a generic in/out report on the vendor usage page, so the OS doesn't treat it
+// as anything in particular and hands it over to whatever opens it
+uint8_t const desc_vendor_report[] =
+{
+    TUD_HID_REPORT_DESC_GENERIC_INOUT(VENDOR_REPORT_SIZE)
+};
+
+Adafruit_USBD_HID vendor_hid;
+
+// defined in pico-model-m.cpp and pico-model-m.h
+extern uint32_t scrolldelay;
+extern uint32_t scrolltimeout;
+extern macroRecording macros[NUM_MACROS];
+
+static inline uint16_t get16(const uint8_t *b) {
+    return b[0] | (b[1] << 8);
+}
+
+static inline uint32_t get32(const uint8_t *b) {
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static inline void put16(uint8_t *b, uint16_t v) {
+    b[0] = v & 0xFF;
+    b[1] = v >> 8;
+}
+
+static inline void put32(uint8_t *b, uint32_t v) {
+    for (uint8_t c = 0; c < 4; c++) {
+        b[c] = (v >> (8*c)) & 0xFF;
+    }
+}
+
+VendorHID::VendorHID() {
+}
+
+void VendorHID::begin() {
+    vendor_hid.setPollInterval(2);
+    vendor_hid.setReportDescriptor(desc_vendor_report, sizeof(desc_vendor_report));
+    vendor_hid.setStringDescriptor("Configuration");
+    vendor_hid.enableOutEndpoint(true);
+    vendor_hid.setReportCallback(NULL, vendor_report_callback);
+    vendor_hid.begin();
+}
+
+void VendorHID::task() {
+    if (responsepending) { // finish sending the last response before starting on another
+        if (!vendor_hid.ready()) {
+            return;
+        }
+        vendor_hid.sendReport(0, response, VENDOR_REPORT_SIZE);
+        responsepending = false;
+    }
+    if (queuetail == queuehead) {
+        // tinyusb copies the report into its own buffer, so the slot can go straight back
+        const uint8_t *packet = StateStream.peek();
+        if (packet != NULL && vendor_hid.ready()) {
+            vendor_hid.sendReport(0, packet, VENDOR_REPORT_SIZE);
+            StateStream.release();
+        }
+        return;
+    }
+
+    const uint8_t *request = queue[queuetail];
+    memset(response, 0, VENDOR_REPORT_SIZE);
+    response[0] = request[0];
+    response[1] = request[1];
+    process(request, response);
+    queuetail = (queuetail + 1) % VENDOR_QUEUE_LENGTH;
+
+    if (vendor_hid.ready()) {
+        vendor_hid.sendReport(0, response, VENDOR_REPORT_SIZE);
+    }
+    else {
+        responsepending = true;
+    }
+}
+
+// fill in the status and data of the response to a request
+void VendorHID::process(const uint8_t *request, uint8_t *response) {
+    const uint8_t *args = &request[2];
+    uint8_t *data = &response[3];
+    const uint8_t maxdata = VENDOR_REPORT_SIZE - 3;
+    uint8_t status = VENDOR_OK;
+
+    switch (request[0]) {
+        case VENDOR_INFO: {
+            data[0] = VENDOR_PROTOCOL_VERSION;
+            data[1] = NUM_DOWN;
+            data[2] = NUM_ACROSS;
+            data[3] = MAX_LAYERS;
+            data[4] = NUM_MACROS;
+            data[5] = KEYMAP_MAX_SPECIALS;
+            data[6] = SPECIAL_MAX_LENGTH;
+            data[7] = sizeof(specialEntry);
+            put16(&data[8], sizeof(keymapImage));
+            put16(&data[10], offsetof(keymapImage, keymap));
+            put16(&data[12], offsetof(keymapImage, specials));
+            data[14] = (staged != NULL) | (Keymaps.swapPending() << 1);
+            data[15] = PARAM_COUNT;
+            data[16] = COUNTER_COUNT;
+            strncpy((char*)&data[17], VERSION, maxdata - 17); // whatever fits
+            break;
+        }
+
+        case VENDOR_KEYMAP_READ: {
+            uint16_t offset = get16(&args[0]);
+            uint8_t length = args[2];
+            if (length > maxdata || offset + length > sizeof(keymapImage)) {
+                status = VENDOR_BAD_ARGUMENT;
+                break;
+            }
+            memcpy(data, (const uint8_t*)Keymaps.active() + offset, length);
+            break;
+        }
+
+        case VENDOR_KEYMAP_WRITE:
+            status = keymapWrite(args);
+            break;
+
+        case VENDOR_KEYMAP_COMMIT:
+            if (staged == NULL) {
+                status = VENDOR_BAD_ARGUMENT; // nothing to commit
+            }
+            else if (Keymaps.swapPending()) {
+                status = VENDOR_BUSY;
+            }
+            else if (!Keymaps.commit()) {
+                status = VENDOR_FAILED; // didn't validate, it stays staged so it can be fixed
+            }
+            else {
+                staged = NULL;
+            }
+            break;
+
+        case VENDOR_KEYMAP_SAVE:
+            if (Keymaps.swapPending()) {
+                status = VENDOR_BUSY;
+            }
+            else if (!Keymaps.save()) {
+                status = VENDOR_FAILED;
+            }
+            break;
+
+        case VENDOR_KEYMAP_DEFAULTS:
+            if (staged == NULL) {
+                staged = Keymaps.stage();
+            }
+            if (staged == NULL) {
+                status = VENDOR_BUSY;
+                break;
+            }
+            KeymapStore::loadDefaults(staged);
+            break;
+
+        case VENDOR_PARAM_GET:
+            if (args[0] >= PARAM_COUNT) {
+                status = VENDOR_BAD_ARGUMENT;
+                break;
+            }
+            put32(data, getParameter(args[0]));
+            break;
+
+        case VENDOR_PARAM_SET:
+            status = setParameter(args[0], get32(&args[1]));
+            break;
+
+        case VENDOR_MACRO_READ: {
+            if (args[0] < 1 || args[0] > NUM_MACROS) { // numbered from 1 like in the specials
+                status = VENDOR_BAD_ARGUMENT;
+                break;
+            }
+            const macroRecording *m = &macros[args[0]-1];
+            uint16_t index = get16(&args[1]);
+            uint8_t count = 0;
+            put16(&data[0], m->length);
+            while (index + count < m->length && 3 + 2*(count+1) <= maxdata) {
+                data[3 + 2*count] = m->scancode[index + count];
+                data[4 + 2*count] = m->pressed[index + count];
+                count++;
+            }
+            data[2] = count;
+            break;
+        }
+
+        case VENDOR_MACRO_CLEAR:
+            if (args[0] < 1 || args[0] > NUM_MACROS) {
+                status = VENDOR_BAD_ARGUMENT;
+                break;
+            }
+            macros[args[0]-1].length = 0;
+            break;
+
+        case VENDOR_MACRO_APPEND: {
+            uint8_t count = args[1];
+            if (args[0] < 1 || args[0] > NUM_MACROS || 4 + 2*count > VENDOR_REPORT_SIZE ||
+                    macros[args[0]-1].length + count > MACRO_MAX_LENGTH) {
+                status = VENDOR_BAD_ARGUMENT;
+                break;
+            }
+            for (uint8_t c = 0; c < count; c++) {
+                macros[args[0]-1].add(args[2 + 2*c], args[3 + 2*c] != 0);
+            }
+            break;
+        }
+
+        case VENDOR_COUNTERS: { // they don't all fit in one report, so they're read from an index
+            uint8_t count = 0;
+            while (args[0] + count < COUNTER_COUNT && 1 + 4*(count+1) <= maxdata) {
+                put32(&data[1 + 4*count], getCounter(args[0] + count));
+                count++;
+            }
+            data[0] = count;
+            break;
+        }
+
+        case VENDOR_STREAM:
+            StateStream.enable(args[0] != 0);
+            break;
+
+        case VENDOR_RECORDER_READ: { // records that have been overwritten can't be read
+            if (args[0] > 1) {
+                status = VENDOR_BAD_ARGUMENT;
+                break;
+            }
+            uint32_t first = get32(&args[1]);
+            uint32_t head = Recorder.getHead(args[0]);
+            if (first < head && head - first > RECORDER_LENGTH) {
+                status = VENDOR_BAD_ARGUMENT;
+                break;
+            }
+            uint8_t count = 0;
+            const eventRecord *e;
+            while (5 + sizeof(eventRecord)*(count+1) <= maxdata && (e = Recorder.getRecord(args[0], first + count)) != NULL) {
+                put32(&data[5 + sizeof(eventRecord)*count], e->time);
+                put32(&data[9 + sizeof(eventRecord)*count], e->data);
+                count++;
+            }
+            put32(&data[0], head);
+            data[4] = count;
+            break;
+        }
+
+        case VENDOR_KEY_STATS: {
+            if (args[0] >= NUM_DOWN || args[1] >= NUM_ACROSS) {
+                status = VENDOR_BAD_ARGUMENT;
+                break;
+            }
+            const keyStats *k = KeyMatrix.getKeyStats(args[0], args[1]);
+            put16(&data[0], k->rejected);
+            put16(&data[2], k->chatter);
+            for (uint8_t b = 0; b < BOUNCE_BUCKETS; b++) {
+                put16(&data[4 + 2*b], k->histogram[b]);
+            }
+            put16(&data[4 + 2*BOUNCE_BUCKETS], k->debouncetime);
+            break;
+        }
+
+        case VENDOR_KEY_STATS_CLEAR:
+            KeyMatrix.clearKeyStats();
+            break;
+
+        default:
+            status = VENDOR_UNKNOWN_COMMAND;
+    }
+    response[2] = status;
+}
+
+// edits go into a staged copy of the keymap, which is only used once committed
+uint8_t VendorHID::keymapWrite(const uint8_t *args) {
+    uint16_t offset = get16(&args[0]);
+    uint8_t length = args[2];
+    // the crc is worked out when committing
+    if (length > VENDOR_REPORT_SIZE - 5 || offset + length > offsetof(keymapImage, crc)) {
+        return VENDOR_BAD_ARGUMENT;
+    }
+    if (staged == NULL) {
+        staged = Keymaps.stage();
+        if (staged == NULL) {
+            return VENDOR_BUSY;
+        }
+    }
+    memcpy((uint8_t*)staged + offset, &args[3], length);
+    return VENDOR_OK;
+}
+
+uint32_t VendorHID::getParameter(uint8_t id) {
+    switch (id) {
+        case PARAM_DEBOUNCE_MS: return KeyMatrix.getDebounceDelay();
+        case PARAM_SETTLE_US: return KeyMatrix.getSettleDelay();
+        case PARAM_SCAN_INTERVAL_US: return KeyMatrix.getScanInterval();
+        case PARAM_SCROLL_DELAY_MS: return scrolldelay;
+        case PARAM_SCROLL_TIMEOUT_S: return scrolltimeout;
+        case PARAM_ADAPTIVE_DEBOUNCE: return KeyMatrix.getAdaptiveDebounce();
+        case PARAM_DEBOUNCE_MIN_MS: return KeyMatrix.getDebounceMin();
+        case PARAM_DEBOUNCE_MAX_MS: return KeyMatrix.getDebounceMax();
+        case PARAM_CLOCK_GOVERNOR: return Power.getGoverning();
+        case PARAM_EXPANSIONS: return Expander.getEnabled();
+        case PARAM_RESOLVE_MAX_MS: return Resolver.getMaxDelay();
+        case PARAM_TEXT_PACKING: return USBKeyboard::getPacking();
+    }
+    return 0;
+}
+
+// values are limited to something that will still leave a working keyboard
+uint8_t VendorHID::setParameter(uint8_t id, uint32_t value) {
+    switch (id) {
+        case PARAM_DEBOUNCE_MS:
+            if (value > 50) return VENDOR_BAD_ARGUMENT;
+            KeyMatrix.setDebounceDelay(value);
+            break;
+        case PARAM_SETTLE_US:
+            if (value < 1 || value > 1000) return VENDOR_BAD_ARGUMENT;
+            KeyMatrix.setSettleDelay(value);
+            break;
+        case PARAM_SCAN_INTERVAL_US:
+            if (value > 10000) return VENDOR_BAD_ARGUMENT;
+            KeyMatrix.setScanInterval(value);
+            break;
+        case PARAM_SCROLL_DELAY_MS:
+            if (value < 10 || value > 5000) return VENDOR_BAD_ARGUMENT;
+            scrolldelay = value;
+            break;
+        case PARAM_SCROLL_TIMEOUT_S:
+            if (value < 1 || value > 3600) return VENDOR_BAD_ARGUMENT;
+            scrolltimeout = value;
+            break;
+        case PARAM_ADAPTIVE_DEBOUNCE:
+            if (value > 1) return VENDOR_BAD_ARGUMENT;
+            KeyMatrix.setAdaptiveDebounce(value);
+            break;
+        case PARAM_DEBOUNCE_MIN_MS:
+            if (value > KeyMatrix.getDebounceMax()) return VENDOR_BAD_ARGUMENT;
+            KeyMatrix.setDebounceLimits(value, KeyMatrix.getDebounceMax());
+            break;
+        case PARAM_DEBOUNCE_MAX_MS:
+            if (value < KeyMatrix.getDebounceMin() || value > 50) return VENDOR_BAD_ARGUMENT;
+            KeyMatrix.setDebounceLimits(KeyMatrix.getDebounceMin(), value);
+            break;
+        case PARAM_CLOCK_GOVERNOR:
+            if (value > 1) return VENDOR_BAD_ARGUMENT;
+            Power.setGoverning(value);
+            break;
+        case PARAM_EXPANSIONS:
+            if (value > 1) return VENDOR_BAD_ARGUMENT;
+            Expander.setEnabled(value);
+            break;
+        case PARAM_RESOLVE_MAX_MS:
+            if (value < 10 || value > 2550) return VENDOR_BAD_ARGUMENT;
+            Resolver.setMaxDelay(value);
+            break;
+        case PARAM_TEXT_PACKING:
+            if (value > 1) return VENDOR_BAD_ARGUMENT;
+            USBKeyboard::setPacking(value);
+            break;
+        default:
+            return VENDOR_BAD_ARGUMENT;
+    }
+    return VENDOR_OK;
+}
+
+uint32_t VendorHID::getCounter(uint8_t id) {
+    switch (id) {
+        case COUNTER_UPTIME_MS: return to_ms_since_boot(get_absolute_time());
+        case COUNTER_SCANS: return KeyMatrix.getScanCount();
+        case COUNTER_MAX_SCAN_US: return KeyMatrix.getMaxScanTime();
+        case COUNTER_LOCK_MISSES: return KeyMatrix.getLockMisses();
+        case COUNTER_REPORTS: return Keyboard.getReportCount();
+        case COUNTER_OVERFLOW_REPORTS: return Keyboard.getOverflowCount();
+        case COUNTER_VENDOR_REQUESTS: return requests;
+        case COUNTER_VENDOR_DROPPED: return dropped;
+        case COUNTER_STREAM_LOST: return StateStream.getLost();
+        case COUNTER_CORE1_RESTARTS: return KeyMatrix.getRestarts();
+        case COUNTER_MOUNTED_US: return Keyboard.getMountedTime();
+        case COUNTER_FIRST_REPORT_US: return Keyboard.getFirstReportTime();
+        case COUNTER_SUSPENDS: return Power.getSuspendCount();
+        case COUNTER_KEY_WAKES: return Power.getKeyWakeCount();
+        case COUNTER_CLOCK_KHZ: return clock_get_hz(clk_sys) / 1000;
+        case COUNTER_CLOCK_CHANGES: return Power.getClockChanges();
+        case COUNTER_RESOLVE_HELD: return Resolver.getHeldEvents();
+        case COUNTER_RESOLVE_MAX_US: return Resolver.getMaxHeld();
+        case COUNTER_LIVE_REPORTS: return Reports.getPublished();
+        case COUNTER_SLOW_KEYS: return Reports.getSlowChanges();
+        case COUNTER_IGNORED_KEYS: return Keyboard.getIgnoredKeys() + Reports.getIgnoredKeys();
+    }
+    return 0;
+}
+
+// tinyusb calls this with data from the out endpoint (report type invalid), or
+// with a SET_REPORT on the control endpoint if the host uses that instead
+void VendorHID::vh_report_callback(uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize) {
+    (void) report_id;
+    if (report_type != HID_REPORT_TYPE_OUTPUT && report_type != HID_REPORT_TYPE_INVALID) return;
+
+    uint8_t next = (queuehead + 1) % VENDOR_QUEUE_LENGTH;
+    if (next == queuetail) {
+        dropped++;
+        return;
+    }
+    uint16_t length = bufsize < VENDOR_REPORT_SIZE ? bufsize : VENDOR_REPORT_SIZE;
+    memcpy(queue[queuehead], buffer, length);
+    memset(&queue[queuehead][length], 0, VENDOR_REPORT_SIZE - length);
+    queuehead = next;
+    requests++;
+}
+
+VendorHID Vendor;
+
+// callback wrapper so that it has the class
+void vendor_report_callback(uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize) {
+    Vendor.vh_report_callback(report_id, report_type, buffer, bufsize);
+}
@@ -0,0 +1,120 @@
+/*
+ * FlightRecorder.h - always on record of recent input and USB events, kept
+ *                    over a watchdog reboot and readable from the host
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef FlightRecorder_h
+#define FlightRecorder_h
+
+#include <cstdint>
+
+#include "pico/platform.h"
+#include "pico/time.h"
+#include "hardware/sync.h"
+
+#define RECORDER_MAGIC 0x52464d4d // "MMFR"
+// records kept for each core, must be a power of 2
+#define RECORDER_LENGTH 512
+
+enum recorderEvent {
+    EVENT_NONE = 0,
+    EVENT_BOOT, // watchdog caused the reboot, boot count (2)
+    EVENT_RAW, // down, across, state, an edge straight off the matrix
+    EVENT_DEBOUNCE_ACCEPT, // down, across, state
+    EVENT_DEBOUNCE_REJECT, // down, across, state, an edge inside the debounce time
+    EVENT_GHOST, // down, across, ignored (1) or not any more (0)
+    EVENT_LOCK_MISS, // getPinState couldn't get the mutex
+    EVENT_REPORT, // modifiers, first key, number of keys in it (top bit set when overflowing), only when it changed
+    EVENT_MOUNT,
+    EVENT_UNMOUNT,
+    EVENT_SUSPEND, // remote wakeup allowed
+    EVENT_RESUME,
+    EVENT_MACRO, // macroAction, macro number, length
+    EVENT_KEYMAP_SWAP,
+    EVENT_DEBOUNCE_TIME, // down, across, new adaptive debounce time (0.5 ms)
+    EVENT_CORE1_RESTART, // restart count, scan count (low bytes)
+    EVENT_KEY_WAKE, // remote wakeup allowed, a key was pressed while the computer was asleep
+    EVENT_CLOCK, // clockProfile, MHz, it worked
+    EVENT_RESOLVE, // special, resolveOutcome, ms the key was held back (KeyResolver.h)
+    EVENT_KEYMAP_STALE // the saved keymap was made from different defaults, so they're used instead
+};
+
+enum macroAction {
+    MACRO_RECORD_START = 0,
+    MACRO_RECORD_STOP,
+    MACRO_SELECT,
+    MACRO_PLAY
+};
+
+// 8 bytes, the time is the low 32 bits of the us timer (so it wraps every 71
+// minutes) and data is the event type in the low byte then up to 3 bytes of
+// arguments
+struct eventRecord {
+    uint32_t time;
+    uint32_t data;
+};
+
+struct recorderRing {
+    uint32_t magic;
+    uint32_t size; // sizeof(recorderRing), a different build starts afresh
+    uint32_t boots;
+    volatile uint32_t head; // records ever written, the next goes at head % RECORDER_LENGTH
+    eventRecord records[RECORDER_LENGTH];
+};
+
+// the rings are in RAM that isn't cleared at start up, so after a watchdog
+// reboot the events leading up to it are still there
+extern recorderRing recorderRings[2];
+
+// each core writes to its own ring so the cores never need to lock each other
+// out, but core0 also records from the USB interrupt (usb.cpp), which could
+// land between reading head and moving it on and lose a record, so interrupts
+// are off for the few stores it takes. reading the other core's ring while
+// it's being written could give a torn record, that's fine for diagnostics
+class FlightRecorder {
+    public:
+        FlightRecorder();
+        void begin(); // core0, before core1 is started
+
+        inline void record(uint8_t type, uint8_t a = 0, uint8_t b = 0, uint8_t c = 0) {
+            recorderRing *r = &recorderRings[get_core_num()];
+            uint32_t ints = save_and_disable_interrupts();
+            uint32_t n = r->head;
+            eventRecord *e = &r->records[n & (RECORDER_LENGTH - 1)];
+            e->time = time_us_32();
+            e->data = type | (a << 8) | (b << 16) | ((uint32_t)c << 24);
+            r->head = n + 1;
+            restore_interrupts(ints);
+        };
+
+        uint32_t getHead(uint8_t core) { return recorderRings[core].head; };
+        // record n (counting from the first ever), NULL if it's been overwritten or not written yet
+        const eventRecord* getRecord(uint8_t core, uint32_t n);
+};
+
+extern FlightRecorder Recorder;
+
+#endif
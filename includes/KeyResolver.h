@@ -0,0 +1,134 @@
+/*
+ * KeyResolver.h - dual role (tap-hold) keys and combos, decided as soon as
+ *                 the keys pressed so far allow it
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef KeyResolver_h
+#define KeyResolver_h
+
+#include <cstdint>
+
+#include "KeymapStore.h"
+
+// key changes held back while a binding is being decided, reaching this
+// decides it straight away
+#define RESOLVER_QUEUE_LENGTH 16
+// keys that are down after being decided, and so let go of something else
+#define RESOLVER_MAX_ENGAGED 8
+// the most a key is held back (ms), whatever the binding says (can be
+// changed while running, see VendorHID)
+#define RESOLVE_MAX_MS 300
+
+// times in the specials are in 10 ms, so up to 2.55 s fits in a byte
+#define RESOLVE_TIME(ms) ((ms) / 10)
+
+// SPECIAL_TAP_HOLD topress is {tap key, hold key, RESOLVE_TIME(ms), tapHoldFlags}
+// and SPECIAL_COMBO (always twokey) is {key, RESOLVE_TIME(ms)}. both are found
+// by position, so the keys can be anything in the keymap
+enum tapHoldFlags {
+    TAP_HOLD_ON_OTHER_KEY = 0x01, // another key pressed means hold, nothing else waits
+    TAP_HOLD_PERMISSIVE = 0x02 // another key pressed and let go means hold
+};
+
+enum resolveOutcome {
+    RESOLVE_TAP = 0,
+    RESOLVE_HOLD,
+    RESOLVE_COMBO,
+    RESOLVE_NO_COMBO
+};
+
+struct resolverEvent {
+    uint8_t down;
+    uint8_t across;
+    uint8_t scancode; // from the keymap
+    bool pressed;
+    uint64_t time; // us
+};
+
+struct engagedKey {
+    uint8_t down;
+    uint8_t across;
+    uint8_t scancode; // let go of this when the key is, HID_KEY_NONE for nothing
+    uint8_t binding; // the special
+};
+
+// every key change goes through keyChanged() on its way to handleKey(). when
+// nothing is being decided and a key isn't the start of a binding it goes
+// straight through. when it is, it and anything after it are held back until
+// the binding is decided, which happens on the key change that settles it
+// (or the time running out in task()), and then they're all sent on in the
+// order they happened with the decision made. for a tap-hold key:
+// - let go before the time is up, a tap
+// - TAP_HOLD_ON_OTHER_KEY, another key being pressed is a hold, so other keys
+//   are never held back
+// - TAP_HOLD_PERMISSIVE, another key pressed and let go is a hold
+// - otherwise a hold once the time is up
+// for a combo, the other key being pressed within the time makes it, anything
+// else happening first (including other keys being pressed) means it wasn't
+class KeyResolver {
+    private:
+        resolverEvent held[RESOLVER_QUEUE_LENGTH];
+        uint8_t heldcount = 0;
+        bool pending = false;
+        uint8_t pendingindex = 0;
+        specialEntry binding; // a copy, in case the keymap changes in the meantime
+        uint64_t deadline = 0;
+
+        engagedKey engaged[RESOLVER_MAX_ENGAGED];
+        uint8_t engagedcount = 0;
+
+        volatile uint32_t maxdelay = RESOLVE_MAX_MS;
+
+        // performance counters
+        uint32_t heldevents = 0; // key changes that were held back
+        uint32_t maxheld = 0; // us, the longest any was
+
+        void change(const resolverEvent *e);
+        bool findBinding(uint8_t down, uint8_t across);
+        void decide(uint64_t now);
+        void finish(resolveOutcome outcome, uint8_t partner);
+        void engage(uint8_t down, uint8_t across, uint8_t scancode);
+
+    public:
+        KeyResolver();
+        void keyChanged(uint8_t down, uint8_t across, bool pressed, uint8_t scancode);
+        void task(); // from the main loop, for bindings that are decided by time
+        void reset(); // forget everything, when everything has been let go of anyway
+        bool isDeciding() { return pending; }; // key changes are being held back
+
+        void setMaxDelay(uint32_t ms) { maxdelay = ms; };
+        uint32_t getMaxDelay() { return maxdelay; };
+        uint32_t getHeldEvents() { return heldevents; };
+        uint32_t getMaxHeld() { return maxheld; };
+};
+
+extern KeyResolver Resolver;
+
+// pico-model-m.h, what happens when a key changes once it's been decided,
+// reported if core1 has already sent it (see ReportBuilder)
+void handleKey(uint8_t down, uint8_t across, bool pressed, uint8_t scancode, bool reported = false);
+
+#endif
@@ -29,21 +29,65 @@
 #ifndef keyboardlayout_h
 #define keyboardlayout_h
 
-#include <string>
-#include <vector>
+#include <cstdint>
+#include <initializer_list>
+
+// NUM_ACROSS, NUM_DOWN, and the across/down pins, generated from boards/*.pins
+#include "PinMap.h"
+// NUM_LAYERS and the keymap, generated from boards/*.keymap
+#include "Keymap.h"
 
 // note, macro numbering in specialFunctionDefinition starts at 0x01 to avoid starting a string with 0x00
 #define NUM_MACROS 3
+// key presses and releases a macro can hold
+#define MACRO_MAX_LENGTH 256
+
+// a recorded macro, in the order the keys changed
+struct macroRecording {
+    uint16_t length = 0;
+    uint8_t scancode[MACRO_MAX_LENGTH];
+    bool pressed[MACRO_MAX_LENGTH];
+    bool add(uint8_t k, bool p) { // false once it's full
+        if (length == MACRO_MAX_LENGTH) {
+            return false;
+        }
+        scancode[length] = k;
+        pressed[length++] = p;
+        return true;
+    };
+};
+
+// longest string of keys or text a special function can have
+#define SPECIAL_MAX_LENGTH 25
 
-// columns of the matrix
-#define NUM_ACROSS 20
-// rows of the matrix
-#define NUM_DOWN 8
+// codes in the keymap that aren't keys are put in the range of HID usages
+// no keyboard sends (0xE8-0xFE), with 0xFF for special functions
+#define KEY_TRANSPARENT 0xE8 // use whatever the next active layer down has
+#define KEY_LAYER_MOMENTARY(n) (0xF0 + (n)) // layer n is on while held
+#define KEY_LAYER_TOGGLE(n) (0xF4 + (n)) // layer n is switched on/off when pressed
+#define KEY_LAYER_ONESHOT(n) (0xF8 + (n)) // layer n is on for the next key pressed
+#define MAX_LAYERS 4
 
-extern uint8_t across[NUM_ACROSS];
-extern uint8_t down[NUM_DOWN];
+// true for the keymap codes handled by LayerState rather than sent to the computer
+static inline bool isLayerKey(uint8_t k) { return k >= KEY_LAYER_MOMENTARY(0) && k < 0xFC; }
 
-extern uint8_t keyboardlayout[NUM_DOWN][NUM_ACROSS];
+// which layers of the keymap are active, the scanner on core1 uses this to
+// decide what each key does at the moment it is pressed
+class LayerState {
+    private:
+        uint8_t held[MAX_LAYERS] = {0}; // momentary keys held down for each layer
+        uint8_t toggled = 0; // bit n for layer n
+        uint8_t oneshot = 0;
+
+    public:
+        // bit n is set if layer n is active, layer 0 always is
+        uint8_t active();
+        // work out what the key at down, across does now, call once when it's pressed
+        uint8_t press(uint8_t down, uint8_t across);
+        // call when a key is released, with the code press() returned for it
+        void release(uint8_t k);
+        void reset();
+};
 
 enum specialType {
     SPECIAL_TYPE, // have the keyboard type out the contents of a string
@@ -55,23 +99,59 @@ enum specialType {
     SPECIAL_SCROLL, // switch to scroll mode
     SPECIAL_BOOTLOADER, // enter the pico bootloader to update the firmware
     SPECIAL_REATTACH, // software USB disconnect and reconnect
+    SPECIAL_TAP_HOLD, // one key when tapped and another when held (see KeyResolver.h)
+    SPECIAL_COMBO, // a key sent when two keys are pressed together, in either order
 };
 
-// struct to store special key functions
+// not constexpr (and never defined) on purpose, a special that's too long
+// calls this while the list is being worked out when compiling, which stops
+// the build rather than cutting it off
+void specialTooLong();
+
+// struct to store special key functions, the constructors are constexpr so
+// the list is worked out when compiling and stays in flash
 struct specialFunctionDefinition {
     uint8_t across;
     uint8_t down;
-    uint8_t across2;
-    uint8_t down2;
+    uint8_t across2 = 0;
+    uint8_t down2 = 0;
     bool twokey = false;
     specialType type;
-    std::string topress = ""; // keys to press, or other optional arguments (like macro number) as a 0x00 terminated array
-    specialFunctionDefinition(uint8_t a, uint8_t d, specialType t) : across(a), down(d), type(t) {}
-    specialFunctionDefinition(uint8_t a, uint8_t d, specialType t, std::string t2) : across(a), down(d), type(t), topress(t2) {}
-    specialFunctionDefinition(uint8_t a, uint8_t d, uint8_t a2, uint8_t d2, specialType t) : across(a), down(d), across2(a2), down2(d2), type(t), twokey(true) {}
-    specialFunctionDefinition(uint8_t a, uint8_t d, uint8_t a2, uint8_t d2, specialType t, std::string t2) : across(a), down(d), across2(a2), down2(d2), type(t), topress(t2), twokey(true) {}
+    // keys to press, or other optional arguments (like macro number) as a 0x00 terminated array,
+    // at most SPECIAL_MAX_LENGTH
+    uint8_t topress[SPECIAL_MAX_LENGTH] = {0};
+    uint8_t length = 0;
+    constexpr specialFunctionDefinition(uint8_t a, uint8_t d, specialType t) : across(a), down(d), type(t) {}
+    constexpr specialFunctionDefinition(uint8_t a, uint8_t d, specialType t, const char *t2) : across(a), down(d), type(t) { set(t2); }
+    constexpr specialFunctionDefinition(uint8_t a, uint8_t d, specialType t, std::initializer_list<uint8_t> t2) : across(a), down(d), type(t) { set(t2); }
+    constexpr specialFunctionDefinition(uint8_t a, uint8_t d, uint8_t a2, uint8_t d2, specialType t) : across(a), down(d), across2(a2), down2(d2), twokey(true), type(t) {}
+    constexpr specialFunctionDefinition(uint8_t a, uint8_t d, uint8_t a2, uint8_t d2, specialType t, const char *t2) : across(a), down(d), across2(a2), down2(d2), twokey(true), type(t) { set(t2); }
+    constexpr specialFunctionDefinition(uint8_t a, uint8_t d, uint8_t a2, uint8_t d2, specialType t, std::initializer_list<uint8_t> t2) : across(a), down(d), across2(a2), down2(d2), twokey(true), type(t) { set(t2); }
+
+    private:
+        constexpr void set(const char *t2) {
+            while (t2[length] != 0) {
+                if (length == SPECIAL_MAX_LENGTH) {
+                    specialTooLong();
+                    break;
+                }
+                topress[length] = t2[length];
+                length++;
+            }
+        }
+        constexpr void set(std::initializer_list<uint8_t> t2) {
+            if (t2.size() > SPECIAL_MAX_LENGTH) {
+                specialTooLong();
+            }
+            for (uint8_t k : t2) {
+                if (length < SPECIAL_MAX_LENGTH) {
+                    topress[length++] = k;
+                }
+            }
+        }
 };
 
-extern std::vector<specialFunctionDefinition> specials;
+extern const specialFunctionDefinition specials[];
+extern const uint8_t numspecials;
 
 #endif
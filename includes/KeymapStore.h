@@ -0,0 +1,128 @@
+/*
+ * KeymapStore.h - RAM copy of the keymap and special functions that can be
+ *                 changed while running and saved to flash
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef KeymapStore_h
+#define KeymapStore_h
+
+#include "hardware/flash.h"
+
+#include "KeyboardLayout.h"
+#include "USBKeyboard.h"
+
+#define KEYMAP_MAGIC 0x4d4d4b31 // "1KMM"
+#define KEYMAP_VERSION 2
+
+#define KEYMAP_MAX_SPECIALS 48
+
+// SPECIAL_TYPE and SPECIAL_RUN text packed into reports, with room for the
+// newline SPECIAL_RUN adds
+#define SPECIAL_PACKED_SIZE TYPED_SIZE(SPECIAL_MAX_LENGTH + 1)
+
+// the keymap is saved in the last sector of flash, well away from the firmware
+#define KEYMAP_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+
+// a specialFunctionDefinition in a fixed size that can be saved
+struct specialEntry {
+    uint8_t across;
+    uint8_t down;
+    uint8_t across2;
+    uint8_t down2;
+    uint8_t twokey;
+    uint8_t type; // specialType
+    uint8_t length; // of topress
+    uint8_t topress[SPECIAL_MAX_LENGTH];
+};
+
+// everything needed to say what the keys do, in the same layout in RAM and flash
+struct keymapImage {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size; // sizeof(keymapImage), so a different build's image isn't used
+    uint8_t numlayers;
+    uint8_t numspecials;
+    uint8_t reserved[2];
+    uint32_t defaults; // the crc of the built in keymap this one started from
+    uint8_t keymap[MAX_LAYERS][NUM_DOWN][NUM_ACROSS];
+    specialEntry specials[KEYMAP_MAX_SPECIALS];
+    uint32_t crc; // of everything before this
+};
+
+// flash is programmed in whole pages, so each buffer is padded out to one
+#define KEYMAP_BUFFER_SIZE ((sizeof(keymapImage) + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1))
+union keymapBuffer {
+    keymapImage image;
+    uint8_t bytes[KEYMAP_BUFFER_SIZE];
+};
+
+struct packedText {
+    uint8_t length;
+    uint8_t data[SPECIAL_PACKED_SIZE];
+};
+
+// a keymap and the text packed from its specials, from the same copy
+struct activeKeymap {
+    const keymapImage *image;
+    const packedText *packed; // for image->specials
+};
+
+// there are two copies of the keymap in RAM, the one in use and one that can
+// be edited. once an edited copy checks out, core1 swaps over to it between
+// scans (while it holds the matrix mutex), so neither core ever sees half of
+// one keymap and half of another. text for the specials to type is packed
+// into reports as each copy is loaded or committed, so it's ready to go
+class KeymapStore {
+    private:
+        keymapBuffer buffers[2];
+        packedText packed[2][KEYMAP_MAX_SPECIALS];
+        volatile uint8_t activebuffer = 0;
+        volatile bool swappending = false;
+
+        void pack(uint8_t buffer);
+        static uint32_t crc32(const uint8_t *data, uint32_t length);
+
+    public:
+        KeymapStore();
+        // load from flash, or the defaults if there's nothing good there or
+        // what's there was changed from different defaults (an older build's)
+        void begin();
+
+        const keymapImage* active() { return &buffers[activebuffer].image; };
+        activeKeymap current(); // the image and its packed text, in case core1 swaps in between
+        keymapImage* stage(); // a copy of the active keymap to edit, NULL while waiting to swap
+        bool commit(); // check the staged copy and ask core1 to swap to it
+        bool swap(); // core1 only, between scans, true if the keymap changed
+        bool swapPending() { return swappending; };
+        bool save(); // write the active keymap to flash (pauses core1)
+
+        static void loadDefaults(keymapImage *image);
+        static bool validate(const keymapImage *image);
+};
+
+extern KeymapStore Keymaps;
+
+#endif
@@ -33,32 +33,165 @@
 
 #include "KeyboardLayout.h"
 
+// default timings, these can be changed while running (see VendorHID)
+// debounce delay (ms)
+#define DEBOUNCE_DELAY 5
+// delay for changes to GPIO to settle after driving a column (us)
+#define SETTLE_DELAY 30
+// pause between scans of the whole matrix (us)
+#define SCAN_INTERVAL 100
+// core1 is restarted if it hasn't finished a scan in this long (ms)
+#define SCAN_DEADLINE 100
+
+// a new key that might be ghosting has to stay down this many scans to count
+#define GHOST_WAIT_SCANS 3
+
+// adaptive debounce, each key's debounce time moves between these (ms)
+#define DEBOUNCE_MIN 2
+#define DEBOUNCE_MAX 20
+// a key's time goes up this much (us) when it bounces close to its limit or chatters
+#define DEBOUNCE_GROW 1000
+// and down this much after DEBOUNCE_CLEAN_COUNT changes in a row without bouncing
+#define DEBOUNCE_SHRINK 500
+#define DEBOUNCE_CLEAN_COUNT 32
+// a press or release shorter than this (us) is too quick to be a person, it's chatter
+#define CHATTER_TIME 20000
+
+// the bounce histogram has buckets for how long after a key changed it
+// bounced, up to (us)
+#define BOUNCE_BUCKETS 8
+constexpr uint16_t bouncebuckets[BOUNCE_BUCKETS] = {500, 1000, 2000, 3000, 5000, 8000, 13000, 0xFFFF};
+
+// what's known about how each key bounces, counts stop at 0xFFFF
+struct keyStats {
+    uint16_t rejected; // changes ignored as bounce
+    uint16_t chatter; // changes that got through debounce but were too quick
+    uint16_t histogram[BOUNCE_BUCKETS]; // of rejected changes
+    uint16_t debouncetime; // us, for adaptive debounce
+    uint8_t cleancount; // changes in a row without bouncing
+    bool bounced; // since the last change that got through
+};
+
+// the scanner is specialised on the size of the matrix and a PinMap struct
+// (generated from boards/*.pins by tools/pinmap.py) that gives the pins, how
+// to pack a GPIO reading into a byte of rows, and which modifiers ghost
+template <uint8_t NumDown, uint8_t NumAcross, typename PinMap>
 class MatrixScanner {
     private:
-        bool pinstate[NUM_DOWN][NUM_ACROSS];
-        bool lastpinstate[NUM_DOWN][NUM_ACROSS]; // so we can detect a change
-        uint64_t lastpinchangetime[NUM_DOWN][NUM_ACROSS]; // for debounce
+        static_assert(NumDown <= 8, "rows are packed into a byte");
+        static_assert(sizeof(PinMap::across) == NumAcross && sizeof(PinMap::down) == NumDown, "PinMap does not match the matrix size");
+
+        // the base layer of the keymap, to know which positions have no key switch
+        const uint8_t (*layout)[NumAcross];
+
+        bool pinstate[NumDown][NumAcross];
+        bool lastpinstate[NumDown][NumAcross]; // so we can detect a change
+        uint64_t lastpinchangetime[NumDown][NumAcross]; // for debounce
+
+        // debounced state of each column, bit j is row j (before ghosting is removed)
+        uint8_t debounced[NumAcross];
+        // and what was read on the last scan, before debouncing
+        uint8_t raw[NumAcross];
+        // rows that are pressed but ignored by preventGhosting
+        uint8_t ghosted[NumAcross];
+        // raw, debounced, ghosted as last sent to StateStream
+        uint8_t streamed[NumAcross][3];
 
         // used for checking ghosting
-        std::vector<uint8_t> k1, k2;
+        uint8_t k1[NumAcross], k2[NumDown];
+
+        // what the keymap said each key was when it was last pressed, worked out
+        // here on core1 so the main loop gets the final HID usage
+        uint8_t keycodes[NumDown][NumAcross];
+        bool resolvedstate[NumDown][NumAcross]; // pinstate when keycodes was last updated
+        uint8_t waiting[NumDown][NumAcross]; // scans each key preventGhosting isn't sure of has been held back
+        LayerState layers;
 
         // mutext to lock a ccess to pinstate and lastpinstate
         mutex_t mx1;
 
+        volatile uint16_t debouncedelay = DEBOUNCE_DELAY;
+        volatile uint16_t settledelay = SETTLE_DELAY;
+        volatile uint16_t scaninterval = SCAN_INTERVAL;
+        volatile bool adaptive = false;
+        volatile uint16_t debouncemin = DEBOUNCE_MIN;
+        volatile uint16_t debouncemax = DEBOUNCE_MAX;
+
+        keyStats stats[NumDown][NumAcross];
+        void keyAccepted(uint8_t j, uint8_t i, uint32_t since);
+        void keyRejected(uint8_t j, uint8_t i, uint32_t since);
+        void setKeyDebounce(uint8_t j, uint8_t i, int32_t us);
+
+        // performance counters
+        volatile uint32_t scancount = 0;
+        volatile uint32_t maxscantime = 0; // us, for scan, ghosting, and keymap together
+        volatile uint32_t lockmisses = 0; // times getPinState couldn't get the mutex
+
+        // for core0 to keep an eye on core1
+        uint32_t watchscans = 0; // scancount when it last changed
+        uint32_t watchtime = 0; // when that was
+        uint32_t watchlast = 0; // when core0 last checked
+        uint32_t restarts = 0;
+
+        // while the computer is asleep core1 waits for a key instead of scanning
+        volatile bool parkrequested = false;
+        volatile bool parked = false;
+        volatile bool keywake = false; // a key was pressed while parked
+
+        void resetState();
+
         void setpininput(uint8_t pin);
 
     public:
-        MatrixScanner();
+        MatrixScanner(const uint8_t l[NumDown][NumAcross]);
         void begin();
+        void setLayout(const uint8_t l[NumDown][NumAcross]) { layout = l; };
         void scan();
         void preventGhosting();
-        bool getPinState(bool outpinstate[NUM_DOWN][NUM_ACROSS], bool outlastpinstate[NUM_DOWN][NUM_ACROSS]);
+        void resolveKeys();
+        void streamChanges();
+        bool getPinState(bool outpinstate[NumDown][NumAcross], bool outlastpinstate[NumDown][NumAcross], uint8_t outkeycodes[NumDown][NumAcross]);
         
         mutex_t* getMutex() { return &mx1; };
+
+        bool stalled(); // core0, true if core1 has missed the scan deadline
+        void restart(); // core0, reset and relaunch core1
+        uint32_t getRestarts() { return restarts; };
+
+        void requestPark(bool park); // core0
+        bool parkRequested() { return parkrequested; };
+        void park(); // core1, returns when a key is pressed or core0 cancels the park
+        void wakeFromPark() { keywake = true; }; // from the GPIO interrupt
+        bool takeKeyWake() { bool k = keywake; keywake = false; return k; }; // core0
+
+        uint16_t getDebounceDelay() { return debouncedelay; };
+        void setDebounceDelay(uint16_t ms) { debouncedelay = ms; };
+        uint16_t getSettleDelay() { return settledelay; };
+        void setSettleDelay(uint16_t us) { settledelay = us; };
+        uint16_t getScanInterval() { return scaninterval; };
+        void setScanInterval(uint16_t us) { scaninterval = us; };
+        bool getAdaptiveDebounce() { return adaptive; };
+        void setAdaptiveDebounce(bool on);
+        uint16_t getDebounceMin() { return debouncemin; };
+        uint16_t getDebounceMax() { return debouncemax; };
+        void setDebounceLimits(uint16_t minms, uint16_t maxms);
+
+        // per key bounce statistics, read from core0 while core1 is updating them
+        const keyStats* getKeyStats(uint8_t j, uint8_t i) { return &stats[j][i]; };
+        void clearKeyStats();
+
+        void countScan(uint32_t duration) { scancount++; if (duration > maxscantime) maxscantime = duration; };
+        uint32_t getScanCount() { return scancount; };
+        uint32_t getMaxScanTime() { return maxscantime; };
+        uint32_t getLockMisses() { return lockmisses; };
 };
 
-extern MatrixScanner KeyMatrix;
+// the scanner for the board being built for, see MatrixScanner.cpp
+typedef MatrixScanner<NUM_DOWN, NUM_ACROSS, BoardPinMap> BoardMatrixScanner;
+
+extern BoardMatrixScanner KeyMatrix;
 
 void core1_entry();
+void matrix_wake_callback(uint gpio, uint32_t events);
 
 #endif
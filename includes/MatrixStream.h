@@ -0,0 +1,92 @@
+/*
+ * MatrixStream.h - raw, debounced, and ghosting state of the matrix sent to the
+ *                  host as it changes, for diagnosing misbehaving keys
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef MatrixStream_h
+#define MatrixStream_h
+
+#include <cstdint>
+
+#include "VendorHID.h"
+
+// packets waiting to be sent, each one is a whole vendor report
+#define STREAM_SLOTS 16
+// a part filled packet is sent after this long (us) so quiet keys still show up
+#define STREAM_FLUSH_TIME 4000
+
+// a packet is [VENDOR_STREAM_DATA, packet sequence, scan number (4), record count],
+// with the top bit of the count set if packets were lost before this one. each
+// record is [scans since the packet's scan number, column, raw rows, debounced
+// rows, rows removed as ghosting], for a column where any of them changed
+#define STREAM_HEADER_SIZE 7
+#define STREAM_RECORD_SIZE 5
+#define STREAM_RECORDS (((VENDOR_REPORT_SIZE) - STREAM_HEADER_SIZE) / STREAM_RECORD_SIZE)
+#define STREAM_LOST 0x80
+
+// core1 writes records straight into the packet they'll be sent in, and core0
+// passes full packets to tinyusb from the same memory. the ring has one writer
+// and one reader so it only needs the indices to be updated after the data. if
+// the ring fills up, records are dropped and the next packet is a full snapshot
+// so the host can get back in step
+class MatrixStream {
+    private:
+        uint8_t slots[STREAM_SLOTS][VENDOR_REPORT_SIZE];
+        volatile uint8_t head = 0; // next slot to be published, core1
+        volatile uint8_t tail = 0; // next slot to be sent, core0
+
+        // on core1
+        uint8_t *filling = NULL; // packet being filled
+        uint32_t fillingscan = 0;
+        uint32_t fillingtime = 0;
+        uint8_t sequence = 0;
+        bool lost = false;
+
+        volatile bool enabled = false;
+        volatile bool snapshot = false;
+        volatile uint32_t lostrecords = 0;
+
+        void publish();
+
+    public:
+        MatrixStream();
+
+        // core0
+        void enable(bool on);
+        bool isEnabled() { return enabled; };
+        const uint8_t* peek(); // the next packet to send, or NULL
+        void release(); // done with the packet from peek()
+        uint32_t getLost() { return lostrecords; };
+
+        // core1, while scanning
+        bool takeSnapshot(); // true if every column should be recorded this scan
+        void record(uint32_t scan, uint8_t column, uint8_t raw, uint8_t debounced, uint8_t ghosted);
+        void flush(uint32_t now); // send the part filled packet if it's old enough
+};
+
+extern MatrixStream StateStream;
+
+#endif
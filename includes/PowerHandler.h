@@ -0,0 +1,136 @@
+/*
+ * PowerHandler.h - low power while the computer is asleep, and waking it up
+ *                  again when a key is pressed
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef PowerHandler_h
+#define PowerHandler_h
+
+#include <cstdint>
+
+#include "hardware/vreg.h"
+
+// clk_sys while the computer is asleep (kHz), from the USB PLL (which has to
+// keep running for USB) so the system PLL can be turned off
+#define SUSPEND_CLOCK_KHZ 12000
+// clk_sys when nothing has been pressed for a while
+#define LOW_CLOCK_KHZ 48000
+// clk_sys while typing (the pico-sdk default)
+#define NORMAL_CLOCK_KHZ 125000
+// clk_sys during bursts of typing, scrolling and macros, an overclock that
+// needs the core voltage turned up a bit
+#define FAST_CLOCK_KHZ 200000
+#define FAST_CLOCK_VOLTAGE VREG_VOLTAGE_1_15
+// how long the regulator is given to get to a higher voltage (us)
+#define VREG_SETTLE_US 1000
+// how long to wait for the computer to resume after asking it to (ms)
+#define WAKEUP_TIMEOUT 1000
+
+// the clock governor, this many key changes within BURST_WINDOW (ms) is a
+// burst, which goes to the fast clock until FAST_HOLD (ms) after the last one
+#define BURST_KEYS 8
+#define BURST_WINDOW 1000
+#define FAST_HOLD 2000
+// no keys for this long (ms) goes to the low clock
+#define IDLE_TIMEOUT 30000
+
+enum clockProfile {
+    CLOCK_LOW = 0,
+    CLOCK_NORMAL,
+    CLOCK_FAST,
+    CLOCK_PROFILE_COUNT
+};
+
+struct clockProfileDefinition {
+    uint32_t khz;
+    enum vreg_voltage voltage; // at least this much is needed for khz
+};
+
+// the tinyusb callbacks can be in an interrupt, so they only set flags and
+// task() in the main loop does the work. while suspended:
+// - clk_sys is dropped to SUSPEND_CLOCK_KHZ and the system PLL is off
+// - core1 stops scanning and waits for a key press (MatrixScanner::park)
+// - the LED is off and its PIO stopped
+// a key press wakes the computer straight away if it allows remote wakeup
+//
+// the rest of the time clk_sys follows what the keyboard is doing (see the
+// clockProfile defines above). scanning and the USB reports are paced by the
+// timer, which runs from clk_ref, and USB has its own PLL, so only the LED's
+// PIO divider needs changing along with clk_sys. each profile is checked
+// with check_sys_clock_khz() in begin() and measured with the frequency
+// counter after switching to it, one that doesn't work out isn't used again
+class PowerHandler {
+    private:
+        volatile bool hostsuspended = false;
+        volatile bool remotewakeup = false; // the computer allows it
+        bool suspended = false;
+        bool wakingup = false; // asked the computer to wake, waiting for it to resume
+        uint64_t wakeuptime = 0;
+
+        uint32_t suspends = 0;
+        uint32_t keywakes = 0;
+
+        volatile bool governing = true;
+        bool available[CLOCK_PROFILE_COUNT] = {false, true, false};
+        clockProfile profile = CLOCK_NORMAL;
+        bool busy = false;
+        uint64_t lastactivity = 0;
+        uint64_t burststart = 0;
+        uint8_t burstcount = 0;
+        uint64_t fastuntil = 0;
+        uint32_t clockchanges = 0;
+
+        void enterSuspend();
+        void exitSuspend();
+        void governor();
+        bool setProfile(clockProfile to);
+
+    public:
+        PowerHandler();
+        void begin(); // check which clock profiles are possible
+        void task();
+        bool isSuspended() { return suspended; };
+
+        // what the clock governor goes on
+        void activity(); // a key changed
+        void setBusy(bool b) { busy = b; }; // scrolling, stays on the fast clock
+        void boost(); // the fast clock straight away, for macros played back in one go
+        void setGoverning(bool g) { governing = g; }; // false stays on the normal clock
+        bool getGoverning() { return governing; };
+        clockProfile getProfile() { return profile; };
+        uint32_t getClockChanges() { return clockchanges; };
+
+        // from the tinyusb callbacks in usb.h
+        void hostSuspend(bool remote_wakeup_en) { remotewakeup = remote_wakeup_en; hostsuspended = true; };
+        void hostResume() { hostsuspended = false; };
+
+        uint32_t getSuspendCount() { return suspends; };
+        uint32_t getKeyWakeCount() { return keywakes; };
+};
+
+extern PowerHandler Power;
+
+#endif
@@ -31,27 +31,60 @@
 
 #include "hardware/pio.h"
 
-// rgb strip information
+#include "PinMap.h"
+
+// rgb strip information, the first pixel is the status LED and any after it
+// are under the keys in matrix order (down then across, see keyPixel())
+#ifndef NUM_PIXELS
 #define NUM_PIXELS 1
-#define WS2812_PIN 0
+#endif
+#define WS2812_PIN PINMAP_LED_PIN
 #define IS_RGBW false
+#define WS2812_FREQ 800000
+// how long a frame takes to go out (us), 24 bits at 1.25 us a pixel and then
+// at least 50 us low so the pixels latch
+#define FRAME_US (NUM_PIXELS*30 + 80)
 
 // these should match WS2812_PIN
 #define LED_PIO pio0
 #define LED_SM 0
 
+// the animations run every RGB_TICK ms
+#define RGB_TICK 10
+// each tick a fade moves 1/2^FADE_SHIFT of the way to the target colour
+#define FADE_SHIFT 2
+// how far through a breath each tick goes (of 65536), about 2.5 s a breath
+#define BREATHE_STEP 256
+// the dimmest a breath gets (of 256)
+#define BREATHE_MIN 64
+
+enum rgbAnimation {
+    ANIMATION_FADE = 0, // ease over to the target colour and stay there
+    ANIMATION_BREATHE // the same, then get brighter and dimmer
+};
+
 class RGBHandler {
     private:
-        #if NUM_PIXELS != 1
-            #error "Currently only coded up for 1 pixel"
-        #endif
-        // stored as float so that dividing to get the smoothe gradient converges
-        float currentColor[3] = {0.0f, 0.0f, 0.0f};
-        float targetColor[3] = {0.0f, 0.0f, 0.0f};
-
-        // functions for sending the pixel color and converting r g b to a combined int for
-        // transfer to the pixels (see pico-examples)
-        void put_pixel(uint32_t pixel_grb) { pio_sm_put_blocking(LED_PIO, LED_SM, pixel_grb << 8u); };
+        // colours are how bright they look (0 to 255), and gamma corrected on the
+        // way out. current is Q8.8 so fades can move by less than a step
+        uint16_t currentColor[3] = {0, 0, 0};
+        uint8_t targetColor[3] = {0, 0, 0};
+        rgbAnimation animation = ANIMATION_FADE;
+        uint16_t phase = 0; // through a breath
+        uint8_t lastout[3] = {0, 0, 0}; // last sent to the status LED
+        volatile bool statuschanged = true; // the lock or USB state changed
+
+        void updateStatus();
+
+        // pixels are drawn into framebuffer and copied to dmabuffer for the DMA
+        // to feed to the PIO, so drawing never waits for the strip and a frame
+        // is always sent whole. each word is what the PIO shifts out, grb << 8
+        uint32_t framebuffer[NUM_PIXELS];
+        uint32_t dmabuffer[NUM_PIXELS];
+        int dmachannel = -1;
+        uint32_t laststart = 0; // time_us_32() the last frame started going out
+
+        // converting r g b to a combined int for transfer to the pixels (see pico-examples)
         uint32_t urgb_u32(uint8_t r, uint8_t g, uint8_t b) { 
             return ((uint32_t) (r) << 8) | ((uint32_t) (g) << 16) | (uint32_t) (b);
         };
@@ -65,14 +98,33 @@ class RGBHandler {
     public:
         RGBHandler();
         void begin();
-        void updateTargetColor(float r, float g, float b);
-
-        void setRed() { updateTargetColor(33, 0, 0); };
-        void setGreen() { updateTargetColor(0, 33, 0); };
-        void setBlue() { updateTargetColor(0, 0, 33); }
-        void setOrange() { updateTargetColor(30, 10, 0); };
-        void setPurple() { updateTargetColor(30, 0, 5); };
-        void setYellow() { updateTargetColor(17, 20, 0); }
+        void updateTargetColor(uint8_t r, uint8_t g, uint8_t b, rgbAnimation a = ANIMATION_FADE);
+        void statusChanged() { statuschanged = true; }; // from the USB callbacks
+        void suspend(); // LED off and the PIO stopped
+        void resume();
+        void flush(); // wait for the last frame to go out and latch
+        void clockChanged(); // clk_sys changed, keep the PIO at WS2812_FREQ
+
+        // draw into the framebuffer, nothing changes on the strip until show()
+        void setPixel(uint16_t n, uint8_t r, uint8_t g, uint8_t b) {
+            if (n < NUM_PIXELS) framebuffer[n] = urgb_u32(r, g, b) << 8u;
+        };
+        int16_t keyPixel(uint8_t down, uint8_t across) { // -1 if that key doesn't have one
+            uint16_t n = 1 + down*NUM_ACROSS + across;
+            return n < NUM_PIXELS ? n : -1;
+        };
+        void setKeyPixel(uint8_t down, uint8_t across, uint8_t r, uint8_t g, uint8_t b) {
+            int16_t n = keyPixel(down, across);
+            if (n >= 0) setPixel(n, r, g, b);
+        };
+        bool show(); // start sending the framebuffer, false if the last frame is still going
+
+        void setRed() { updateTargetColor(101, 0, 0); };
+        void setGreen() { updateTargetColor(0, 101, 0); };
+        void setBlue(rgbAnimation a = ANIMATION_FADE) { updateTargetColor(0, 0, 101, a); }
+        void setOrange() { updateTargetColor(96, 59, 0); };
+        void setPurple() { updateTargetColor(96, 0, 43); };
+        void setYellow() { updateTargetColor(74, 80, 0); }
 };
 
 extern RGBHandler RGB;
@@ -0,0 +1,101 @@
+/*
+ * ReportBuilder.h - keys that are only keys put into reports on core1, the
+ *                   rest left to the main loop
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef ReportBuilder_h
+#define ReportBuilder_h
+
+#include <cstdint>
+
+#include "KeyboardLayout.h"
+#include "USBKeyboard.h"
+
+// core1's reports waiting to be sent
+#define LIVE_SLOTS 16
+
+// core1 works out what each key is as it's scanned (see MatrixScanner::resolveKeys)
+// and, if it's a plain key, presses it in its own keySet here and publishes a
+// report's worth once the scan is done, which core0 sends as soon as the
+// endpoint is ready (see USBKeyboard::publish) with anything of its own added.
+// everything else is slow, it goes to the main loop through getPinState as
+// before: specials (which can type, play macros, or scroll), tap-hold and combo
+// keys, and any key while one of those is down, KeyResolver is deciding, or the
+// main loop hasn't caught up with a slow change yet, so a plain key can never
+// overtake something that came before it. a key's release goes the same way
+// as its press, but core1 doesn't publish it (or anything else) until the main
+// loop has caught up and KeyResolver has made up its mind, otherwise letting go
+// of shift would beat the tap-hold key it was held for to the host. core0 is still told about the plain keys, for macros and text
+// expansion, but doesn't press them again. the ring has one writer and one
+// reader, if it fills up core1 publishes what's down once there's room again
+class ReportBuilder {
+    private:
+        // core1
+        keySet keys;
+        bool fast[NUM_DOWN][NUM_ACROSS]; // the key's press went into keys
+        bool resolved[NUM_DOWN][NUM_ACROSS]; // tap-hold and combo keys, always slow
+        uint8_t slowheld = 0; // keys down that core0 is looking after
+        bool changed = false; // keys changed since they were last published
+        volatile uint32_t slowchanges = 0; // ever left to core0
+
+        // core0
+        bool fasttaken[NUM_DOWN][NUM_ACROSS]; // fast as of the last getPinState
+        uint32_t slowtaken = 0; // slowchanges as of the last getPinState
+        volatile uint32_t slowdone = 0; // slowchanges the main loop has finished with
+        volatile bool holding = false; // the main loop wants every key
+        volatile bool deciding = false; // KeyResolver is holding keys back
+
+        keySnapshot slots[LIVE_SLOTS];
+        volatile uint8_t head = 0; // next slot to be published, core1
+        volatile uint8_t tail = 0; // next slot to be sent, core0
+
+        // performance counters
+        volatile uint32_t published = 0;
+
+    public:
+        ReportBuilder();
+        void reset(); // from core0 while core1 is stopped
+
+        // core1, while it has the matrix mutex
+        void keymapChanged();
+        void keyChanged(uint8_t down, uint8_t across, bool pressed, uint8_t scancode);
+        void publish(); // after each scan
+        void snapshot(); // for core0, from getPinState
+
+        // core0
+        bool wasFast(uint8_t down, uint8_t across) { return fasttaken[down][across]; }; // as of the last getPinState
+        void slowDone(); // every change from the last getPinState has been dealt with
+        void setHolding(bool d, bool scrolling) { deciding = d; holding = d || scrolling; };
+        bool take(keySnapshot *s); // the next report's worth of keys, in order
+
+        uint32_t getPublished() { return published; };
+        uint32_t getSlowChanges() { return slowchanges; };
+        uint32_t getIgnoredKeys() { return keys.ignored; };
+};
+
+extern ReportBuilder Reports;
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * TextExpander.h - typing a trigger like ;fn replaces it with longer text
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef TextExpander_h
+#define TextExpander_h
+
+#include <cstdint>
+
+#include "Expansions.h"
+
+// the expansions come from boards/*.expand, which tools/expand.py turns into
+// a state machine in flash (see there). every key press the main loop hands
+// to the computer is also passed to keyChanged(), which is one lookup to the
+// next state, and when a trigger is finished it's backspaced over and the
+// text typed through TextQueue. nothing is allocated and the only RAM used is
+// the state below
+class TextExpander {
+    private:
+        expansionState state = 0;
+        uint8_t modifiers = 0; // held, in the format they're sent
+        volatile bool enabled = true;
+
+        void expand(uint8_t n);
+
+    public:
+        TextExpander();
+        void keyChanged(uint8_t k, bool pressed); // every key with a scancode, as it's sent
+        void reset() { state = 0; };
+
+        void setEnabled(bool e) { enabled = e; state = 0; };
+        bool getEnabled() { return enabled; };
+};
+
+extern TextExpander Expander;
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * TextQueue.h - text and key presses typed out a report at a time from the
+ *               main loop, alongside whatever is being typed live
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef TextQueue_h
+#define TextQueue_h
+
+#include <cstdint>
+#include <cstddef>
+
+#include "USBKeyboard.h"
+
+// steps waiting to be typed, enough for a couple of SPECIAL_RUNs
+#define TEXT_QUEUE_LENGTH 64
+
+enum textStepType {
+    TEXT_KEYS = 0, // press keys together, and let go of them in the next report
+    TEXT_DELAY // wait before going on
+};
+
+struct textStep {
+    uint8_t type; // textStepType
+    uint8_t modifiers; // held along with the keys, in the format they're sent
+    uint8_t count;
+    uint8_t keys[MAX_KEYS];
+    uint16_t delay; // ms
+};
+
+// SPECIAL_TYPE and SPECIAL_RUN used to type everything in one go from
+// handleSpecial, which held up the main loop (and the keys pressed in the
+// meantime) for as long as it took. now they queue up a job and task() sets
+// up a report's worth of it each time round the main loop, which goes out
+// with the live keys in the main loop's report. while a job plays:
+// - the modifiers the user is holding aren't sent, so they can't turn the
+//   text into shortcuts (they're back once the queue is empty)
+// - keys the user is holding stay down, the text's keys go alongside them
+//   (the text waits if it needs one of them, e.g. the end of an expansion's
+//   trigger, until it's let go, and with six keys held until there's room)
+// - escape, or cancel(), throws away everything still to be typed
+class TextQueue {
+    private:
+        textStep steps[TEXT_QUEUE_LENGTH];
+        uint8_t first = 0;
+        uint8_t count = 0;
+        uint8_t done = 0; // keys of the first step already typed
+        bool pressed = false; // keys are down, they're let go next time
+        uint64_t waituntil = 0; // for a TEXT_DELAY, 0 until it starts
+
+        // a job is queued all or nothing
+        uint8_t jobstart = 0;
+        bool jobfailed = false;
+
+        textStep* add();
+        void next();
+
+    public:
+        TextQueue();
+        void task(); // from the main loop
+
+        void startJob();
+        bool endJob(); // false if it didn't fit, nothing of it is kept
+        void queueKeys(const uint8_t *k, uint8_t length); // scancodes as with pressScancode
+        void queuePacked(const uint8_t *packed, size_t length); // from USBKeyboard::packText
+        void queueText(const char *text, size_t length);
+        void queueDelay(uint16_t ms);
+
+        void cancel();
+        bool busy() { return count > 0 || pressed; };
+};
+
+extern TextQueue Typing;
+
+#endif
@@ -30,39 +30,136 @@
 #ifndef USBKeyboard_h
 #define USBKeyboard_h
 
-#include <string>
-#include <vector>
+#include <algorithm>
 
-#include "Adafruit_TinyUSB_Arduino/src/Adafruit_TinyUSB.h"
+#include "Adafruit_TinyUSB.h"
 
 #define RID_KEYBOARD 1
 #define RID_MOUSE 2
 
+#define MAX_KEYS 6
+// keys that can be held down at once, past MAX_KEYS is overflowing
+#define MAX_HELD_KEYS 32
+// reports kept while waiting for the computer to finish setting up USB
+#define REPORT_QUEUE_LENGTH 32
+
+// text packed into the reports that type it (see USBKeyboard::packText), a
+// byte for each report with the number of keys in it and TYPED_SHIFT if
+// shift is held, then the keys. each lot of keys is pressed together in the
+// order given, and released together in the next report
+#define TYPED_SHIFT 0x80
+// longest packed text for length characters (a report for each at worst)
+#define TYPED_SIZE(length) (2*(length))
+
+struct keyboardReport {
+    uint8_t modifiers;
+    uint8_t keys[MAX_KEYS];
+};
+
+// a report's worth of a keySet, with how many keys there really are
+struct keySnapshot {
+    uint8_t modifiers;
+    uint8_t count; // more than MAX_KEYS is overflowing
+    uint8_t keys[MAX_KEYS];
+};
+
+// keys held down, newest first, and the modifiers in the format they're sent
+struct keySet {
+    uint8_t keys[MAX_HELD_KEYS] = {0}; // HID_KEY_NONE after count
+    uint8_t count = 0;
+    uint8_t modifiers = 0;
+    uint32_t ignored = 0; // presses with no room left, not reset by clear()
+
+    void press(uint8_t k);
+    void release(uint8_t k);
+    void clear();
+    void snapshot(keySnapshot *s);
+    bool contains(uint8_t k) { return std::find(keys, keys + count, k) != keys + count; };
+};
+
 class USBKeyboard {
     private:
-        std::vector<uint8_t> keys = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-        uint8_t modifiers = 0;
-        bool overflowing = false;
+        // keys pressed from core0, by specials, macros, and KeyResolver, and
+        // what core1 had down as of the last of its reports sent (see ReportBuilder)
+        keySet held;
+        keySnapshot live = {0, 0, {0}};
         const uint8_t overflow[6] = {0x01, 0x01, 0x01, 0x01, 0x01, 0x01};
 
         bool numLock = false;
         bool capsLock = false;
         bool scrollLock = false;
 
+        // performance counters
+        uint32_t reportcount = 0;
+        uint32_t overflowcount = 0; // changed reports sent with the overflow code
+        uint64_t mountedtime = 0; // us after power on
+        uint64_t firstreporttime = 0; // the first with a key or modifier in it
+
+        // keys can be pressed before USB is ready, they're sent in order once it is
+        keyboardReport queue[REPORT_QUEUE_LENGTH];
+        uint8_t queuefirst = 0;
+        uint8_t queuecount = 0;
+        keyboardReport lastsent = {0, {0}};
+
+        // keys being typed by TextQueue, sent ahead of the live ones, and
+        // while injecting only its modifiers are sent
+        uint8_t injected[MAX_KEYS];
+        uint8_t injectedcount = 0;
+        uint8_t injectedmodifiers = 0;
+        bool injecting = false;
+        bool injectedsent = true; // sendReport() has had the latest inject()
+
+        static volatile bool packing; // more than one key to a report when typing
+
+        void build(keyboardReport *report); // everything down, ready to go
+        void publish(); // core1's next report, if the computer is ready for it
+        void deliver(const keyboardReport *report); // waits for the computer
+        void queueReport(const keyboardReport *report);
+        void send(const keyboardReport *report);
+        void typeKeys(const uint8_t *k, uint8_t count, bool shift);
+
         void uk_hid_report_callback(uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize);
         friend void hid_report_callback(uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize);
 
     public:
         USBKeyboard();
-        void begin();
+        void begin(); // doesn't wait for the computer, see task()
+        void task(); // from the main loop, sends anything queued up and core1's reports
         void pressScancode(uint8_t k);
         void releaseScancode(uint8_t k);
-        void sendReport();
-        void type(std::string line);
+        void sendReport(); // after any of core1's reports that haven't been sent yet
+        void releaseAll(); // and tell the computer
+        void type(const char *line, size_t length);
+
+        // for TextQueue
+        bool ready(); // reports are going straight to the computer, nothing queued
+        uint8_t getFreeSlots();
+        bool isPressed(uint8_t k);
+        void inject(const uint8_t *k, uint8_t count, uint8_t modifiers); // sent with the next sendReport()
+        void endInjection(); // back to the live modifiers
+        bool isInjecting() { return injecting; };
+        bool injectionSent() { return injectedsent; };
+
+        // the next report's worth of keys from text, starting at pos, returns
+        // how many keys (0 at the end, 1 with packing off) and moves pos on past them
+        static uint8_t nextPacked(const char *text, size_t length, size_t *pos, uint8_t keys[MAX_KEYS], bool *shift);
+        // all of text, returns how much of packed was used (whole reports only, anything that doesn't fit is left off)
+        static size_t packText(const char *text, size_t length, uint8_t *packed, size_t size);
+        // with it off text is typed a key to a report, for computers that don't
+        // keep the order of the keys in a report (already packed text is split
+        // up as it's queued, see TextQueue::queuePacked)
+        static void setPacking(bool p) { packing = p; };
+        static bool getPacking() { return packing; };
 
         bool getNumLock() { return numLock; };
         bool getCapsLock() { return capsLock; };
         bool getScrollLock() { return scrollLock; };
+
+        uint32_t getReportCount() { return reportcount; };
+        uint32_t getOverflowCount() { return overflowcount; };
+        uint32_t getIgnoredKeys() { return held.ignored; };
+        uint64_t getMountedTime() { return mountedtime; };
+        uint64_t getFirstReportTime() { return firstreporttime; };
 };
 
 extern USBKeyboard Keyboard;
@@ -0,0 +1,154 @@
+/*
+ * VendorHID.h - a vendor defined HID interface for changing the configuration
+ *               and reading counters while the keyboard is running
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef VendorHID_h
+#define VendorHID_h
+
+#include "Adafruit_TinyUSB.h"
+
+#include "KeymapStore.h"
+
+// every request and response is one report of this size, without a report ID
+#define VENDOR_REPORT_SIZE 32
+// requests that can be waiting to be processed
+#define VENDOR_QUEUE_LENGTH 4
+// bump when the meaning of a command changes
+#define VENDOR_PROTOCOL_VERSION 1
+
+// a request is [command, sequence, arguments...], the response is
+// [command, sequence, status, data...] (the sequence is just copied back so the
+// host can match them up). multi-byte values are little endian
+enum vendorCommand {
+    VENDOR_INFO = 0x01, // -> protocol version, matrix size, and where things are in the keymap image
+    VENDOR_KEYMAP_READ = 0x10, // offset (2), length -> bytes of the active keymap image
+    VENDOR_KEYMAP_WRITE = 0x11, // offset (2), length, bytes -> written to the staged copy
+    VENDOR_KEYMAP_COMMIT = 0x12, // check the staged copy and switch to it
+    VENDOR_KEYMAP_SAVE = 0x13, // write the active keymap to flash
+    VENDOR_KEYMAP_DEFAULTS = 0x14, // stage the keymap the firmware was built with
+    VENDOR_PARAM_GET = 0x20, // parameter -> value (4)
+    VENDOR_PARAM_SET = 0x21, // parameter, value (4)
+    VENDOR_MACRO_READ = 0x30, // macro, index (2) -> length (2), count, (scancode, pressed) * count
+    VENDOR_MACRO_CLEAR = 0x31, // macro
+    VENDOR_MACRO_APPEND = 0x32, // macro, count, (scancode, pressed) * count
+    VENDOR_COUNTERS = 0x40, // first counter -> count, vendorCounter values (4 each)
+    VENDOR_STREAM = 0x50, // on/off, stream the state of the matrix (see MatrixStream.h)
+    VENDOR_STREAM_DATA = 0x51, // sent by the keyboard while streaming, never requested
+    VENDOR_RECORDER_READ = 0x60, // core, first record (4) -> head (4), count, eventRecords (see FlightRecorder.h)
+    VENDOR_KEY_STATS = 0x70, // down, across -> keyStats rejected, chatter, histogram, debounce time (2 each)
+    VENDOR_KEY_STATS_CLEAR = 0x71
+};
+
+enum vendorStatus {
+    VENDOR_OK = 0,
+    VENDOR_UNKNOWN_COMMAND,
+    VENDOR_BAD_ARGUMENT,
+    VENDOR_BUSY, // try again later (e.g. a keymap is waiting for core1 to swap to it)
+    VENDOR_FAILED
+};
+
+// timing parameters that can be changed while running, these aren't saved
+enum vendorParameter {
+    PARAM_DEBOUNCE_MS = 0,
+    PARAM_SETTLE_US,
+    PARAM_SCAN_INTERVAL_US,
+    PARAM_SCROLL_DELAY_MS,
+    PARAM_SCROLL_TIMEOUT_S,
+    PARAM_ADAPTIVE_DEBOUNCE, // 0 or 1, per key debounce times (see MatrixScanner.h)
+    PARAM_DEBOUNCE_MIN_MS,
+    PARAM_DEBOUNCE_MAX_MS,
+    PARAM_CLOCK_GOVERNOR, // 0 or 1, clk_sys follows typing (see PowerHandler.h)
+    PARAM_EXPANSIONS, // 0 or 1, text expansions (see TextExpander.h)
+    PARAM_RESOLVE_MAX_MS, // the most a tap-hold key or combo is held back (see KeyResolver.h)
+    PARAM_TEXT_PACKING, // 0 or 1, more than one key to a report when typing (see USBKeyboard::nextPacked)
+    PARAM_COUNT
+};
+
+enum vendorCounter {
+    COUNTER_UPTIME_MS = 0,
+    COUNTER_SCANS,
+    COUNTER_MAX_SCAN_US,
+    COUNTER_LOCK_MISSES,
+    COUNTER_REPORTS,
+    COUNTER_OVERFLOW_REPORTS,
+    COUNTER_VENDOR_REQUESTS,
+    COUNTER_VENDOR_DROPPED,
+    COUNTER_STREAM_LOST, // records that didn't fit in the stream
+    COUNTER_CORE1_RESTARTS, // core1 missed the scan deadline and was restarted
+    COUNTER_MOUNTED_US, // after power on, when the computer finished setting up USB
+    COUNTER_FIRST_REPORT_US, // after power on, when the first report with a key or modifier down was sent
+    COUNTER_SUSPENDS,
+    COUNTER_KEY_WAKES, // times a key press woke the computer
+    COUNTER_CLOCK_KHZ, // clk_sys right now
+    COUNTER_CLOCK_CHANGES,
+    COUNTER_RESOLVE_HELD, // key changes held back by KeyResolver
+    COUNTER_RESOLVE_MAX_US, // the longest any of them was
+    COUNTER_LIVE_REPORTS, // reports put together on core1 (see ReportBuilder)
+    COUNTER_SLOW_KEYS, // key changes core1 left to the main loop
+    COUNTER_IGNORED_KEYS, // presses past MAX_HELD_KEYS on either core
+    COUNTER_COUNT
+};
+
+// requests arrive in the tinyusb callback (which can be in an interrupt), so
+// they're only copied into a queue there. task() is called from the main loop
+// after the keys have been dealt with and handles one request at a time,
+// without ever waiting on USB, so configuring the keyboard can't hold up
+// typing on it. when there's nothing else to send, streamed matrix state is
+// sent instead
+class VendorHID {
+    private:
+        uint8_t queue[VENDOR_QUEUE_LENGTH][VENDOR_REPORT_SIZE];
+        volatile uint8_t queuehead = 0; // written by the callback
+        volatile uint8_t queuetail = 0; // written by task()
+        uint8_t response[VENDOR_REPORT_SIZE];
+        bool responsepending = false;
+
+        keymapImage *staged = NULL; // being edited, until it's committed
+
+        volatile uint32_t requests = 0;
+        volatile uint32_t dropped = 0; // arrived with the queue full
+
+        void process(const uint8_t *request, uint8_t *response);
+        uint8_t keymapWrite(const uint8_t *args);
+        uint8_t setParameter(uint8_t id, uint32_t value);
+        uint32_t getParameter(uint8_t id);
+        uint32_t getCounter(uint8_t id);
+
+        void vh_report_callback(uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize);
+        friend void vendor_report_callback(uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize);
+
+    public:
+        VendorHID();
+        void begin(); // call before the device is mounted
+        void task();
+};
+
+extern VendorHID Vendor;
+
+void vendor_report_callback(uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize);
+
+#endif
@@ -30,8 +30,7 @@
 
 bool macrorecording = false;
 // variables to store the recorded macros
-std::vector< std::vector<uint8_t> > macro_scancode(NUM_MACROS, std::vector<uint8_t>(0));
-std::vector< std::vector<uint8_t> > macro_pressed(NUM_MACROS, std::vector<uint8_t>(0));;
+macroRecording macros[NUM_MACROS];
 // the currently selected macro
 uint8_t activemacro = 0;
 
@@ -41,7 +40,15 @@ uint8_t activemacro = 0;
 void handleSpecial(uint8_t down, uint8_t across, bool pressed) { // pressed or released
     bool doprocess = false;
     uint8_t c;
-    for (c = 0; c < specials.size(); c++) {
+    // the specials come from the keymap in RAM, so they can be changed while running,
+    // everything here has to come from the one copy (see KeymapStore::current)
+    const activeKeymap active = Keymaps.current();
+    const keymapImage *image = active.image;
+    const specialEntry *specials = image->specials;
+    for (c = 0; c < image->numspecials; c++) {
+        if (specials[c].type == SPECIAL_TAP_HOLD || specials[c].type == SPECIAL_COMBO) {
+            continue; // KeyResolver takes care of these
+        }
         if (!specials[c].twokey) {
             if (specials[c].down == down && specials[c].across == across) {
                 doprocess = true;
@@ -61,12 +68,14 @@ void handleSpecial(uint8_t down, uint8_t across, bool pressed) { // pressed or r
 
     switch (specials[c].type) {
         case SPECIAL_TYPE:
-            if (pressed) {
-                Keyboard.type(specials[c].topress);
+            if (pressed) { // typed out from the main loop (see TextQueue)
+                Typing.startJob();
+                Typing.queuePacked(active.packed[c].data, active.packed[c].length);
+                Typing.endJob();
             }
             break;
         case SPECIAL_PRESS:
-            for (uint8_t d = 0; d < specials[c].topress.length(); d++) {
+            for (uint8_t d = 0; d < specials[c].length; d++) {
                 if (pressed) {
                     Keyboard.pressScancode(specials[c].topress[d]);
                 }
@@ -77,17 +86,12 @@ void handleSpecial(uint8_t down, uint8_t across, bool pressed) { // pressed or r
             break;
         case SPECIAL_RUN: // opens a terminal (alt-f3 is my key combo for that) and runs a command
             if (!pressed) {
-                Keyboard.pressScancode(HID_KEY_ALT_RIGHT);
-                Keyboard.pressScancode(HID_KEY_F3);
-                Keyboard.sendReport();
-
-                Keyboard.releaseScancode(HID_KEY_F3);
-                Keyboard.releaseScancode(HID_KEY_ALT_RIGHT);
-                Keyboard.sendReport();
-
-                sleep_ms(150); // need to wait for the terminal to open
-                Keyboard.type(specials[c].topress);
-                Keyboard.type("\n");
+                const uint8_t terminal[2] = {HID_KEY_ALT_RIGHT, HID_KEY_F3};
+                Typing.startJob();
+                Typing.queueKeys(terminal, 2);
+                Typing.queueDelay(150); // need to wait for the terminal to open
+                Typing.queuePacked(active.packed[c].data, active.packed[c].length); // with a newline
+                Typing.endJob();
             }
             break;
         case SPECIAL_SCROLL:
@@ -97,12 +101,13 @@ void handleSpecial(uint8_t down, uint8_t across, bool pressed) { // pressed or r
             if (!pressed) { // released
                 if (macrorecording == false) {
                     activemacro = specials[c].topress[0]-1; // stored variable starts at 0x01, need to subtract 1 for array index
-                    macro_scancode[activemacro].clear();
-                    macro_pressed[activemacro].clear();
+                    macros[activemacro].length = 0;
                     macrorecording = true;
+                    Recorder.record(EVENT_MACRO, MACRO_RECORD_START, activemacro+1);
                 }
                 else {
                     macrorecording = false;
+                    Recorder.record(EVENT_MACRO, MACRO_RECORD_STOP, activemacro+1, macros[activemacro].length);
                 }
             }
             break;
@@ -112,20 +117,24 @@ void handleSpecial(uint8_t down, uint8_t across, bool pressed) { // pressed or r
                     macrorecording = false;
                 }
                 activemacro = specials[c].topress[0]-1;
+                Recorder.record(EVENT_MACRO, MACRO_SELECT, activemacro+1);
             }
             break;
         case SPECIAL_MACRO: // play back macro
             if (!pressed) { // released
                 if (macrorecording) {
                     macrorecording = false;
+                    Recorder.record(EVENT_MACRO, MACRO_RECORD_STOP, activemacro+1, macros[activemacro].length);
                 }
                 else {
-                    for (uint8_t d = 0; d < macro_scancode[activemacro].size(); d++) {
-                        if (macro_pressed[activemacro][d]) {
-                            Keyboard.pressScancode(macro_scancode[activemacro][d]);
+                    Recorder.record(EVENT_MACRO, MACRO_PLAY, activemacro+1, macros[activemacro].length);
+                    Power.boost();
+                    for (uint16_t d = 0; d < macros[activemacro].length; d++) {
+                        if (macros[activemacro].pressed[d]) {
+                            Keyboard.pressScancode(macros[activemacro].scancode[d]);
                         }
                         else {
-                            Keyboard.releaseScancode(macro_scancode[activemacro][d]);
+                            Keyboard.releaseScancode(macros[activemacro].scancode[d]);
                         }
                         Keyboard.sendReport();
                     }
@@ -146,3 +155,35 @@ void handleSpecial(uint8_t down, uint8_t across, bool pressed) { // pressed or r
     return;
 }
 
+// called for every key change, once KeyResolver has decided what it is
+void handleKey(uint8_t down, uint8_t across, bool pressed, uint8_t scancode, bool reported) {
+    if (scancode == HID_KEY_ESCAPE && pressed) {
+        Typing.cancel(); // stop typing anything from the specials (escape still goes to the computer)
+    }
+    if (scancode == 0xFF) { // a special case key
+        handleSpecial(down, across, pressed);
+    }
+    else if (isLayerKey(scancode)) {
+        // nothing to send, layers are taken care of by the scanner
+    }
+    else if (!doscroll) { // only handle regular keys if we're not scrolling
+        if (reported) {
+            // already down (or up) in core1's report
+        }
+        else if (pressed) {
+            Keyboard.pressScancode(scancode);
+        }
+        else {
+            Keyboard.releaseScancode(scancode);
+        }
+        Expander.keyChanged(scancode, pressed);
+    }
+    else {
+        // a scroll key was probably triggered
+        // reset scroll time delay so that scrolling will immediately trigger
+        lastscroll = lastpress - scrolldelay*1000;
+    }
+    if (macrorecording && !doscroll && scancode != 0xFF && !isLayerKey(scancode) && scancode != HID_KEY_NONE) { // shouldn't ever hit none, but just to be safe...
+        macros[activemacro].add(scancode, pressed); // anything past MACRO_MAX_LENGTH isn't kept
+    }
+}
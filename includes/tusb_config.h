@@ -79,14 +79,16 @@ extern "C" {
 #endif
 
 //------------- CLASS -------------//
-#define CFG_TUD_HID             1
+#define CFG_TUD_HID             2 // keyboard/mouse and the vendor configuration interface
 #define CFG_TUD_CDC             0
 #define CFG_TUD_MSC             0
 #define CFG_TUD_MIDI            0
 #define CFG_TUD_VENDOR          0
 
 // HID buffer size Should be sufficient to hold ID (if any) + Data
-#define CFG_TUD_HID_BUFSIZE     16
+// (the vendor interface uses 32 byte reports, see VendorHID.h)
+#define CFG_TUD_HID_BUFSIZE     64
+#define CFG_TUD_HID_EP_BUFSIZE  64
 
 #ifdef __cplusplus
 }
@@ -26,28 +26,12 @@
  *
  */
 
-#include "bsp/board.h"
-
-//--------------------------------------------------------------------+
-// Device callbacks
-//--------------------------------------------------------------------+
-
-// Invoked when device is mounted
-void tud_mount_cb(void) {
-}
+#ifndef usb_h
+#define usb_h
 
-// Invoked when device is unmounted
-void tud_umount_cb(void) {
-}
-
-// Invoked when usb bus is suspended
-// remote_wakeup_en : if host allow us  to perform remote wakeup
-// Within 7ms, device must draw an average of current less than 2.5 mA from bus
-void tud_suspend_cb(bool remote_wakeup_en) {
-    (void) remote_wakeup_en;
-}
+#include "bsp/board.h"
 
-// Invoked when usb bus is resumed
-void tud_resume_cb(void) {
-}
+// the device callbacks (mount, suspend, etc.) are in usb.cpp, so there's one
+// of each however many files include this
 
+#endif
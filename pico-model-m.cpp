@@ -31,15 +31,25 @@
 #include "pico/binary_info.h"
 #include "pico/bootrom.h"
 #include "hardware/gpio.h"
+#include "hardware/watchdog.h"
 
 #include "KeyboardLayout.h"
 #include "USBKeyboard.h"
 #include "MatrixScanner.h"
 #include "RGBHandler.h"
+#include "KeymapStore.h"
+#include "VendorHID.h"
+#include "FlightRecorder.h"
+#include "PowerHandler.h"
+#include "TextQueue.h"
+#include "TextExpander.h"
+#include "KeyResolver.h"
+#include "ReportBuilder.h"
 
 // status of what's active on the matrix
 bool pinstate[NUM_DOWN][NUM_ACROSS];
 bool lastpinstate[NUM_DOWN][NUM_ACROSS]; // so we can detect a change
+uint8_t keycodes[NUM_DOWN][NUM_ACROSS]; // what the keymap says each key is
 
 // these variables are needed for mouse scrolling
 extern Adafruit_USBD_HID usb_hid; // for sending mouseReports
@@ -48,112 +58,192 @@ bool doscroll = false; // to true
 // then press down an arrow key, mouse scrolls will be sent at 
 // scroll delay (ms) intervals
 #define SCROLL_DELAY 150
+uint32_t scrolldelay = SCROLL_DELAY; // can be changed while running (see VendorHID)
 // to make sure we don't get stuck scrolling, we have a time out 
 // in seconds to deactivate scrolling mode
 uint64_t lastscroll = 0; // the last time we sent a mouse scroll, for the delay
 #define SCROLL_TIMEOUT 30
+uint32_t scrolltimeout = SCROLL_TIMEOUT;
 // variable to store when the last time a key was pressed for the timeout
 uint64_t lastpress = 0;
 
+// if the main loop stops for this long (ms) the hardware watchdog reboots the pico
+#define WATCHDOG_TIMEOUT 3000
+// if core1 gets stuck again this soon (ms) after being restarted, restarting
+// isn't helping, so leave it to the watchdog
+#define RESTART_HOLDOFF 10000
+uint64_t lastrestart = 0;
+bool feedwatchdog = true;
+
+#if defined(MODEL_M_HEAP_FREE) && !defined(PICO_MODEL_M_SIM)
+// linked with --wrap=_sbrk, so the first malloc (or new) that needs memory
+// ends up here, better to stop loudly than find out after months of uptime
+extern "C" void *__wrap__sbrk(int incr) {
+    panic("heap used in a heap-free build (%d bytes)", incr);
+}
+#endif
+
 #include "pico-model-m.h"
 
-int main() {
-    bi_decl(bi_program_description("Firmware to scan an IBM Model M keyboard matrix and register as a USB Keyboard"));
-    bi_decl(bi_program_version_string(VERSION));
-    bi_decl(bi_program_build_date_string(BUILD_TIME));
-    bi_decl(bi_program_url("https://github.com/guruthree/pico-model-m"));
-    bi_decl(bi_1pin_with_name(WS2812_PIN, "ws2812 RGB LED"));
-    bi_decl(bi_pin_mask_with_name(0xfffff << 1, "Matrix columns"));
-    bi_decl(bi_pin_mask_with_name(0xff << 21, "Matrix rows"));
-    bi_decl(bi_program_feature("USB HID, GPIO, RGB"))
+// everything that gets going before the main loop, split from main() so the
+// simulator (see sim/) can run the same code
+void setup() {
     TinyUSBDevice.detach(); // don't do anything USB until we're ready
 
+    // start recording events, keeping those from before a watchdog reboot
+    Recorder.begin();
+
+    // work out which clock speeds can be used
+    Power.begin();
+
     // initialise RGB
     RGB.begin();
     RGB.setBlue();
 
-    // initialise USB (it'll wait here until plugged in)
-    Keyboard.begin();
-//    sleep_ms(3000); // let USB settle (needed for my KVM?)
-
     // initialise variables for detecting key press
     for (uint8_t i = 0; i < NUM_ACROSS; i++) {
         for (uint8_t j = 0; j < NUM_DOWN; j++) {
             pinstate[j][i] = 0;
             lastpinstate[j][i] = 0;
+            keycodes[j][i] = HID_KEY_NONE;
         }
     }
 
+    // load the keymap, either as last saved to flash or the defaults
+    Keymaps.begin();
+
     // initialise the keyboard matrix
-    // this will launch the matrix scan onto the second core
+    // this will launch the matrix scan onto the second core, before USB so
+    // that keys pressed while the computer is still setting up aren't lost
     KeyMatrix.begin();
 
-    // main loop
-    while (1) {
+    // initialise USB, this doesn't wait to be plugged in, reports are queued
+    // until the computer is ready for them (see USBKeyboard::task)
+    Keyboard.begin();
+//    sleep_ms(3000); // let USB settle (needed for my KVM?)
+
+    // last resort if anything gets stuck, the flight recorder notes a watchdog reboot
+    watchdog_enable(WATCHDOG_TIMEOUT, true);
+}
+
+// the main loop
+void loop() {
+    if (feedwatchdog) {
+        watchdog_update();
+    }
+
+    // go into or come out of low power if the computer is asleep, otherwise
+    // pick a clock speed for how busy the keyboard is
+    Power.setBusy(doscroll);
+    Power.task();
+
+    // send anything queued up from before USB was ready, and the next of
+    // core1's reports if the computer is ready for it
+    Keyboard.task();
 
-        // if we secured the mutex lock on pinstate we can process changes
-        if (KeyMatrix.getPinState(pinstate, lastpinstate)) {
-            // check state against last state
-            // if it's changed, print an update
-            // copy state to last state
-            for (uint8_t i = 0; i < NUM_ACROSS; i++) {
-                for (uint8_t j = 0; j < NUM_DOWN; j++) {
-                    if (pinstate[j][i] != lastpinstate[j][i]) { // the pin has changed, do something
-                        lastpress = to_us_since_boot(get_absolute_time());
-                        uint8_t scancode = keyboardlayout[j][i];
-                        if (scancode == 0xFF) { // a special case key
-                            handleSpecial(j, i, pinstate[j][i]);
-                        }
-                        else if (!doscroll) { // only handle regular keys if we're not scrolling
-                            if (pinstate[j][i]) {
-                                Keyboard.pressScancode(scancode);
-                            }
-                            else {
-                                Keyboard.releaseScancode(scancode);
-                            }
-                        }
-                        else {
-                            // a scroll key was probably triggered
-                            // reset scroll time delay so that scrolling will immediately trigger
-                            lastscroll = lastpress - SCROLL_DELAY*1000;
-                        }
-                        if (macrorecording && !doscroll && scancode != 0xFF && scancode != HID_KEY_NONE) { // shouldn't ever hit none, but just to be safe...
-                            macro_scancode[activemacro].push_back(scancode);
-                            macro_pressed[activemacro].push_back(pinstate[j][i]);
-                        }
+    // the next bit of any text from the specials, it goes with the report below
+    Typing.task();
+
+    // tap-hold keys that have now been held long enough, and combos that didn't
+    // happen in time, these go with the report below too
+    Resolver.task();
+
+    // make sure core1 is still scanning, if it isn't it's restarted and
+    // anything it had pressed is released
+    if (KeyMatrix.stalled()) {
+        uint64_t now = to_us_since_boot(get_absolute_time());
+        if (lastrestart != 0 && now - lastrestart < RESTART_HOLDOFF*1000) {
+            feedwatchdog = false;
+        }
+        else {
+            KeyMatrix.restart();
+            Resolver.reset();
+            Keyboard.releaseAll();
+            lastrestart = now;
+        }
+    }
+
+    // if we secured the mutex lock on pinstate we can process changes
+    if (KeyMatrix.getPinState(pinstate, lastpinstate, keycodes)) {
+        // check state against last state
+        // if it's changed, print an update
+        // copy state to last state
+        for (uint8_t i = 0; i < NUM_ACROSS; i++) {
+            for (uint8_t j = 0; j < NUM_DOWN; j++) {
+                if (pinstate[j][i] != lastpinstate[j][i]) { // the pin has changed, do something
+                    lastpress = to_us_since_boot(get_absolute_time());
+                    Power.activity();
+                    if (Reports.wasFast(j, i)) {
+                        // core1 has sent it already, this is for macros and text expansion
+                        handleKey(j, i, pinstate[j][i], keycodes[j][i], true);
+                    }
+                    else {
+                        // tap-hold keys and combos are worked out first, everything
+                        // else goes straight on to handleKey()
+                        Resolver.keyChanged(j, i, pinstate[j][i], keycodes[j][i]);
                     }
                 }
             }
-            Keyboard.sendReport();
         }
+        // core1 leaves every key to us while anything is being held back
+        Reports.setHolding(Resolver.isDeciding(), doscroll);
+        Reports.slowDone();
+        Keyboard.sendReport();
+    }
 
 
-        if (doscroll) { // intercept for scrolling
-            uint64_t now = to_us_since_boot(get_absolute_time());
-            if (now - lastscroll > SCROLL_DELAY*1000) { // only scroll every so often
-                while( !usb_hid.ready() ) {
-                    sleep_us(100);
-                }
-                if (pinstate[0][16] == true) {
+    if (doscroll && TinyUSBDevice.mounted() && !Power.isSuspended()) { // intercept for scrolling
+        uint64_t now = to_us_since_boot(get_absolute_time());
+        if (now - lastscroll > scrolldelay*1000) { // only scroll every so often
+            while( !usb_hid.ready() && !Power.isSuspended() && TinyUSBDevice.mounted() && !TinyUSBDevice.suspended() ) {
+                watchdog_update();
+                sleep_us(100);
+            }
+            // which keys are the arrows comes from the board's .pins file
+            const uint8_t (*arrow)[2] = BoardPinMap::scroll;
+            if (BoardPinMap::hasscroll) {
+                if (pinstate[arrow[0][0]][arrow[0][1]] == true) {
                     usb_hid.mouseReport(RID_MOUSE,0,0,0,1,0); // scroll up
                 }
-                else if (pinstate[0][15] == true) {
+                else if (pinstate[arrow[1][0]][arrow[1][1]] == true) {
                     usb_hid.mouseReport(RID_MOUSE,0,0,0,-1,0); // scroll down
                 }
-                if (pinstate[1][19] == true) {
+                if (pinstate[arrow[2][0]][arrow[2][1]] == true) {
                     usb_hid.mouseReport(RID_MOUSE,0,0,0,0,1); // scroll right
                 }
-                else if (pinstate[6][0] == true) {
+                else if (pinstate[arrow[3][0]][arrow[3][1]] == true) {
                     usb_hid.mouseReport(RID_MOUSE,0,0,0,0,-1); // scroll left
                 }
-                lastscroll = now;
-            }
-            else if (now - lastpress > SCROLL_TIMEOUT*1e6) {
-                // after X inactive seconds exit out of scroll mode
-                doscroll = false;
             }
+            lastscroll = now;
+        }
+        else if (now - lastpress > scrolltimeout*1000000ull) {
+            // after X inactive seconds exit out of scroll mode
+            doscroll = false;
         }
+    }
 
-        sleep_us(500); // I think the above code takes a couple milliseconds, so around a 200 hz refresh?
+    // configuration and telemetry requests, after the keyboard has had its turn
+    Vendor.task();
+
+    sleep_us(500); // I think the above code takes a couple milliseconds, so around a 200 hz refresh?
+}
+
+// the simulator (see sim/) has its own main() and runs setup() and loop() itself
+#ifndef PICO_MODEL_M_SIM
+int main() {
+    bi_decl(bi_program_description("Firmware to scan an IBM Model M keyboard matrix and register as a USB Keyboard"));
+    bi_decl(bi_program_version_string(VERSION));
+    bi_decl(bi_program_build_date_string(BUILD_TIME));
+    bi_decl(bi_program_url("https://github.com/guruthree/pico-model-m"));
+    bi_decl(bi_1pin_with_name(WS2812_PIN, "ws2812 RGB LED"));
+    bi_decl(bi_pin_mask_with_name(PINMAP_ACROSS_MASK, "Matrix columns"));
+    bi_decl(bi_pin_mask_with_name(PINMAP_DOWN_MASK, "Matrix rows"));
+    bi_decl(bi_program_feature("USB HID, GPIO, RGB"))
+
+    setup();
+    while (1) {
+        loop();
     }
 }
+#endif
@@ -0,0 +1,197 @@
+/*
+ * Membrane.cpp - an electrical model of a diode-less membrane for the
+ *                simulator, with settling, bouncing contacts, and sneak paths
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include "Membrane.h"
+
+bool membraneParams::set(const char *name, double value) {
+    if (strcmp(name, "rise") == 0) rise = value;
+    else if (strcmp(name, "risepercolumn") == 0) risepercolumn = value;
+    else if (strcmp(name, "fall") == 0) fall = value;
+    else if (strcmp(name, "threshold") == 0) threshold = value;
+    else if (strcmp(name, "bounce") == 0) bounce = value;
+    else if (strcmp(name, "bouncespread") == 0) bouncespread = value;
+    else if (strcmp(name, "bounces") == 0) bounces = value;
+    else if (strcmp(name, "missing") == 0) missing = value;
+    else if (strcmp(name, "seed") == 0) seed = value;
+    else return false;
+    return true;
+}
+
+MembraneMatrix::MembraneMatrix(const membraneParams &p) : params(p), rng(p.seed) {
+    for (uint8_t j = 0; j < NUM_DOWN; j++) {
+        tau[j] = params.fall;
+    }
+}
+
+// a breadth first search from the driven columns, counting the contacts on
+// the shortest path to each row. a weak contact only conducts on its own,
+// straight from a driven column to its row
+void MembraneMatrix::connect() {
+    uint8_t keys[NUM_DOWN] = {}; // on the path to each row, 0 if there isn't one
+    uint8_t origin[NUM_DOWN] = {}; // column the path starts from
+    bool strong[NUM_DOWN] = {}; // reached without a weak contact, so the path can go on
+    for (uint8_t i = 0; i < NUM_ACROSS; i++) {
+        if (!(driven & (1u << i))) {
+            continue;
+        }
+        for (uint8_t j = 0; j < NUM_DOWN; j++) {
+            if (contact[j][i] && (keys[j] == 0 || (!strong[j] && !weak[j][i]))) {
+                keys[j] = 1;
+                origin[j] = i;
+                strong[j] = !weak[j][i];
+            }
+        }
+    }
+
+    // each step goes from a row along a key to a column, and back down another
+    // key to a new row
+    bool columnseen[NUM_ACROSS] = {};
+    for (uint8_t length = 1; ; length += 2) {
+        bool more = false;
+        for (uint8_t j = 0; j < NUM_DOWN; j++) {
+            if (keys[j] != length || !strong[j]) {
+                continue;
+            }
+            for (uint8_t i = 0; i < NUM_ACROSS; i++) {
+                if (columnseen[i] || (driven & (1u << i)) || !contact[j][i] || weak[j][i]) {
+                    continue;
+                }
+                columnseen[i] = true;
+                for (uint8_t j2 = 0; j2 < NUM_DOWN; j2++) {
+                    if (keys[j2] == 0 && contact[j2][i] && !weak[j2][i]) {
+                        keys[j2] = length + 2;
+                        origin[j2] = origin[j];
+                        strong[j2] = true;
+                        more = true;
+                    }
+                }
+            }
+        }
+        if (!more) {
+            break;
+        }
+    }
+
+    for (uint8_t j = 0; j < NUM_DOWN; j++) {
+        if (keys[j] > 0) {
+            target[j] = 1.0;
+            tau[j] = (params.rise + params.risepercolumn*origin[j]) * keys[j];
+        }
+        else {
+            target[j] = 0.0;
+            tau[j] = params.fall;
+        }
+    }
+}
+
+void MembraneMatrix::charge(uint64_t now) {
+    if (now <= updated) {
+        return;
+    }
+    double dt = now - updated;
+    for (uint8_t j = 0; j < NUM_DOWN; j++) {
+        voltage[j] = target[j] + (voltage[j] - target[j]) * exp(-dt / tau[j]);
+    }
+    updated = now;
+}
+
+void MembraneMatrix::advance(uint64_t now) {
+    while (!bouncing.empty() && bouncing.begin()->first <= now) {
+        uint64_t t = bouncing.begin()->first;
+        uint16_t k = bouncing.begin()->second;
+        bouncing.erase(bouncing.begin());
+        charge(t);
+        contact[k / NUM_ACROSS][k % NUM_ACROSS] = !contact[k / NUM_ACROSS][k % NUM_ACROSS];
+        connect();
+    }
+    charge(now);
+}
+
+// the contact changes now, then opens and closes again a few times over a
+// log normal bounce time before settling
+void MembraneMatrix::change(uint8_t down, uint8_t across, bool closed) {
+    uint64_t now = Sim.now();
+    advance(now);
+    uint16_t k = down*NUM_ACROSS + across;
+    for (auto b = bouncing.begin(); b != bouncing.end(); ) {
+        b = b->second == k ? bouncing.erase(b) : std::next(b);
+    }
+    contact[down][across] = closed;
+    connect();
+
+    if (params.bounce <= 0 || params.bounces == 0) {
+        return;
+    }
+    std::lognormal_distribution<double> duration(log(params.bounce), params.bouncespread);
+    double length = duration(rng);
+    uint8_t count = 2 * (1 + rng() % params.bounces); // an even number, so it ends up where it should
+    std::uniform_real_distribution<double> when(1, length > 1 ? length : 1);
+    std::vector<uint64_t> times;
+    for (uint8_t c = 0; c < count; c++) {
+        times.push_back(now + (uint64_t)when(rng));
+    }
+    std::sort(times.begin(), times.end());
+    for (uint64_t t : times) {
+        bouncing.insert(std::make_pair(t, k));
+    }
+}
+
+void MembraneMatrix::press(uint8_t down, uint8_t across) {
+    pressed[down][across] = true;
+    weak[down][across] = std::uniform_real_distribution<double>(0, 1)(rng) < params.missing;
+    change(down, across, true);
+}
+
+void MembraneMatrix::release(uint8_t down, uint8_t across) {
+    pressed[down][across] = false;
+    change(down, across, false);
+}
+
+void MembraneMatrix::drive(uint32_t columns, uint64_t now) {
+    advance(now);
+    driven = columns;
+    connect();
+}
+
+uint8_t MembraneMatrix::readRows(uint32_t columns, uint64_t now) {
+    if (columns != driven) {
+        drive(columns, now);
+    }
+    advance(now);
+    uint8_t rows = 0;
+    for (uint8_t j = 0; j < NUM_DOWN; j++) {
+        if (voltage[j] > params.threshold) {
+            rows |= (1 << j);
+        }
+    }
+    return rows;
+}
@@ -0,0 +1,95 @@
+/*
+ * Membrane.h - an electrical model of a diode-less membrane for the simulator,
+ *              with settling, bouncing contacts, and sneak paths
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef Membrane_h
+#define Membrane_h
+
+#include <cstdint>
+#include <map>
+#include <random>
+
+#include "Simulator.h"
+
+// what the membrane is like. the defaults are a guess at a Model M's, to be
+// replaced with measurements from a real one (e.g. a row on a scope while its
+// column is driven, and a key pressed on a logic analyser)
+struct membraneParams {
+    double rise = 1.5; // us, time constant for a row to charge from column 0 through one key
+    double risepercolumn = 0.1; // us more for each column further along the tail
+    double fall = 4.0; // us, time constant for a row to discharge through its pull down
+    double threshold = 0.5; // of the supply, a row reads high above this
+    double bounce = 800; // us, median time a contact bounces for after a press or release
+    double bouncespread = 0.5; // sigma of the log normal the bounce time comes from
+    uint8_t bounces = 4; // most times a contact opens and closes again while bouncing
+    double missing = 0.02; // chance a press is too light to carry a sneak path
+    uint32_t seed = 1;
+
+    bool set(const char *name, double value); // by name, false if there's no such parameter
+};
+
+// with no diodes, a row is connected to the column being driven through any
+// chain of closed contacts, not just the key at the crossing, so three keys
+// in a rectangle light up the fourth corner (ghosting). every contact in the
+// chain adds to the resistance, so a sneak path is slower to charge the row
+// than a key on its own, and a light press may not conduct well enough for
+// the path to show at all, which is the corner that sometimes doesn't read
+// (see preventGhosting). each row is an RC charging towards the supply
+// while connected and discharging through its pull down while not, and reads
+// high above the threshold, so a short settle delay misses keys on slow
+// columns and sees the last column's keys on the next. presses and releases
+// bounce for a random time before the contact settles
+class MembraneMatrix : public VirtualMatrix {
+    private:
+        membraneParams params;
+        std::mt19937 rng;
+
+        bool contact[NUM_DOWN][NUM_ACROSS] = {}; // closed right now, bouncing or not
+        bool weak[NUM_DOWN][NUM_ACROSS] = {}; // pressed too lightly to be part of a sneak path
+        std::multimap<uint64_t, uint16_t> bouncing; // contacts still to change, down*NUM_ACROSS + across
+
+        uint32_t driven = 0;
+        double voltage[NUM_DOWN] = {}; // of each row, as a fraction of the supply
+        double target[NUM_DOWN] = {}; // where each row is heading
+        double tau[NUM_DOWN]; // and how quickly, us
+        uint64_t updated = 0; // when voltage was worked out for
+
+        void connect(); // work out target and tau from the contacts and the driven columns
+        void charge(uint64_t now);
+        void advance(uint64_t now); // the rows and contacts as of now
+        void change(uint8_t down, uint8_t across, bool closed);
+
+    public:
+        MembraneMatrix(const membraneParams &p = membraneParams());
+
+        void press(uint8_t down, uint8_t across) override;
+        void release(uint8_t down, uint8_t across) override;
+        uint8_t readRows(uint32_t columns, uint64_t now) override;
+        void drive(uint32_t columns, uint64_t now) override;
+};
+
+#endif
@@ -0,0 +1,688 @@
+/*
+ * Simulator.cpp - runs the firmware on Linux against a virtual matrix and a
+ *                 virtual USB host, for trying things out and testing
+ *                 without a keyboard
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <cstring>
+
+#include "Simulator.h"
+#include "USBKeyboard.h"
+
+// from pico-model-m.cpp
+void setup();
+void loop();
+
+// the coroutines don't need much, but the firmware uses std::vector and std::string
+#define SIM_STACK_SIZE (1024 * 1024)
+
+//--------------------------------------------------------------------+
+// the scheduler
+//--------------------------------------------------------------------+
+
+Simulator::Simulator() {
+}
+
+void Simulator::begin() {
+    memset(sim_flash, 0xFF, sizeof(sim_flash)); // erased
+    stacks[SIM_CORE0].resize(SIM_STACK_SIZE);
+    getcontext(&cores[SIM_CORE0]);
+    cores[SIM_CORE0].uc_stack.ss_sp = stacks[SIM_CORE0].data();
+    cores[SIM_CORE0].uc_stack.ss_size = SIM_STACK_SIZE;
+    cores[SIM_CORE0].uc_link = &scheduler;
+    makecontext(&cores[SIM_CORE0], core0Main, 0);
+    core0started = true;
+}
+
+void Simulator::core0Main() {
+    try {
+        setup();
+        while (1) {
+            loop();
+        }
+    }
+    catch (const SimHalt &h) {
+        Sim.halted = h.reason;
+    }
+    while (1) {
+        Sim.yield();
+    }
+}
+
+void Simulator::core1Main() {
+    try {
+        Sim.core1entry();
+    }
+    catch (const SimHalt &h) {
+        Sim.halted = h.reason;
+    }
+    while (1) {
+        Sim.yield();
+    }
+}
+
+void Simulator::at(uint64_t time, std::function<void()> f) {
+    events.insert(std::make_pair(time, f));
+}
+
+// interrupts go before core1 and core1 before core0 if they're due at the same time
+uint64_t Simulator::nextDue(simContext *c) {
+    uint64_t due = UINT64_MAX;
+    if (!events.empty()) {
+        due = events.begin()->first;
+        *c = SIM_IRQ;
+    }
+    for (repeating_timer_t *t : timers) {
+        if (t->next < due) {
+            due = t->next;
+            *c = SIM_IRQ;
+        }
+    }
+    if (core1running && !core1waiting && clock[SIM_CORE1] < due) {
+        due = clock[SIM_CORE1];
+        *c = SIM_CORE1;
+    }
+    if (core0started && clock[SIM_CORE0] < due) {
+        due = clock[SIM_CORE0];
+        *c = SIM_CORE0;
+    }
+    return due;
+}
+
+void Simulator::switchTo(simContext c) {
+    current = c;
+    swapcontext(&scheduler, &cores[c]);
+}
+
+void Simulator::yield() {
+    swapcontext(&cores[current], &scheduler);
+}
+
+// everything due by time, one at a time as each can add more
+void Simulator::runInterrupts(uint64_t time) {
+    current = SIM_IRQ;
+    while (1) {
+        clock[SIM_IRQ] = time;
+        if (!events.empty() && events.begin()->first <= time) {
+            std::function<void()> f = events.begin()->second;
+            events.erase(events.begin());
+            f();
+            continue;
+        }
+        repeating_timer_t *due = NULL;
+        for (repeating_timer_t *t : timers) {
+            if (t->next <= time) {
+                due = t;
+                break;
+            }
+        }
+        if (due == NULL) {
+            break;
+        }
+        // a negative delay is from the start of the last callback, which is
+        // the same thing here
+        due->next += due->delay_us < 0 ? -due->delay_us : due->delay_us;
+        if (!due->callback(due)) {
+            cancel_repeating_timer(due);
+        }
+    }
+}
+
+void Simulator::run(uint64_t until) {
+    if (halted) {
+        throw SimHalt{halted};
+    }
+    simContext c = SIM_CORE0;
+    uint64_t time;
+    while ((time = nextDue(&c)) < until) {
+        if (c == SIM_IRQ) {
+            runInterrupts(time);
+        }
+        else {
+            switchTo(c);
+        }
+        if (halted) {
+            throw SimHalt{halted};
+        }
+        if (watchdogtime != 0 && time > watchdogtime) {
+            halted = "watchdog";
+            throw SimHalt{halted};
+        }
+        clock[SIM_IRQ] = time;
+        checkGPIOInterrupts();
+    }
+}
+
+//--------------------------------------------------------------------+
+// the GPIO pins and the matrix
+//--------------------------------------------------------------------+
+
+uint8_t VirtualMatrix::readRows(uint32_t driven, uint64_t now) {
+    (void) now;
+    uint8_t rows = 0;
+    for (uint8_t j = 0; j < NUM_DOWN; j++) {
+        for (uint8_t i = 0; i < NUM_ACROSS; i++) {
+            if (pressed[j][i] && (driven & (1u << i))) {
+                rows |= (1 << j);
+            }
+        }
+    }
+    return rows;
+}
+
+// bit i set if across[i] is an output and high
+uint32_t Simulator::drivenColumns() {
+    uint32_t columns = 0;
+    for (uint8_t i = 0; i < NUM_ACROSS; i++) {
+        uint32_t bit = 1u << BoardPinMap::across[i];
+        if ((pinout & bit) && (pinvalue & bit)) {
+            columns |= (1u << i);
+        }
+    }
+    return columns;
+}
+
+void Simulator::pinsChanged() {
+    uint32_t columns = drivenColumns();
+    if (columns != driven) {
+        driven = columns;
+        matrix->drive(driven, clock[current]);
+    }
+}
+
+// the outputs, and the rows from whichever columns are driven high
+uint32_t Simulator::readPins() {
+    uint8_t rows = matrix->readRows(drivenColumns(), clock[current]);
+    uint32_t readings = pinout & pinvalue;
+    for (uint8_t j = 0; j < NUM_DOWN; j++) {
+        if (rows & (1 << j)) {
+            readings |= 1u << BoardPinMap::down[j];
+        }
+    }
+    return readings;
+}
+
+// the only GPIO interrupt is the matrix waking core1 (see MatrixScanner::park)
+void Simulator::checkGPIOInterrupts() {
+    if (irqcallback == NULL || irqrise == 0) {
+        return;
+    }
+    current = SIM_IRQ;
+    uint32_t levels = readPins();
+    uint32_t rising = levels & ~irqlevels & irqrise;
+    irqlevels = levels;
+    if (rising == 0) {
+        return;
+    }
+    for (uint8_t pin = 0; pin < 32; pin++) {
+        if (rising & (1u << pin)) {
+            irqcallback(pin, GPIO_IRQ_EDGE_RISE);
+        }
+    }
+    if (core1waiting) {
+        core1waiting = false;
+        if (clock[SIM_CORE1] < clock[SIM_IRQ]) {
+            clock[SIM_CORE1] = clock[SIM_IRQ];
+        }
+    }
+}
+
+void gpio_init(uint gpio) {
+    gpio_set_dir(gpio, GPIO_IN);
+    gpio_put(gpio, 0);
+}
+
+void gpio_set_dir(uint gpio, bool out) {
+    Sim.pinout = out ? Sim.pinout | (1u << gpio) : Sim.pinout & ~(1u << gpio);
+    Sim.pinsChanged();
+}
+
+void gpio_put(uint gpio, bool value) {
+    Sim.pinvalue = value ? Sim.pinvalue | (1u << gpio) : Sim.pinvalue & ~(1u << gpio);
+    Sim.pinsChanged();
+}
+
+bool gpio_get(uint gpio) {
+    return (gpio_get_all() >> gpio) & 1;
+}
+
+uint32_t gpio_get_all() {
+    return Sim.readPins();
+}
+
+// inputs with nothing driving them read low, as if pulled down
+void gpio_pull_up(uint gpio) { (void) gpio; }
+void gpio_pull_down(uint gpio) { (void) gpio; }
+void gpio_disable_pulls(uint gpio) { (void) gpio; }
+
+void gpio_set_irq_enabled(uint gpio, uint32_t events, bool enabled) {
+    if (!(events & GPIO_IRQ_EDGE_RISE)) {
+        return;
+    }
+    uint32_t bit = 1u << gpio;
+    if (enabled) {
+        Sim.irqrise |= bit;
+        Sim.irqlevels = (Sim.irqlevels & ~bit) | (Sim.readPins() & bit); // only new edges count
+    }
+    else {
+        Sim.irqrise &= ~bit;
+    }
+}
+
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t events, bool enabled, gpio_irq_callback_t callback) {
+    Sim.irqcallback = callback;
+    gpio_set_irq_enabled(gpio, events, enabled);
+}
+
+//--------------------------------------------------------------------+
+// time, the cores, and syncing between them
+//--------------------------------------------------------------------+
+
+uint get_core_num() {
+    return Sim.current == SIM_CORE1 ? 1 : 0;
+}
+
+uint64_t time_us_64() {
+    return Sim.clock[Sim.current];
+}
+
+// only go back to the scheduler if something else should run first,
+// interrupts can't sleep so they just take longer
+void sleep_us(uint64_t us) {
+    Sim.clock[Sim.current] += us;
+    if (Sim.current == SIM_IRQ) {
+        return;
+    }
+    simContext c = Sim.current;
+    Sim.nextDue(&c);
+    if (c != Sim.current) {
+        Sim.yield();
+    }
+}
+
+void tight_loop_contents() {
+    sleep_us(1);
+}
+
+bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out) {
+    out->delay_us = delay_us;
+    out->callback = callback;
+    out->user_data = user_data;
+    out->next = time_us_64() + (delay_us < 0 ? -delay_us : delay_us);
+    Sim.timers.push_back(out);
+    return true;
+}
+
+bool cancel_repeating_timer(repeating_timer_t *timer) {
+    for (auto t = Sim.timers.begin(); t != Sim.timers.end(); t++) {
+        if (*t == timer) {
+            Sim.timers.erase(t);
+            return true;
+        }
+    }
+    return false;
+}
+
+void mutex_init(mutex_t *mtx) {
+    mtx->core.spin_lock = NULL;
+    mtx->owner = -1;
+}
+
+// waiting is a microsecond at a time, so the other core gets to run
+void mutex_enter_blocking(mutex_t *mtx) {
+    while (mtx->owner >= 0 && mtx->owner != (int8_t)Sim.current) {
+        sleep_us(1);
+    }
+    mtx->owner = Sim.current;
+}
+
+bool mutex_enter_timeout_ms(mutex_t *mtx, uint32_t timeout_ms) {
+    uint64_t until = time_us_64() + timeout_ms*1000ull;
+    while (mtx->owner >= 0 && mtx->owner != (int8_t)Sim.current) {
+        if (time_us_64() >= until) {
+            return false;
+        }
+        sleep_us(1);
+    }
+    mtx->owner = Sim.current;
+    return true;
+}
+
+void mutex_exit(mutex_t *mtx) {
+    mtx->owner = -1;
+}
+
+void __sev() {
+    if (Sim.core1waiting) {
+        Sim.core1waiting = false;
+        if (Sim.clock[SIM_CORE1] < Sim.clock[Sim.current]) {
+            Sim.clock[SIM_CORE1] = Sim.clock[Sim.current];
+        }
+    }
+}
+
+void __wfe() {
+    if (Sim.current != SIM_CORE1) { // nothing would wake it
+        tight_loop_contents();
+        return;
+    }
+    Sim.core1waiting = true;
+    Sim.yield();
+}
+
+// core1 starts from the beginning, whatever it was doing before
+void multicore_launch_core1(void (*entry)(void)) {
+    Sim.core1entry = entry;
+    Sim.stacks[SIM_CORE1].resize(SIM_STACK_SIZE);
+    getcontext(&Sim.cores[SIM_CORE1]);
+    Sim.cores[SIM_CORE1].uc_stack.ss_sp = Sim.stacks[SIM_CORE1].data();
+    Sim.cores[SIM_CORE1].uc_stack.ss_size = SIM_STACK_SIZE;
+    Sim.cores[SIM_CORE1].uc_link = &Sim.scheduler;
+    makecontext(&Sim.cores[SIM_CORE1], Simulator::core1Main, 0);
+    Sim.clock[SIM_CORE1] = time_us_64();
+    Sim.core1running = true;
+    Sim.core1waiting = false;
+}
+
+void multicore_reset_core1() {
+    Sim.core1running = false;
+    Sim.core1waiting = false;
+}
+
+//--------------------------------------------------------------------+
+// the watchdog and the bootloader
+//--------------------------------------------------------------------+
+
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug) {
+    (void) pause_on_debug;
+    Sim.watchdogdelay = delay_ms;
+    watchdog_update();
+}
+
+void watchdog_update() {
+    if (Sim.watchdogdelay != 0) {
+        Sim.watchdogtime = time_us_64() + Sim.watchdogdelay*1000ull;
+    }
+}
+
+bool watchdog_caused_reboot() {
+    return false;
+}
+
+void reset_usb_boot(uint32_t usb_activity_gpio_pin_mask, uint32_t disable_interface_mask) {
+    (void) usb_activity_gpio_pin_mask;
+    (void) disable_interface_mask;
+    throw SimHalt{"reset to the bootloader"};
+}
+
+//--------------------------------------------------------------------+
+// clocks, which only report what they were set to
+//--------------------------------------------------------------------+
+
+bool clock_configure(enum clock_index clk_index, uint32_t src, uint32_t auxsrc, uint32_t src_freq, uint32_t freq) {
+    (void) src;
+    (void) auxsrc;
+    (void) src_freq;
+    if (clk_index == clk_sys) {
+        Sim.clockkhz = freq / KHZ;
+    }
+    return true;
+}
+
+uint32_t clock_get_hz(enum clock_index clk_index) {
+    switch (clk_index) {
+        case clk_sys: return Sim.clockkhz * KHZ;
+        case clk_peri: return Sim.clockkhz * KHZ;
+        case clk_usb: return 48 * MHZ;
+        case clk_adc: return 48 * MHZ;
+        default: return 12 * MHZ;
+    }
+}
+
+bool set_sys_clock_khz(uint32_t freq_khz, bool required) {
+    (void) required;
+    Sim.clockkhz = freq_khz;
+    return true;
+}
+
+bool check_sys_clock_khz(uint32_t freq_khz, uint *vco_freq_out, uint *post_div1_out, uint *post_div2_out) {
+    (void) freq_khz;
+    *vco_freq_out = 1500 * MHZ;
+    *post_div1_out = 6;
+    *post_div2_out = 2;
+    return true;
+}
+
+uint32_t frequency_count_khz(uint src) {
+    (void) src;
+    return Sim.clockkhz;
+}
+
+//--------------------------------------------------------------------+
+// the LEDs, each frame sent to them ends up in Sim.leds
+//--------------------------------------------------------------------+
+
+pio_hw_t sim_pio0;
+struct pio_program {
+    uint8_t length;
+};
+const pio_program_t ws2812_program = {0};
+
+uint pio_add_program(PIO pio, const pio_program_t *program) {
+    (void) pio;
+    (void) program;
+    return 0;
+}
+
+#define SIM_DMA_CHANNELS 12
+static const volatile uint32_t *dmaread[SIM_DMA_CHANNELS];
+static uint dmacount[SIM_DMA_CHANNELS];
+static uint dmaclaimed = 0;
+
+int dma_claim_unused_channel(bool required) {
+    (void) required;
+    return dmaclaimed < SIM_DMA_CHANNELS ? dmaclaimed++ : -1;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr, const volatile void *read_addr, uint transfer_count, bool trigger) {
+    (void) config;
+    (void) write_addr;
+    dmacount[channel] = transfer_count;
+    dma_channel_set_read_addr(channel, read_addr, trigger);
+}
+
+void dma_channel_set_read_addr(uint channel, const volatile void *read_addr, bool trigger) {
+    dmaread[channel] = (const volatile uint32_t*)read_addr;
+    if (trigger) {
+        Sim.leds.assign(dmaread[channel], dmaread[channel] + dmacount[channel]);
+        Sim.ledframes++;
+    }
+}
+
+//--------------------------------------------------------------------+
+// flash, erasing sets bits and programming can only clear them
+//--------------------------------------------------------------------+
+
+uint8_t sim_flash[PICO_FLASH_SIZE_BYTES];
+
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+    memset(sim_flash + flash_offs, 0xFF, count);
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count) {
+    for (size_t c = 0; c < count; c++) {
+        sim_flash[flash_offs + c] &= data[c];
+    }
+}
+
+//--------------------------------------------------------------------+
+// USB
+//--------------------------------------------------------------------+
+
+void VirtualHost::connect() {
+    if (!attached || !pluggedin || mounted) {
+        return;
+    }
+    Sim.at(Sim.now() + SIM_ENUMERATE_US, [this]() {
+        if (attached && pluggedin && !mounted) {
+            mounted = true;
+            suspended = false;
+            tud_mount_cb();
+        }
+    });
+}
+
+void VirtualHost::plugIn() {
+    pluggedin = true;
+    connect();
+}
+
+void VirtualHost::unplug() {
+    pluggedin = false;
+    if (mounted) {
+        mounted = false;
+        suspended = false;
+        tud_umount_cb();
+    }
+}
+
+void VirtualHost::suspend(bool allowremotewakeup) {
+    if (mounted && !suspended) {
+        suspended = true;
+        remotewakeup = allowremotewakeup;
+        tud_suspend_cb(allowremotewakeup);
+    }
+}
+
+void VirtualHost::resume() {
+    if (suspended) {
+        suspended = false;
+        tud_resume_cb();
+    }
+}
+
+void VirtualHost::setLeds(uint8_t leds) {
+    Adafruit_USBD_HID *keyboard = getInterface(0);
+    if (mounted && keyboard != NULL && keyboard->setreport != NULL) {
+        keyboard->setreport(RID_KEYBOARD, HID_REPORT_TYPE_OUTPUT, &leds, 1);
+    }
+}
+
+void VirtualHost::vendorRequest(const uint8_t *data, uint16_t length) {
+    Adafruit_USBD_HID *vendor = getInterface(1);
+    if (mounted && vendor != NULL && vendor->setreport != NULL) {
+        vendor->setreport(0, HID_REPORT_TYPE_OUTPUT, data, length);
+    }
+}
+
+Adafruit_USBD_HID::Adafruit_USBD_HID() {
+}
+
+bool Adafruit_USBD_HID::begin() {
+    interface = Sim.host.interfaces.size();
+    Sim.host.interfaces.push_back(this);
+    Sim.host.busyuntil.push_back(0);
+    return true;
+}
+
+bool Adafruit_USBD_HID::ready() {
+    return interface >= 0 && Sim.host.mounted && !Sim.host.suspended && Sim.now() >= Sim.host.busyuntil[interface];
+}
+
+bool Adafruit_USBD_HID::sendReport(uint8_t report_id, void const *report, uint8_t len) {
+    if (!ready()) {
+        return false;
+    }
+    simReport r;
+    memset(&r, 0, sizeof(simReport));
+    r.time = Sim.now();
+    r.interface = interface;
+    r.id = report_id;
+    r.length = len < CFG_TUD_HID_EP_BUFSIZE ? len : CFG_TUD_HID_EP_BUFSIZE;
+    memcpy(r.data, report, r.length);
+    Sim.host.busyuntil[interface] = Sim.now() + pollinterval*1000ull;
+    Sim.host.reports.push_back(r);
+    if (Sim.host.listener) {
+        Sim.host.listener(r);
+    }
+    return true;
+}
+
+bool Adafruit_USBD_HID::keyboardReport(uint8_t report_id, uint8_t modifier, const uint8_t keycode[6]) {
+    uint8_t report[8] = {modifier, 0, 0, 0, 0, 0, 0, 0};
+    if (keycode != NULL) {
+        memcpy(report + 2, keycode, 6);
+    }
+    return sendReport(report_id, report, sizeof(report));
+}
+
+bool Adafruit_USBD_HID::mouseReport(uint8_t report_id, uint8_t buttons, int8_t x, int8_t y, int8_t vertical, int8_t horizontal) {
+    uint8_t report[5] = {buttons, (uint8_t)x, (uint8_t)y, (uint8_t)vertical, (uint8_t)horizontal};
+    return sendReport(report_id, report, sizeof(report));
+}
+
+bool Adafruit_USBD_Device::detach() {
+    Sim.host.attached = false;
+    if (Sim.host.mounted) {
+        Sim.host.mounted = false;
+        Sim.host.suspended = false;
+        tud_umount_cb();
+    }
+    return true;
+}
+
+bool Adafruit_USBD_Device::attach() {
+    Sim.host.attached = true;
+    Sim.host.connect();
+    return true;
+}
+
+bool Adafruit_USBD_Device::mounted() {
+    return Sim.host.mounted;
+}
+
+bool Adafruit_USBD_Device::suspended() {
+    return Sim.host.suspended;
+}
+
+bool Adafruit_USBD_Device::remoteWakeup() {
+    if (!Sim.host.suspended || !Sim.host.remotewakeup) {
+        return false;
+    }
+    Sim.at(Sim.now() + SIM_RESUME_US, []() { Sim.host.resume(); });
+    return true;
+}
+
+Adafruit_USBD_Device TinyUSBDevice;
+
+// as if tud_init() had been called
+void TinyUSB_Port_InitDevice(uint8_t rhport) {
+    (void) rhport;
+    Sim.host.attached = true;
+    Sim.host.connect();
+}
+
+Simulator Sim;
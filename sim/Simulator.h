@@ -0,0 +1,206 @@
+/*
+ * Simulator.h - runs the firmware on Linux against a virtual matrix and a
+ *               virtual USB host, for trying things out and testing without
+ *               a keyboard
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef Simulator_h
+#define Simulator_h
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <map>
+#include <ucontext.h>
+
+#include "SimMock.h"
+#include "PinMap.h"
+
+// core0 (setup() then loop()) and core1 (whatever multicore_launch_core1 was
+// given) are coroutines, and each keeps its own time, which only moves on
+// when it sleeps or busy waits. whichever is furthest behind runs next, so the
+// cores interleave at every sleep, e.g. core0 can wait on the mutex while
+// core1 waits for a column to settle. timers and things that happen to the
+// keyboard (see Simulator::at) run between them at the time they're due, in
+// an interrupt context of their own. code runs infinitely fast, it's the
+// logic and the timing from the sleeps that are being tested, not how long
+// things take to run
+enum simContext {
+    SIM_CORE0 = 0,
+    SIM_CORE1,
+    SIM_IRQ,
+    SIM_CONTEXT_COUNT
+};
+
+// stops the run, e.g. for the watchdog or the bootloader
+struct SimHalt {
+    const char *reason;
+};
+
+// the key switches, a pressed key connects its column to its row
+class VirtualMatrix {
+    public:
+        bool pressed[NUM_DOWN][NUM_ACROSS] = {};
+
+        virtual ~VirtualMatrix() {};
+        virtual void press(uint8_t down, uint8_t across) { pressed[down][across] = true; };
+        virtual void release(uint8_t down, uint8_t across) { pressed[down][across] = false; };
+
+        // bit j set if row j reads high with the columns in driven high (bit i
+        // for across[i]). this one is ideal, every key has a diode and there's
+        // no settling or bouncing, override it for a more realistic membrane
+        // (see Membrane.h)
+        virtual uint8_t readRows(uint32_t driven, uint64_t now);
+        // told whenever the columns being driven change, before anything is read
+        virtual void drive(uint32_t driven, uint64_t now) { (void) driven; (void) now; };
+};
+
+// a report as the computer received it
+struct simReport {
+    uint64_t time; // us
+    int8_t interface; // 0 is the keyboard and mouse, 1 the configuration interface
+    uint8_t id;
+    uint8_t length;
+    uint8_t data[CFG_TUD_HID_EP_BUFSIZE]; // without the report id
+};
+
+// how long the computer takes to set up the keyboard once it's connected (us)
+#define SIM_ENUMERATE_US 50000
+// and to resume after a remote wakeup (us)
+#define SIM_RESUME_US 20000
+
+// the computer at the other end of the USB cable, the tinyusb callbacks (see
+// usb.cpp) and output reports are called as interrupts
+class VirtualHost {
+    private:
+        bool attached = false; // the firmware wants to be connected
+        bool pluggedin = false;
+        bool mounted = false;
+        bool suspended = false;
+        bool remotewakeup = false;
+        std::vector<Adafruit_USBD_HID*> interfaces;
+        std::vector<uint64_t> busyuntil; // each interface takes one report a poll interval
+
+        void connect();
+
+        friend class Adafruit_USBD_HID;
+        friend class Adafruit_USBD_Device;
+        friend void TinyUSB_Port_InitDevice(uint8_t rhport);
+
+    public:
+        std::vector<simReport> reports;
+        std::function<void(const simReport &)> listener; // told about every report as it arrives
+
+        void plugIn();
+        void unplug();
+        void suspend(bool allowremotewakeup = true);
+        void resume();
+        void setLeds(uint8_t leds); // KEYBOARD_LED_* as an output report to the keyboard
+        void vendorRequest(const uint8_t *data, uint16_t length); // to the configuration interface
+
+        bool isMounted() { return mounted; };
+        bool isSuspended() { return suspended; };
+        Adafruit_USBD_HID* getInterface(uint8_t n) { return n < interfaces.size() ? interfaces[n] : NULL; };
+};
+
+class Simulator {
+    private:
+        uint64_t clock[SIM_CONTEXT_COUNT] = {};
+        simContext current = SIM_CORE0;
+        const char *halted = NULL;
+
+        // the coroutines, run from the scheduler in run()
+        ucontext_t scheduler;
+        ucontext_t cores[2];
+        std::vector<uint8_t> stacks[2];
+        bool core0started = false;
+        bool core1running = false;
+        bool core1waiting = false; // in __wfe()
+        void (*core1entry)(void) = NULL;
+
+        std::multimap<uint64_t, std::function<void()>> events;
+        std::vector<repeating_timer_t*> timers;
+        uint64_t watchdogtime = 0; // 0 when not enabled
+        uint32_t watchdogdelay = 0;
+
+        // the GPIO pins
+        uint32_t pinout = 0;
+        uint32_t pinvalue = 0;
+        uint32_t irqrise = 0; // pins with a rising edge interrupt enabled
+        uint32_t irqlevels = 0; // the pins as of the last interrupt check
+        gpio_irq_callback_t irqcallback = NULL;
+        uint32_t driven = 0; // columns, as last told to the matrix
+
+        uint64_t nextDue(simContext *c); // when and which context runs next
+        void switchTo(simContext c);
+        void yield(); // back to the scheduler from a core
+        void runInterrupts(uint64_t time);
+        void checkGPIOInterrupts();
+        uint32_t drivenColumns();
+        void pinsChanged();
+        uint32_t readPins();
+
+        static void core0Main();
+        static void core1Main();
+
+        friend uint64_t time_us_64();
+        friend void sleep_us(uint64_t us);
+        friend void tight_loop_contents();
+        friend uint get_core_num();
+        friend void __sev();
+        friend void __wfe();
+        friend void mutex_enter_blocking(mutex_t *mtx);
+        friend bool mutex_enter_timeout_ms(mutex_t *mtx, uint32_t timeout_ms);
+        friend bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out);
+        friend bool cancel_repeating_timer(repeating_timer_t *timer);
+        friend void multicore_launch_core1(void (*entry)(void));
+        friend void multicore_reset_core1();
+        friend void watchdog_enable(uint32_t delay_ms, bool pause_on_debug);
+        friend void watchdog_update();
+        friend void gpio_set_dir(uint gpio, bool out);
+        friend void gpio_put(uint gpio, bool value);
+        friend uint32_t gpio_get_all();
+        friend void gpio_set_irq_enabled(uint gpio, uint32_t events, bool enabled);
+        friend void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t events, bool enabled, gpio_irq_callback_t callback);
+
+    public:
+        VirtualMatrix defaultmatrix;
+        VirtualMatrix *matrix = &defaultmatrix;
+        VirtualHost host;
+        std::vector<uint32_t> leds; // the last frame sent to the LEDs, each grb << 8
+        uint32_t ledframes = 0;
+        uint32_t clockkhz = 125000; // clk_sys
+
+        Simulator();
+        void begin(); // power on, setup() runs at the start of the first run()
+        void at(uint64_t time, std::function<void()> f); // something that happens at time (us)
+        void run(uint64_t until); // until every core has got to until (us), throws SimHalt
+        uint64_t now() { return clock[current]; };
+};
+
+extern Simulator Sim;
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * Trace.cpp - traces of what happens on the matrix, for playing through the
+ *             firmware in the simulator
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "Simulator.h"
+#include "Trace.h"
+
+bool loadTrace(const char *path, std::vector<replayEvent> &events, std::vector<replayReport> *reports) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    char line[256], what[16], flag[16];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash != NULL) {
+            *hash = 0;
+        }
+        double ms;
+        int d, a, used = 0;
+        if (sscanf(line, "%lf %15s %n", &ms, what, &used) == 2 && strcmp(what, "report") == 0) {
+            replayReport r = {};
+            r.time = ms * 1000 + 0.5;
+            uint8_t count = 0;
+            char *p = line + used, *end;
+            bool ok = ms >= 0;
+            for (unsigned long v = strtoul(p, &end, 16); ok && end != p; v = strtoul(p, &end, 16)) {
+                ok = v <= 0xFF && count <= sizeof(r.keys);
+                if (ok && count == 0) {
+                    r.modifiers = v;
+                }
+                else if (ok) {
+                    r.keys[count - 1] = v;
+                }
+                count++;
+                p = end;
+            }
+            if (!ok || count == 0 || strspn(p, " \t\r\n") != strlen(p)) {
+                fprintf(stderr, "%s:%d: expected a time, report, then the modifiers and up to 6 keys in hex\n", path, lineno);
+                fclose(f);
+                return false;
+            }
+            std::sort(r.keys, r.keys + count - 1);
+            if (reports != NULL) {
+                reports->push_back(r);
+            }
+            continue;
+        }
+        flag[0] = 0;
+        int n = sscanf(line, "%lf %15s %d %d %15s", &ms, what, &d, &a, flag);
+        if (n <= 0) {
+            continue;
+        }
+        replayEvent e = {};
+        e.time = ms * 1000 + 0.5;
+        if (n < 4 || ms < 0 || d < 0 || d >= NUM_DOWN || a < 0 || a >= NUM_ACROSS) {
+            fprintf(stderr, "%s:%d: expected a time, a change, and a down and across inside the matrix\n", path, lineno);
+            fclose(f);
+            return false;
+        }
+        e.down = d;
+        e.across = a;
+        if (strcmp(what, "press") == 0) {
+            e.type = REPLAY_PRESS;
+            e.value = true;
+            e.ghost = n == 5 && strcmp(flag, "ghost") == 0;
+        }
+        else if (strcmp(what, "release") == 0) {
+            e.type = REPLAY_RELEASE;
+        }
+        else if (strcmp(what, "contact") == 0 && n == 5 && (strcmp(flag, "0") == 0 || strcmp(flag, "1") == 0)) {
+            e.type = REPLAY_CONTACT;
+            e.value = flag[0] == '1';
+        }
+        else {
+            fprintf(stderr, "%s:%d: unknown change\n", path, lineno);
+            fclose(f);
+            return false;
+        }
+        events.push_back(e);
+    }
+    fclose(f);
+    std::stable_sort(events.begin(), events.end(), [](const replayEvent &x, const replayEvent &y) { return x.time < y.time; });
+    return true;
+}
+
+uint64_t scheduleTrace(const std::vector<replayEvent> &events, bool contacts) {
+    uint64_t end = 0;
+    for (const replayEvent &e : events) {
+        if (e.type == REPLAY_CONTACT) {
+            if (contacts) {
+                Sim.at(REPLAY_START + e.time, [e]() { Sim.matrix->pressed[e.down][e.across] = e.value; });
+            }
+        }
+        else if (e.type == REPLAY_PRESS) {
+            Sim.at(REPLAY_START + e.time, [e]() { Sim.matrix->press(e.down, e.across); });
+        }
+        else {
+            Sim.at(REPLAY_START + e.time, [e]() { Sim.matrix->release(e.down, e.across); });
+        }
+        end = e.time;
+    }
+    return end;
+}
+
+void printLatency(const char *name, std::vector<uint64_t> &latency) {
+    if (latency.empty()) {
+        printf("  %s latency us: none\n", name);
+        return;
+    }
+    std::sort(latency.begin(), latency.end());
+    uint64_t total = 0;
+    for (uint64_t l : latency) {
+        total += l;
+    }
+    size_t n = latency.size();
+    printf("  %s latency us: min %lu mean %lu p50 %lu p99 %lu max %lu\n", name, latency[0], total / n, latency[n / 2],
+            latency[std::min(n - 1, n * 99 / 100)], latency[n - 1]);
+}
@@ -0,0 +1,91 @@
+/*
+ * Trace.h - traces of what happens on the matrix, for playing through the
+ *           firmware in the simulator
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef Trace_h
+#define Trace_h
+
+#include <cstdint>
+#include <vector>
+
+// each line of a trace is a time in ms and a change on the matrix, anything
+// after # is ignored
+//   press down across [ghost]   a key is pressed, ghost if it makes a rectangle
+//                               with a fourth key that can't be told apart from
+//                               it, so it should be ignored (see preventGhosting)
+//   release down across
+//   contact down across 0|1     the contact changed but the key didn't, e.g. a
+//                               bounce or a key connected by a ghosting rectangle
+//   report modifiers [key...]   in hex, the next keyboard report that's
+//                               different to the one before, not before this
+//                               time, for traces where what's sent isn't just
+//                               the keys pressed (tap-hold keys, combos, typed
+//                               text), the keys can be in any order
+// tools/gentrace.py makes them, sim/traces has a set covering typing, fast
+// typing with lots of keys down at once, bouncing contacts, and ghosting, and
+// hand written ones with reports for text expansion and typing while keys
+// are held. sim/traces/resolver is for modelm-replay-resolver, which has the
+// tap-hold and combo examples in KeyboardLayout.cpp switched on
+
+// time for the keyboard to be mounted before a trace starts (us)
+#define REPLAY_START 200000
+// and to keep going after the last change
+#define REPLAY_END 500000
+
+enum replayType {
+    REPLAY_PRESS,
+    REPLAY_RELEASE,
+    REPLAY_CONTACT
+};
+
+struct replayEvent {
+    uint64_t time; // us from the start of the trace
+    replayType type;
+    uint8_t down;
+    uint8_t across;
+    bool value; // the contact afterwards
+    bool ghost; // expected to be ignored
+};
+
+struct replayReport {
+    uint64_t time; // us from the start of the trace, it can't be any sooner
+    uint8_t modifiers;
+    uint8_t keys[6]; // sorted, HID_KEY_NONE after the last
+};
+
+// sorted by time, false (after saying why) if the trace can't be read. report
+// lines go in reports, in the order they're in the trace, or are left out
+bool loadTrace(const char *path, std::vector<replayEvent> &events, std::vector<replayReport> *reports = NULL);
+// on the simulator's matrix from REPLAY_START, returns when the last change
+// is from the start of the trace (us). contact lines are left out unless
+// contacts is set, e.g. for a matrix that bounces by itself
+uint64_t scheduleTrace(const std::vector<replayEvent> &events, bool contacts);
+
+// min, mean, p50, p99, and max on one line (sorts latency)
+void printLatency(const char *name, std::vector<uint64_t> &latency);
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * Uhid.cpp - the simulated keyboard as a real HID device on Linux, through
+ *            /dev/uhid, so its reports go through the kernel's input stack
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#include "Simulator.h"
+#include "Uhid.h"
+
+// how long to wait for the kernel to make the evdev devices (ms)
+#define UHID_EVDEV_WAIT 2000
+
+bool UhidDevice::create(const char *devicename, const uint8_t *descriptor, uint16_t length, uint16_t vid, uint16_t pid) {
+    if (length > HID_MAX_DESCRIPTOR_SIZE) {
+        errno = EINVAL;
+        return false;
+    }
+    fd = open("/dev/uhid", O_RDWR | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        return false;
+    }
+
+    // the name has the pid in so the evdev devices can be found
+    char unique[64];
+    snprintf(unique, sizeof(unique), "%s %d", devicename, getpid());
+    name = unique;
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_CREATE2;
+    strncpy((char*)ev.u.create2.name, unique, sizeof(ev.u.create2.name) - 1);
+    strncpy((char*)ev.u.create2.phys, "pico-model-m-sim", sizeof(ev.u.create2.phys) - 1);
+    ev.u.create2.rd_size = length;
+    ev.u.create2.bus = BUS_USB;
+    ev.u.create2.vendor = vid;
+    ev.u.create2.product = pid;
+    memcpy(ev.u.create2.rd_data, descriptor, length);
+    if (write(fd, &ev, sizeof(ev)) != sizeof(ev)) {
+        destroy();
+        return false;
+    }
+
+    for (uint32_t waited = 0; !findEvents(); waited += 10) {
+        if (waited >= UHID_EVDEV_WAIT) {
+            destroy();
+            errno = ENODEV;
+            return false;
+        }
+        handle();
+        usleep(10000);
+    }
+    return true;
+}
+
+// each evdev device's name starts with the name given to uhid (hid-input
+// adds the application, e.g. Keyboard or Mouse, to some of them)
+bool UhidDevice::findEvents() {
+    DIR *dir = opendir("/sys/class/input");
+    if (dir == NULL) {
+        return false;
+    }
+    std::vector<int> found;
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL) {
+        if (strncmp(d->d_name, "event", 5) != 0) {
+            continue;
+        }
+        char path[300], devname[256] = {};
+        snprintf(path, sizeof(path), "/sys/class/input/%s/device/name", d->d_name);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        bool ours = fgets(devname, sizeof(devname), f) != NULL && strncmp(devname, name.c_str(), name.length()) == 0;
+        fclose(f);
+        if (!ours) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/dev/input/%s", d->d_name);
+        int e = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        if (e < 0) {
+            continue;
+        }
+        // timestamps on the same clock as the reports are written with
+        int clock = CLOCK_MONOTONIC;
+        ioctl(e, EVIOCSCLOCKID, &clock);
+        ioctl(e, EVIOCGRAB, 1);
+        found.push_back(e);
+    }
+    closedir(dir);
+    if (found.empty()) {
+        return false;
+    }
+    events = found;
+    return true;
+}
+
+void UhidDevice::destroy() {
+    for (int e : events) {
+        close(e);
+    }
+    events.clear();
+    if (fd >= 0) {
+        struct uhid_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.type = UHID_DESTROY;
+        if (write(fd, &ev, sizeof(ev)) != sizeof(ev)) {
+            perror("uhid destroy");
+        }
+        close(fd);
+        fd = -1;
+    }
+}
+
+bool UhidDevice::input(uint8_t id, const uint8_t *data, uint16_t length) {
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_INPUT2;
+    if (length + 1 > (int)sizeof(ev.u.input2.data)) {
+        return false;
+    }
+    // with report ids in the descriptor every report starts with one
+    ev.u.input2.data[0] = id;
+    memcpy(ev.u.input2.data + 1, data, length);
+    ev.u.input2.size = length + 1;
+    return write(fd, &ev, sizeof(ev)) == sizeof(ev);
+}
+
+// the lock lights come as an output report or a set report request, they're
+// passed to the firmware as an interrupt at the current simulated time
+void UhidDevice::handle() {
+    struct uhid_event ev;
+    while (read(fd, &ev, sizeof(ev)) > 0) {
+        if (ev.type == UHID_OUTPUT && ev.u.output.rtype == UHID_OUTPUT_REPORT && ev.u.output.size >= 2) {
+            uint8_t leds = ev.u.output.data[1];
+            Sim.at(Sim.now(), [leds]() { Sim.host.setLeds(leds); });
+        }
+        else if (ev.type == UHID_SET_REPORT) {
+            if (ev.u.set_report.rtype == UHID_OUTPUT_REPORT && ev.u.set_report.size >= 2) {
+                uint8_t leds = ev.u.set_report.data[1];
+                Sim.at(Sim.now(), [leds]() { Sim.host.setLeds(leds); });
+            }
+            struct uhid_event reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.type = UHID_SET_REPORT_REPLY;
+            reply.u.set_report_reply.id = ev.u.set_report.id;
+            if (write(fd, &reply, sizeof(reply)) != sizeof(reply)) {
+                perror("uhid set report");
+            }
+        }
+        else if (ev.type == UHID_GET_REPORT) {
+            // the firmware has no feature reports
+            struct uhid_event reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.type = UHID_GET_REPORT_REPLY;
+            reply.u.get_report_reply.id = ev.u.get_report.id;
+            reply.u.get_report_reply.err = EIO;
+            if (write(fd, &reply, sizeof(reply)) != sizeof(reply)) {
+                perror("uhid get report");
+            }
+        }
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * Uhid.h - the simulated keyboard as a real HID device on Linux, through
+ *          /dev/uhid, so its reports go through the kernel's input stack
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef Uhid_h
+#define Uhid_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// a HID device made from the report descriptor the firmware gives tinyusb
+// (desc_hid_report), the kernel parses the reports the same as it would from
+// the RP2040 and passes them on to evdev. needs write access to /dev/uhid and
+// read access to /dev/input (usually root). the evdev devices are grabbed, so
+// what the simulated keyboard types doesn't go to anything else
+class UhidDevice {
+    private:
+        int fd = -1;
+        std::vector<int> events; // evdev
+        std::string name;
+
+        bool findEvents(); // the evdev devices the kernel made for this one
+
+    public:
+        ~UhidDevice() { destroy(); };
+        bool create(const char *devicename, const uint8_t *descriptor, uint16_t length, uint16_t vid, uint16_t pid); // false and errno
+        void destroy();
+
+        bool input(uint8_t id, const uint8_t *data, uint16_t length); // an input report from the keyboard
+        // from the kernel to the keyboard, e.g. the lock lights, sent on to the simulated host
+        void handle();
+
+        int getFd() { return fd; };
+        const std::vector<int>& getEvents() { return events; };
+};
+
+#endif
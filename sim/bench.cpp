@@ -0,0 +1,270 @@
+/*
+ * bench.cpp - time the worst cases of scanning, anti-ghosting, and building
+ *             reports on their own
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+// usage: modelm-bench [name...]
+//
+// each case runs one part of the firmware over and over with the same keys
+// held, on the computer running it, and prints how long it took per operation
+// as
+//   name ops ns/op
+// one line per case, in the same order every time so the output from two
+// commits can be diffed. every case is run BENCH_RUNS times and the fastest
+// kept. names given on the command line run just the cases starting with
+// them. the keys for the random cases come from a fixed seed, so every run
+// holds the same ones.
+//
+// the scan cases include the virtual matrix and GPIO standing in for the
+// hardware, and the report cases the virtual computer taking the reports, so
+// those are only worth comparing with each other, not with the RP2040
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Simulator.h"
+#include "Keymap.h"
+#include "MatrixScanner.h"
+#include "USBKeyboard.h"
+#include "FlightRecorder.h"
+
+// for the random cases
+#define BENCH_SEED 1
+#define BENCH_RUNS 5
+
+typedef std::pair<uint8_t, uint8_t> position; // down, across
+
+struct benchCase {
+    const char *name;
+    uint32_t ops; // per run
+    std::function<void()> prepare; // before each run, not timed
+    std::function<void(uint32_t ops)> run;
+};
+
+static bool hasSwitch(uint8_t j, uint8_t i) {
+    return keymap[0][j][i] != HID_KEY_NONE;
+}
+
+static void holdOnly(const std::vector<position> &keys) {
+    memset(Sim.matrix->pressed, 0, sizeof(Sim.matrix->pressed));
+    for (const position &p : keys) {
+        Sim.matrix->press(p.first, p.second);
+    }
+}
+
+// scan until the held keys are through debounce and anti-ghosting has seen
+// them twice, so they're held rather than newly pressed
+static void settle() {
+    static bool pinstate[NUM_DOWN][NUM_ACROSS], lastpinstate[NUM_DOWN][NUM_ACROSS];
+    static uint8_t keycodes[NUM_DOWN][NUM_ACROSS];
+    for (uint8_t c = 0; c < 2; c++) {
+        KeyMatrix.scan();
+        KeyMatrix.preventGhosting();
+        KeyMatrix.resolveKeys();
+        KeyMatrix.getPinState(pinstate, lastpinstate, keycodes);
+    }
+}
+
+// every key in the row with the most keys and the column with the most keys
+static std::vector<position> rowAndColumn() {
+    uint8_t row = 0, column = 0, rowkeys = 0, columnkeys = 0;
+    for (uint8_t j = 0; j < NUM_DOWN; j++) {
+        uint8_t n = 0;
+        for (uint8_t i = 0; i < NUM_ACROSS; i++) n += hasSwitch(j, i);
+        if (n > rowkeys) { rowkeys = n; row = j; }
+    }
+    for (uint8_t i = 0; i < NUM_ACROSS; i++) {
+        uint8_t n = 0;
+        for (uint8_t j = 0; j < NUM_DOWN; j++) n += hasSwitch(j, i);
+        if (n > columnkeys) { columnkeys = n; column = i; }
+    }
+    std::vector<position> keys;
+    for (uint8_t i = 0; i < NUM_ACROSS; i++) {
+        if (hasSwitch(row, i)) keys.push_back(position(row, i));
+    }
+    for (uint8_t j = 0; j < NUM_DOWN; j++) {
+        if (j != row && hasSwitch(j, column)) keys.push_back(position(j, column));
+    }
+    return keys;
+}
+
+// the first 4 rows and 4 columns (going across) where all 16 have a key
+// switch, every key is part of 9 rectangles
+static std::vector<position> block() {
+    std::vector<position> keys;
+    uint8_t columns[4], n = 0;
+    for (uint8_t i = 0; i < NUM_ACROSS && n < 4; i++) {
+        if (hasSwitch(0, i) && hasSwitch(1, i) && hasSwitch(2, i) && hasSwitch(3, i)) {
+            columns[n++] = i;
+        }
+    }
+    for (uint8_t j = 0; j < 4; j++) {
+        for (uint8_t c = 0; c < n; c++) {
+            keys.push_back(position(j, columns[c]));
+        }
+    }
+    return keys;
+}
+
+// the three modifiers of a ctrl, alt, shift combo, which the board's ghost
+// pairs are there for
+static std::vector<position> modifiers() {
+    std::vector<position> keys;
+    for (uint8_t j = 0; j < NUM_DOWN; j++) {
+        for (uint8_t i = 0; i < NUM_ACROSS; i++) {
+            uint8_t k = keymap[0][j][i];
+            if (k == HID_KEY_CONTROL_LEFT || k == HID_KEY_ALT_LEFT || k == HID_KEY_SHIFT_LEFT) {
+                keys.push_back(position(j, i));
+            }
+        }
+    }
+    return keys;
+}
+
+static std::vector<position> randomKeys(uint8_t count) {
+    std::mt19937 rng(BENCH_SEED);
+    std::vector<position> keys;
+    while (keys.size() < count) {
+        position p(rng() % NUM_DOWN, rng() % NUM_ACROSS);
+        if (hasSwitch(p.first, p.second) && std::find(keys.begin(), keys.end(), p) == keys.end()) {
+            keys.push_back(p);
+        }
+    }
+    return keys;
+}
+
+static std::vector<benchCase> cases() {
+    std::vector<benchCase> c;
+
+    auto holding = [](std::vector<position> keys) {
+        return [keys]() { holdOnly(keys); settle(); };
+    };
+    auto scanning = [](uint32_t ops) {
+        for (uint32_t n = 0; n < ops; n++) KeyMatrix.scan();
+    };
+    c.push_back({"scan/idle", 5000, holding({}), scanning});
+    c.push_back({"scan/row+column", 5000, holding(rowAndColumn()), scanning});
+    // with no debounce every key changes every scan
+    std::vector<position> cross = rowAndColumn();
+    c.push_back({"scan/changing", 5000, holding({}), [cross](uint32_t ops) {
+        KeyMatrix.setDebounceDelay(0);
+        for (uint32_t n = 0; n < ops; n++) {
+            for (const position &p : cross) {
+                Sim.matrix->pressed[p.first][p.second] = !(n & 1);
+            }
+            KeyMatrix.scan();
+        }
+        KeyMatrix.setDebounceDelay(DEBOUNCE_DELAY);
+    }});
+
+    auto ghosting = [](uint32_t ops) {
+        for (uint32_t n = 0; n < ops; n++) KeyMatrix.preventGhosting();
+    };
+    c.push_back({"ghosting/idle", 50000, holding({}), ghosting});
+    c.push_back({"ghosting/row+column", 50000, holding(rowAndColumn()), ghosting});
+    c.push_back({"ghosting/block", 50000, holding(block()), ghosting});
+    c.push_back({"ghosting/modifiers", 50000, holding(modifiers()), ghosting});
+    c.push_back({"ghosting/random12", 50000, holding(randomKeys(12)), ghosting});
+
+    // 7 keys down is one more than a report has room for, an op is one press
+    // or release
+    auto none = []() { Keyboard.releaseAll(); };
+    auto overflowing = []() {
+        Keyboard.releaseAll();
+        for (uint8_t k = 0; k < MAX_KEYS + 1; k++) Keyboard.pressScancode(HID_KEY_A + k);
+    };
+    c.push_back({"keys/6kro", 700000, none, [](uint32_t ops) {
+        for (uint32_t n = 0; n < ops; n += 2*(MAX_KEYS + 1)) {
+            for (uint8_t k = 0; k < MAX_KEYS + 1; k++) Keyboard.pressScancode(HID_KEY_A + k);
+            for (uint8_t k = 0; k < MAX_KEYS + 1; k++) Keyboard.releaseScancode(HID_KEY_A + k);
+        }
+    }});
+    c.push_back({"keys/overflowing", 700000, overflowing, [](uint32_t ops) {
+        for (uint32_t n = 0; n < ops; n += 2) {
+            Keyboard.pressScancode(HID_KEY_Z);
+            Keyboard.releaseScancode(HID_KEY_Z);
+        }
+    }});
+
+    auto reporting = [](uint32_t ops) {
+        for (uint32_t n = 0; n < ops; n++) Keyboard.sendReport();
+    };
+    c.push_back({"report/6kro", 20000, []() {
+        Keyboard.releaseAll();
+        for (uint8_t k = 0; k < MAX_KEYS; k++) Keyboard.pressScancode(HID_KEY_A + k);
+    }, reporting});
+    c.push_back({"report/overflowing", 20000, overflowing, reporting});
+
+    // an op is one character
+    std::string line;
+    while (line.length() < 10000) line += "The quick brown fox jumps over the lazy dog, 0123456789 times! ";
+    c.push_back({"type/text", 10000, none, [line](uint32_t ops) {
+        Keyboard.type(line.data(), ops);
+    }});
+    return c;
+}
+
+int main(int argc, char **argv) {
+    // enough of the firmware to run the cases, without starting core1 or the
+    // main loop, so everything runs here between the simulator's interrupts
+    Recorder.begin();
+    Keyboard.begin();
+    TinyUSBDevice.attach();
+    Sim.host.plugIn();
+    Sim.run(SIM_ENUMERATE_US + 1);
+    KeyMatrix.begin();
+    multicore_reset_core1();
+
+    printf("# modelm-bench seed %d runs %d\n", BENCH_SEED, BENCH_RUNS);
+    for (const benchCase &c : cases()) {
+        bool wanted = argc < 2;
+        for (int a = 1; a < argc; a++) {
+            wanted |= strncmp(c.name, argv[a], strlen(argv[a])) == 0;
+        }
+        if (!wanted) {
+            continue;
+        }
+
+        double best = 0;
+        for (uint8_t r = 0; r < BENCH_RUNS; r++) {
+            c.prepare();
+            Sim.host.reports.clear();
+            auto start = std::chrono::steady_clock::now();
+            c.run(c.ops);
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            if (r == 0 || ns < best) {
+                best = ns;
+            }
+        }
+        printf("%-20s %8u %10.1f ns/op\n", c.name, c.ops, best / c.ops);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * SimHID.h - the parts of tinyusb's HID class header the firmware uses,
+ *            for the simulator (see Simulator.h)
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef SimHID_h
+#define SimHID_h
+
+#include <cstdint>
+
+typedef enum {
+    HID_REPORT_TYPE_INVALID = 0,
+    HID_REPORT_TYPE_INPUT,
+    HID_REPORT_TYPE_OUTPUT,
+    HID_REPORT_TYPE_FEATURE
+} hid_report_type_t;
+
+#define KEYBOARD_LED_NUMLOCK 0x01
+#define KEYBOARD_LED_CAPSLOCK 0x02
+#define KEYBOARD_LED_SCROLLLOCK 0x04
+#define KEYBOARD_LED_COMPOSE 0x08
+#define KEYBOARD_LED_KANA 0x10
+
+#define HID_KEY_NONE                0x00
+#define HID_KEY_A                   0x04
+#define HID_KEY_B                   0x05
+#define HID_KEY_C                   0x06
+#define HID_KEY_D                   0x07
+#define HID_KEY_E                   0x08
+#define HID_KEY_F                   0x09
+#define HID_KEY_G                   0x0A
+#define HID_KEY_H                   0x0B
+#define HID_KEY_I                   0x0C
+#define HID_KEY_J                   0x0D
+#define HID_KEY_K                   0x0E
+#define HID_KEY_L                   0x0F
+#define HID_KEY_M                   0x10
+#define HID_KEY_N                   0x11
+#define HID_KEY_O                   0x12
+#define HID_KEY_P                   0x13
+#define HID_KEY_Q                   0x14
+#define HID_KEY_R                   0x15
+#define HID_KEY_S                   0x16
+#define HID_KEY_T                   0x17
+#define HID_KEY_U                   0x18
+#define HID_KEY_V                   0x19
+#define HID_KEY_W                   0x1A
+#define HID_KEY_X                   0x1B
+#define HID_KEY_Y                   0x1C
+#define HID_KEY_Z                   0x1D
+#define HID_KEY_1                   0x1E
+#define HID_KEY_2                   0x1F
+#define HID_KEY_3                   0x20
+#define HID_KEY_4                   0x21
+#define HID_KEY_5                   0x22
+#define HID_KEY_6                   0x23
+#define HID_KEY_7                   0x24
+#define HID_KEY_8                   0x25
+#define HID_KEY_9                   0x26
+#define HID_KEY_0                   0x27
+#define HID_KEY_ENTER               0x28
+#define HID_KEY_ESCAPE              0x29
+#define HID_KEY_BACKSPACE           0x2A
+#define HID_KEY_TAB                 0x2B
+#define HID_KEY_SPACE               0x2C
+#define HID_KEY_MINUS               0x2D
+#define HID_KEY_EQUAL               0x2E
+#define HID_KEY_BRACKET_LEFT        0x2F
+#define HID_KEY_BRACKET_RIGHT       0x30
+#define HID_KEY_BACKSLASH           0x31
+#define HID_KEY_EUROPE_1            0x32
+#define HID_KEY_SEMICOLON           0x33
+#define HID_KEY_APOSTROPHE          0x34
+#define HID_KEY_GRAVE               0x35
+#define HID_KEY_COMMA               0x36
+#define HID_KEY_PERIOD              0x37
+#define HID_KEY_SLASH               0x38
+#define HID_KEY_CAPS_LOCK           0x39
+#define HID_KEY_F1                  0x3A
+#define HID_KEY_F2                  0x3B
+#define HID_KEY_F3                  0x3C
+#define HID_KEY_F4                  0x3D
+#define HID_KEY_F5                  0x3E
+#define HID_KEY_F6                  0x3F
+#define HID_KEY_F7                  0x40
+#define HID_KEY_F8                  0x41
+#define HID_KEY_F9                  0x42
+#define HID_KEY_F10                 0x43
+#define HID_KEY_F11                 0x44
+#define HID_KEY_F12                 0x45
+#define HID_KEY_PRINT_SCREEN        0x46
+#define HID_KEY_SCROLL_LOCK         0x47
+#define HID_KEY_PAUSE               0x48
+#define HID_KEY_INSERT              0x49
+#define HID_KEY_HOME                0x4A
+#define HID_KEY_PAGE_UP             0x4B
+#define HID_KEY_DELETE              0x4C
+#define HID_KEY_END                 0x4D
+#define HID_KEY_PAGE_DOWN           0x4E
+#define HID_KEY_ARROW_RIGHT         0x4F
+#define HID_KEY_ARROW_LEFT          0x50
+#define HID_KEY_ARROW_DOWN          0x51
+#define HID_KEY_ARROW_UP            0x52
+#define HID_KEY_NUM_LOCK            0x53
+#define HID_KEY_KEYPAD_DIVIDE       0x54
+#define HID_KEY_KEYPAD_MULTIPLY     0x55
+#define HID_KEY_KEYPAD_SUBTRACT     0x56
+#define HID_KEY_KEYPAD_ADD          0x57
+#define HID_KEY_KEYPAD_ENTER        0x58
+#define HID_KEY_KEYPAD_1            0x59
+#define HID_KEY_KEYPAD_2            0x5A
+#define HID_KEY_KEYPAD_3            0x5B
+#define HID_KEY_KEYPAD_4            0x5C
+#define HID_KEY_KEYPAD_5            0x5D
+#define HID_KEY_KEYPAD_6            0x5E
+#define HID_KEY_KEYPAD_7            0x5F
+#define HID_KEY_KEYPAD_8            0x60
+#define HID_KEY_KEYPAD_9            0x61
+#define HID_KEY_KEYPAD_0            0x62
+#define HID_KEY_KEYPAD_DECIMAL      0x63
+#define HID_KEY_EUROPE_2            0x64
+#define HID_KEY_APPLICATION         0x65
+#define HID_KEY_POWER               0x66
+#define HID_KEY_KEYPAD_EQUAL        0x67
+#define HID_KEY_F13                 0x68
+#define HID_KEY_F14                 0x69
+#define HID_KEY_F15                 0x6A
+#define HID_KEY_F16                 0x6B
+#define HID_KEY_F17                 0x6C
+#define HID_KEY_F18                 0x6D
+#define HID_KEY_F19                 0x6E
+#define HID_KEY_F20                 0x6F
+#define HID_KEY_F21                 0x70
+#define HID_KEY_F22                 0x71
+#define HID_KEY_F23                 0x72
+#define HID_KEY_F24                 0x73
+#define HID_KEY_EXECUTE             0x74
+#define HID_KEY_HELP                0x75
+#define HID_KEY_MENU                0x76
+#define HID_KEY_SELECT              0x77
+#define HID_KEY_STOP                0x78
+#define HID_KEY_AGAIN               0x79
+#define HID_KEY_UNDO                0x7A
+#define HID_KEY_CUT                 0x7B
+#define HID_KEY_COPY                0x7C
+#define HID_KEY_PASTE               0x7D
+#define HID_KEY_FIND                0x7E
+#define HID_KEY_MUTE                0x7F
+#define HID_KEY_VOLUME_UP           0x80
+#define HID_KEY_VOLUME_DOWN         0x81
+#define HID_KEY_LOCKING_CAPS_LOCK   0x82
+#define HID_KEY_LOCKING_NUM_LOCK    0x83
+#define HID_KEY_LOCKING_SCROLL_LOCK 0x84
+#define HID_KEY_KEYPAD_COMMA        0x85
+#define HID_KEY_KEYPAD_EQUAL_SIGN   0x86
+#define HID_KEY_KANJI1              0x87
+#define HID_KEY_KANJI2              0x88
+#define HID_KEY_KANJI3              0x89
+#define HID_KEY_KANJI4              0x8A
+#define HID_KEY_KANJI5              0x8B
+#define HID_KEY_KANJI6              0x8C
+#define HID_KEY_KANJI7              0x8D
+#define HID_KEY_KANJI8              0x8E
+#define HID_KEY_KANJI9              0x8F
+#define HID_KEY_LANG1               0x90
+#define HID_KEY_LANG2               0x91
+#define HID_KEY_LANG3               0x92
+#define HID_KEY_LANG4               0x93
+#define HID_KEY_LANG5               0x94
+#define HID_KEY_LANG6               0x95
+#define HID_KEY_LANG7               0x96
+#define HID_KEY_LANG8               0x97
+#define HID_KEY_LANG9               0x98
+#define HID_KEY_ALTERNATE_ERASE     0x99
+#define HID_KEY_SYSREQ_ATTENTION    0x9A
+#define HID_KEY_CANCEL              0x9B
+#define HID_KEY_CLEAR               0x9C
+#define HID_KEY_PRIOR               0x9D
+#define HID_KEY_RETURN              0x9E
+#define HID_KEY_SEPARATOR           0x9F
+#define HID_KEY_OUT                 0xA0
+#define HID_KEY_OPER                0xA1
+#define HID_KEY_CLEAR_AGAIN         0xA2
+#define HID_KEY_CRSEL_PROPS         0xA3
+#define HID_KEY_EXSEL               0xA4
+#define HID_KEY_CONTROL_LEFT        0xE0
+#define HID_KEY_SHIFT_LEFT          0xE1
+#define HID_KEY_ALT_LEFT            0xE2
+#define HID_KEY_GUI_LEFT            0xE3
+#define HID_KEY_CONTROL_RIGHT       0xE4
+#define HID_KEY_SHIFT_RIGHT         0xE5
+#define HID_KEY_ALT_RIGHT           0xE6
+#define HID_KEY_GUI_RIGHT           0xE7
+
+// {shift, keycode} for each ASCII character
+#define HID_ASCII_TO_KEYCODE \
+    {0, 0x00}, {0, 0x00}, {0, 0x00}, {0, 0x00}, {0, 0x00}, {0, 0x00}, {0, 0x00}, {0, 0x00}, \
+    {0, 0x2A}, {0, 0x2B}, {0, 0x28}, {0, 0x00}, {0, 0x00}, {0, 0x28}, {0, 0x00}, {0, 0x00}, \
+    {0, 0x00}, {0, 0x00}, {0, 0x00}, {0, 0x00}, {0, 0x00}, {0, 0x00}, {0, 0x00}, {0, 0x00}, \
+    {0, 0x00}, {0, 0x00}, {0, 0x00}, {0, 0x29}, {0, 0x00}, {0, 0x00}, {0, 0x00}, {0, 0x00}, \
+    {0, 0x2C}, {1, 0x1E}, {1, 0x34}, {1, 0x20}, {1, 0x21}, {1, 0x22}, {1, 0x24}, {0, 0x34}, \
+    {1, 0x26}, {1, 0x27}, {1, 0x25}, {1, 0x2E}, {0, 0x36}, {0, 0x2D}, {0, 0x37}, {0, 0x38}, \
+    {0, 0x27}, {0, 0x1E}, {0, 0x1F}, {0, 0x20}, {0, 0x21}, {0, 0x22}, {0, 0x23}, {0, 0x24}, \
+    {0, 0x25}, {0, 0x26}, {1, 0x33}, {0, 0x33}, {1, 0x36}, {0, 0x2E}, {1, 0x37}, {1, 0x38}, \
+    {1, 0x1F}, {1, 0x04}, {1, 0x05}, {1, 0x06}, {1, 0x07}, {1, 0x08}, {1, 0x09}, {1, 0x0A}, \
+    {1, 0x0B}, {1, 0x0C}, {1, 0x0D}, {1, 0x0E}, {1, 0x0F}, {1, 0x10}, {1, 0x11}, {1, 0x12}, \
+    {1, 0x13}, {1, 0x14}, {1, 0x15}, {1, 0x16}, {1, 0x17}, {1, 0x18}, {1, 0x19}, {1, 0x1A}, \
+    {1, 0x1B}, {1, 0x1C}, {1, 0x1D}, {0, 0x2F}, {0, 0x31}, {0, 0x30}, {1, 0x23}, {1, 0x2D}, \
+    {0, 0x35}, {0, 0x04}, {0, 0x05}, {0, 0x06}, {0, 0x07}, {0, 0x08}, {0, 0x09}, {0, 0x0A}, \
+    {0, 0x0B}, {0, 0x0C}, {0, 0x0D}, {0, 0x0E}, {0, 0x0F}, {0, 0x10}, {0, 0x11}, {0, 0x12}, \
+    {0, 0x13}, {0, 0x14}, {0, 0x15}, {0, 0x16}, {0, 0x17}, {0, 0x18}, {0, 0x19}, {0, 0x1A}, \
+    {0, 0x1B}, {0, 0x1C}, {0, 0x1D}, {1, 0x2F}, {1, 0x31}, {1, 0x30}, {1, 0x35}, {0, 0x4C}, \
+
+// the same report descriptors as tinyusb's macros, byte for byte
+#define HID_REPORT_ID(x) 0x85, x,
+
+#define TUD_HID_REPORT_DESC_KEYBOARD(...) \
+    0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, __VA_ARGS__ \
+    /* modifiers */ \
+    0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01, 0x95, 0x08, 0x75, 0x01, 0x81, 0x02, \
+    /* reserved */ \
+    0x95, 0x01, 0x75, 0x08, 0x81, 0x01, \
+    /* LEDs and padding */ \
+    0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x95, 0x05, 0x75, 0x01, 0x91, 0x02, \
+    0x95, 0x01, 0x75, 0x03, 0x91, 0x01, \
+    /* 6 keys */ \
+    0x05, 0x07, 0x19, 0x00, 0x2A, 0xFF, 0x00, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x95, 0x06, 0x75, 0x08, 0x81, 0x00, \
+    0xC0
+
+#define TUD_HID_REPORT_DESC_MOUSE(...) \
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, __VA_ARGS__ \
+    0x09, 0x01, 0xA1, 0x00, \
+    /* 5 buttons and padding */ \
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x05, 0x15, 0x00, 0x25, 0x01, 0x95, 0x05, 0x75, 0x01, 0x81, 0x02, \
+    0x95, 0x01, 0x75, 0x03, 0x81, 0x01, \
+    /* x, y */ \
+    0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x81, 0x25, 0x7F, 0x95, 0x02, 0x75, 0x08, 0x81, 0x06, \
+    /* wheel */ \
+    0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x95, 0x01, 0x75, 0x08, 0x81, 0x06, \
+    /* horizontal wheel (AC pan) */ \
+    0x05, 0x0C, 0x0A, 0x38, 0x02, 0x15, 0x81, 0x25, 0x7F, 0x95, 0x01, 0x75, 0x08, 0x81, 0x06, \
+    0xC0, \
+    0xC0
+
+#define TUD_HID_REPORT_DESC_GENERIC_INOUT(report_size, ...) \
+    0x06, 0x00, 0xFF, 0x09, 0x01, 0xA1, 0x01, __VA_ARGS__ \
+    0x09, 0x02, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x75, 0x08, 0x95, report_size, 0x81, 0x02, \
+    0x09, 0x03, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x75, 0x08, 0x95, report_size, 0x91, 0x02, \
+    0xC0
+
+#endif
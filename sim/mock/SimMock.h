@@ -0,0 +1,304 @@
+/*
+ * SimMock.h - stand-ins for the pico-sdk and Adafruit TinyUSB functions the
+ *             firmware uses, so it can be built and run on Linux (the
+ *             headers next to this one all include it)
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef SimMock_h
+#define SimMock_h
+
+#include <cstdint>
+#include <cstddef>
+
+#include "SimHID.h"
+
+typedef unsigned int uint;
+
+//--------------------------------------------------------------------+
+// pico/platform.h, pico/binary_info.h
+//--------------------------------------------------------------------+
+
+#define __uninitialized_ram(group) group
+uint get_core_num();
+void tight_loop_contents(); // a busy wait, so time goes on a little
+#define bi_decl(...)
+
+//--------------------------------------------------------------------+
+// pico/time.h, time only moves on when the firmware sleeps (see Simulator.h)
+//--------------------------------------------------------------------+
+
+typedef uint64_t absolute_time_t;
+uint64_t time_us_64();
+static inline uint32_t time_us_32() { return (uint32_t)time_us_64(); }
+static inline absolute_time_t get_absolute_time() { return time_us_64(); }
+static inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+static inline uint32_t to_ms_since_boot(absolute_time_t t) { return (uint32_t)(t / 1000); }
+void sleep_us(uint64_t us);
+static inline void sleep_ms(uint32_t ms) { sleep_us(ms * 1000ull); }
+static inline void busy_wait_us_32(uint32_t us) { sleep_us(us); }
+
+typedef struct repeating_timer repeating_timer_t;
+typedef bool (*repeating_timer_callback_t)(repeating_timer_t *rt);
+struct repeating_timer {
+    int64_t delay_us;
+    repeating_timer_callback_t callback;
+    void *user_data;
+    uint64_t next; // when it's due
+};
+bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out);
+static inline bool add_repeating_timer_ms(int32_t delay_ms, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out) {
+    return add_repeating_timer_us(delay_ms * 1000ll, callback, user_data, out);
+}
+bool cancel_repeating_timer(repeating_timer_t *timer);
+
+//--------------------------------------------------------------------+
+// pico/sync.h, hardware/sync.h, pico/multicore.h
+//--------------------------------------------------------------------+
+
+typedef volatile uint32_t spin_lock_t;
+typedef struct {
+    spin_lock_t *spin_lock;
+} lock_core_t;
+typedef struct {
+    lock_core_t core;
+    int8_t owner; // -1 when free
+} mutex_t;
+void mutex_init(mutex_t *mtx);
+void mutex_enter_blocking(mutex_t *mtx);
+bool mutex_enter_timeout_ms(mutex_t *mtx, uint32_t timeout_ms);
+void mutex_exit(mutex_t *mtx);
+static inline void spin_unlock_unsafe(spin_lock_t *lock) { (void) lock; }
+#define PICO_SPINLOCK_ID_TIMER 10
+#define PICO_SPINLOCK_ID_STRIPED_FIRST 16
+#define PICO_SPINLOCK_ID_STRIPED_LAST 23
+static inline spin_lock_t* spin_lock_instance(unsigned lock_num) {
+    static spin_lock_t locks[32];
+    return &locks[lock_num];
+}
+
+static inline uint32_t save_and_disable_interrupts() { return 0; }
+static inline void restore_interrupts(uint32_t status) { (void) status; }
+static inline void __mem_fence_acquire() {}
+static inline void __mem_fence_release() {}
+void __sev(); // wakes core1 from __wfe()
+void __wfe(); // core1 waits for __sev() or a GPIO interrupt
+static inline void __wfi() { __wfe(); }
+
+void multicore_launch_core1(void (*entry)(void));
+void multicore_reset_core1();
+static inline void multicore_lockout_victim_init() {}
+static inline void multicore_lockout_start_blocking() {}
+static inline void multicore_lockout_end_blocking() {}
+
+//--------------------------------------------------------------------+
+// pico/bootrom.h, hardware/watchdog.h
+//--------------------------------------------------------------------+
+
+void reset_usb_boot(uint32_t usb_activity_gpio_pin_mask, uint32_t disable_interface_mask);
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug);
+void watchdog_update();
+bool watchdog_caused_reboot();
+
+//--------------------------------------------------------------------+
+// hardware/gpio.h, the matrix pins read from the VirtualMatrix
+//--------------------------------------------------------------------+
+
+enum gpio_dir {
+    GPIO_IN = 0,
+    GPIO_OUT = 1
+};
+enum gpio_irq_level {
+    GPIO_IRQ_LEVEL_LOW = 0x1u,
+    GPIO_IRQ_LEVEL_HIGH = 0x2u,
+    GPIO_IRQ_EDGE_FALL = 0x4u,
+    GPIO_IRQ_EDGE_RISE = 0x8u
+};
+typedef void (*gpio_irq_callback_t)(uint gpio, uint32_t event_mask);
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_put(uint gpio, bool value);
+bool gpio_get(uint gpio);
+uint32_t gpio_get_all();
+void gpio_pull_up(uint gpio);
+void gpio_pull_down(uint gpio);
+void gpio_disable_pulls(uint gpio);
+void gpio_set_irq_enabled(uint gpio, uint32_t events, bool enabled);
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t events, bool enabled, gpio_irq_callback_t callback);
+
+//--------------------------------------------------------------------+
+// hardware/clocks.h, hardware/pll.h, hardware/vreg.h
+//--------------------------------------------------------------------+
+
+enum clock_index {
+    clk_gpout0 = 0, clk_gpout1, clk_gpout2, clk_gpout3, clk_ref, clk_sys, clk_peri, clk_usb, clk_adc, clk_rtc, CLK_COUNT
+};
+#define KHZ 1000
+#define MHZ 1000000
+#define CLOCKS_CLK_SYS_CTRL_SRC_VALUE_CLKSRC_CLK_SYS_AUX 0x1
+#define CLOCKS_CLK_SYS_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB 0x1
+#define CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB 0x2
+#define CLOCKS_FC0_SRC_VALUE_CLK_SYS 0x09
+bool clock_configure(enum clock_index clk_index, uint32_t src, uint32_t auxsrc, uint32_t src_freq, uint32_t freq);
+uint32_t clock_get_hz(enum clock_index clk_index);
+bool set_sys_clock_khz(uint32_t freq_khz, bool required);
+bool check_sys_clock_khz(uint32_t freq_khz, uint *vco_freq_out, uint *post_div1_out, uint *post_div2_out);
+uint32_t frequency_count_khz(uint src);
+
+typedef struct pll_hw pll_hw_t;
+typedef pll_hw_t *PLL;
+#define pll_sys ((PLL)0)
+#define pll_usb ((PLL)1)
+static inline void pll_deinit(PLL pll) { (void) pll; }
+
+enum vreg_voltage {
+    VREG_VOLTAGE_0_85 = 0b0110,
+    VREG_VOLTAGE_0_90 = 0b0111,
+    VREG_VOLTAGE_0_95 = 0b1000,
+    VREG_VOLTAGE_1_00 = 0b1001,
+    VREG_VOLTAGE_1_05 = 0b1010,
+    VREG_VOLTAGE_1_10 = 0b1011,
+    VREG_VOLTAGE_1_15 = 0b1100,
+    VREG_VOLTAGE_1_20 = 0b1101,
+    VREG_VOLTAGE_1_25 = 0b1110,
+    VREG_VOLTAGE_1_30 = 0b1111,
+    VREG_VOLTAGE_DEFAULT = VREG_VOLTAGE_1_10
+};
+static inline void vreg_set_voltage(enum vreg_voltage voltage) { (void) voltage; }
+
+//--------------------------------------------------------------------+
+// hardware/pio.h, hardware/dma.h, ws2812.pio.h, frames sent to the LED end
+// up in Simulator::leds
+//--------------------------------------------------------------------+
+
+typedef struct {
+    volatile uint32_t txf[4];
+} pio_hw_t;
+typedef pio_hw_t *PIO;
+extern pio_hw_t sim_pio0;
+#define pio0 (&sim_pio0)
+typedef struct pio_program pio_program_t;
+uint pio_add_program(PIO pio, const pio_program_t *program);
+static inline void pio_sm_set_enabled(PIO pio, uint sm, bool enabled) { (void) pio; (void) sm; (void) enabled; }
+static inline void pio_sm_set_clkdiv(PIO pio, uint sm, float div) { (void) pio; (void) sm; (void) div; }
+static inline void pio_sm_clkdiv_restart(PIO pio, uint sm) { (void) pio; (void) sm; }
+static inline uint pio_get_dreq(PIO pio, uint sm, bool is_tx) { (void) pio; return sm + (is_tx ? 0 : 4); }
+
+extern const pio_program_t ws2812_program;
+#define ws2812_T1 2
+#define ws2812_T2 5
+#define ws2812_T3 3
+static inline void ws2812_program_init(PIO pio, uint sm, uint offset, uint pin, float freq, bool rgbw) {
+    (void) pio; (void) sm; (void) offset; (void) pin; (void) freq; (void) rgbw;
+}
+
+enum dma_channel_transfer_size {
+    DMA_SIZE_8 = 0,
+    DMA_SIZE_16 = 1,
+    DMA_SIZE_32 = 2
+};
+typedef struct {
+    uint32_t ctrl;
+} dma_channel_config;
+int dma_claim_unused_channel(bool required);
+static inline dma_channel_config dma_channel_get_default_config(uint channel) { (void) channel; return {0}; }
+static inline void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size) { (void) c; (void) size; }
+static inline void channel_config_set_read_increment(dma_channel_config *c, bool incr) { (void) c; (void) incr; }
+static inline void channel_config_set_write_increment(dma_channel_config *c, bool incr) { (void) c; (void) incr; }
+static inline void channel_config_set_dreq(dma_channel_config *c, uint dreq) { (void) c; (void) dreq; }
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr, const volatile void *read_addr, uint transfer_count, bool trigger);
+void dma_channel_set_read_addr(uint channel, const volatile void *read_addr, bool trigger);
+static inline bool dma_channel_is_busy(uint channel) { (void) channel; return false; }
+
+//--------------------------------------------------------------------+
+// hardware/flash.h, flash is an array that starts erased
+//--------------------------------------------------------------------+
+
+#define PICO_FLASH_SIZE_BYTES (8 * 1024 * 1024)
+#define FLASH_PAGE_SIZE (1u << 8)
+#define FLASH_SECTOR_SIZE (1u << 12)
+extern uint8_t sim_flash[PICO_FLASH_SIZE_BYTES];
+#define XIP_BASE ((uintptr_t)sim_flash)
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count);
+
+//--------------------------------------------------------------------+
+// bsp/board.h, the tinyusb callbacks (in usb.cpp) that VirtualHost calls
+//--------------------------------------------------------------------+
+
+void tud_mount_cb(void);
+void tud_umount_cb(void);
+void tud_suspend_cb(bool remote_wakeup_en);
+void tud_resume_cb(void);
+
+//--------------------------------------------------------------------+
+// Adafruit_TinyUSB.h, reports go to VirtualHost
+//--------------------------------------------------------------------+
+
+#define CFG_TUD_HID_BUFSIZE 64
+#define CFG_TUD_HID_EP_BUFSIZE 64
+
+typedef uint16_t (*get_report_callback_t)(uint8_t report_id, hid_report_type_t report_type, uint8_t *buffer, uint16_t reqlen);
+typedef void (*set_report_callback_t)(uint8_t report_id, hid_report_type_t report_type, uint8_t const *buffer, uint16_t bufsize);
+
+class Adafruit_USBD_HID {
+    public:
+        Adafruit_USBD_HID();
+        void setPollInterval(uint8_t interval_ms) { pollinterval = interval_ms; };
+        void setReportDescriptor(uint8_t const *desc_report, uint16_t len) { descriptor = desc_report; descriptorlength = len; };
+        bool setStringDescriptor(const char *str) { (void) str; return true; };
+        void setBootProtocol(uint8_t protocol) { (void) protocol; };
+        void enableOutEndpoint(bool enable) { (void) enable; };
+        void setReportCallback(get_report_callback_t get_report, set_report_callback_t set_report) { (void) get_report; setreport = set_report; };
+        bool begin();
+
+        bool ready();
+        bool sendReport(uint8_t report_id, void const *report, uint8_t len);
+        bool keyboardReport(uint8_t report_id, uint8_t modifier, const uint8_t keycode[6]);
+        bool mouseReport(uint8_t report_id, uint8_t buttons, int8_t x, int8_t y, int8_t vertical, int8_t horizontal);
+
+        // for VirtualHost
+        int8_t interface = -1; // in the order begin() was called
+        uint8_t pollinterval = 1; // ms
+        const uint8_t *descriptor = NULL;
+        uint16_t descriptorlength = 0;
+        set_report_callback_t setreport = NULL;
+};
+
+class Adafruit_USBD_Device {
+    public:
+        void clearConfiguration() {};
+        bool begin(uint8_t rhport = 0) { (void) rhport; return true; };
+        bool detach();
+        bool attach();
+        bool mounted();
+        bool suspended();
+        bool remoteWakeup();
+};
+
+extern Adafruit_USBD_Device TinyUSBDevice;
+void TinyUSB_Port_InitDevice(uint8_t rhport);
+
+#endif
@@ -0,0 +1,2 @@
+// stands in for the real hardware/gpio.h when building the simulator, see SimMock.h
+#include "../SimMock.h"
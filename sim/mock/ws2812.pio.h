@@ -0,0 +1,2 @@
+// stands in for the real ws2812.pio.h when building the simulator, see SimMock.h
+#include "SimMock.h"
@@ -0,0 +1,396 @@
+/*
+ * replay.cpp - play key press traces through the firmware and measure how
+ *              long the keys take to get to the computer and whether they
+ *              all got there
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+// usage: modelm-replay [-v] [-r] [-m] [-p name=value] [-s us] [-d ms] [-i us] trace...
+//        modelm-replay-resolver ... sim/traces/resolver/*.trace
+//
+// plays traces of key presses (see Trace.h) from sim/traces or made by
+// tools/gentrace.py. modelm-replay-resolver is the same with the tap-hold and
+// combo examples in KeyboardLayout.cpp switched on.
+//
+// each trace starts once the keyboard is mounted and runs in a new copy of
+// the firmware. for each press and release the latency is from the change on
+// the matrix to the first report that has it, a press that never makes it
+// is dropped, a key sent again while it's still pressed is duplicated, a key
+// never released is stuck, a key sent when it isn't pressed is a phantom, and
+// a ghosting key that's sent anyway after being ignored leaked. a trace with
+// report lines is checked against those instead. -v prints every press and
+// release (or report line), and -r every keyboard report that's different to
+// the one before. the exit status is 1 if anything didn't go as it should
+// have in any of the traces
+//
+// -m runs the traces on the electrical model of the membrane (see
+// Membrane.h) rather than an ideal matrix, and -p changes one of its
+// parameters (and implies -m). the membrane makes its own bounces and
+// ghosting, so contact lines are left out. -s, -d, and -i set the firmware's
+// settle delay, debounce delay, and scan interval, tools/sweep.py uses these
+// to find the quickest settings that don't lose or make up any keys
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "Simulator.h"
+#include "Membrane.h"
+#include "Trace.h"
+#include "Keymap.h"
+#include "MatrixScanner.h"
+#include "USBKeyboard.h"
+
+// a key going down or up in the reports
+struct keyChange {
+    uint64_t time;
+    bool down;
+};
+
+static bool verbose = false;
+static bool showreports = false;
+static bool membrane = false;
+static membraneParams params;
+static uint16_t settledelay = SETTLE_DELAY;
+static uint16_t debouncedelay = DEBOUNCE_DELAY;
+static uint16_t scaninterval = SCAN_INTERVAL;
+
+static void printReport(const simReport &r) {
+    static simReport last;
+    if (r.interface != 0 || r.id != RID_KEYBOARD || (last.length == r.length && memcmp(last.data, r.data, r.length) == 0)) {
+        return;
+    }
+    memcpy(&last, &r, sizeof(simReport));
+    printf("  %10.3f report", ((int64_t)r.time - REPLAY_START) / 1000.0);
+    for (uint8_t c = 0; c < r.length; c++) {
+        printf(" %02x", r.data[c]);
+    }
+    printf("\n");
+}
+
+// when each key goes down and up according to the keyboard reports, a report
+// saying too many keys are down doesn't change anything
+static void reportedChanges(std::vector<keyChange> changes[256]) {
+    bool down[256] = {};
+    for (const simReport &r : Sim.host.reports) {
+        if (r.interface != 0 || r.id != RID_KEYBOARD || r.length < 8 || r.time < REPLAY_START) {
+            continue;
+        }
+        if (r.data[2] == 0x01) { // ErrorRollOver, see USBKeyboard::sendReport
+            continue;
+        }
+        bool now[256] = {};
+        for (uint8_t b = 0; b < 8; b++) {
+            if (r.data[0] & (1 << b)) {
+                now[HID_KEY_CONTROL_LEFT + b] = true;
+            }
+        }
+        for (uint8_t c = 2; c < 8; c++) {
+            now[r.data[c]] = true;
+        }
+        now[HID_KEY_NONE] = false;
+        for (uint16_t k = 0; k < 256; k++) {
+            if (now[k] != down[k]) {
+                changes[k].push_back({r.time - REPLAY_START, now[k]});
+                down[k] = now[k];
+            }
+        }
+    }
+}
+
+static void printExpected(const replayReport *r) {
+    if (r == NULL) {
+        printf(" nothing");
+        return;
+    }
+    printf(" %02x", r->modifiers);
+    for (uint8_t c = 0; c < sizeof(r->keys) && r->keys[c] != HID_KEY_NONE; c++) {
+        printf(" %02x", r->keys[c]);
+    }
+    printf(" at %.3f", r->time / 1000.0);
+}
+
+// for a trace with report lines, what was sent has to be exactly those, in
+// order, rather than the keys that were pressed
+static int checkReports(const std::vector<replayReport> &expected) {
+    std::vector<replayReport> sent;
+    replayReport last = {};
+    for (const simReport &r : Sim.host.reports) {
+        if (r.interface != 0 || r.id != RID_KEYBOARD || r.length < 8 || r.time < REPLAY_START) {
+            continue;
+        }
+        replayReport now = {};
+        now.time = r.time - REPLAY_START;
+        now.modifiers = r.data[0];
+        uint8_t count = 0;
+        for (uint8_t c = 2; c < 8; c++) {
+            if (r.data[c] != HID_KEY_NONE) {
+                now.keys[count++] = r.data[c];
+            }
+        }
+        std::sort(now.keys, now.keys + count);
+        if (now.modifiers != last.modifiers || memcmp(now.keys, last.keys, sizeof(now.keys)) != 0) {
+            sent.push_back(now);
+        }
+        last = now;
+    }
+
+    size_t matched = 0;
+    for (size_t c = 0; c < std::max(sent.size(), expected.size()); c++) {
+        const replayReport *e = c < expected.size() ? &expected[c] : NULL;
+        const replayReport *r = c < sent.size() ? &sent[c] : NULL;
+        bool same = e != NULL && r != NULL && e->modifiers == r->modifiers &&
+            memcmp(e->keys, r->keys, sizeof(e->keys)) == 0 && r->time >= e->time;
+        matched += same;
+        if (verbose || !same) {
+            printf("  %3zu expected", c);
+            printExpected(e);
+            printf(", sent");
+            printExpected(r);
+            printf("%s\n", same ? "" : " wrong");
+        }
+    }
+    printf("  %zu reports expected, %zu sent, %zu as expected\n", expected.size(), sent.size(), matched);
+    return matched != expected.size() || sent.size() != expected.size();
+}
+
+static int replay(const char *path) {
+    std::vector<replayEvent> events;
+    std::vector<replayReport> expected;
+    if (!loadTrace(path, events, &expected)) {
+        return 1;
+    }
+    printf("%s\n", path);
+    printf("  settle %u us, debounce %u ms, scan interval %u us, %s matrix\n", settledelay, debouncedelay, scaninterval,
+            membrane ? "membrane" : "ideal");
+
+    static MembraneMatrix matrix(params);
+    if (membrane) {
+        Sim.matrix = &matrix;
+    }
+    Sim.begin();
+    Sim.at(0, []() { Sim.host.plugIn(); });
+    // well after setup() and before the trace
+    Sim.at(REPLAY_START / 2, []() {
+        KeyMatrix.setSettleDelay(settledelay);
+        KeyMatrix.setDebounceDelay(debouncedelay);
+        KeyMatrix.setScanInterval(scaninterval);
+    });
+    if (showreports) {
+        Sim.host.listener = printReport;
+    }
+    uint64_t end = scheduleTrace(events, !membrane) + REPLAY_END;
+    try {
+        Sim.run(REPLAY_START + end);
+    }
+    catch (const SimHalt &h) {
+        printf("  halted: %s\n", h.reason);
+        return 1;
+    }
+    if (!expected.empty()) {
+        return checkReports(expected);
+    }
+
+    // go through the presses and releases of each key in order, each is
+    // matched with the first change in the reports after it and before the
+    // next one of that key
+    std::vector<keyChange> reported[256];
+    reportedChanges(reported);
+    std::vector<uint64_t> presslatency, releaselatency;
+    uint32_t presses = 0, dropped = 0, duplicated = 0, stuck = 0, phantom = 0, ghosts = 0, ghostsignored = 0;
+    bool intended[256] = {};
+    uint64_t first[256]; // when each key is first pressed or released
+    bool sent[256] = {}; // the last press of each key was
+    bool ghost[256] = {}; // and was expected to be ignored
+    uint32_t leaked = 0;
+    for (size_t c = 0; c < events.size(); c++) {
+        const replayEvent &e = events[c];
+        if (e.type == REPLAY_CONTACT) {
+            continue;
+        }
+        uint8_t k = keymap[0][e.down][e.across];
+        if (!intended[k]) {
+            intended[k] = true;
+            first[k] = e.time;
+        }
+        uint64_t next = UINT64_MAX;
+        for (size_t c2 = c + 1; c2 < events.size(); c2++) {
+            if (events[c2].type != REPLAY_CONTACT && keymap[0][events[c2].down][events[c2].across] == k) {
+                next = events[c2].time;
+                break;
+            }
+        }
+
+        bool found = false;
+        uint64_t latency = 0;
+        uint32_t downs = 0;
+        for (const keyChange &r : reported[k]) {
+            if (r.time < e.time || r.time >= next) {
+                continue;
+            }
+            if (r.down == e.value && !found) {
+                found = true;
+                latency = r.time - e.time;
+            }
+            downs += r.down;
+        }
+
+        if (e.type == REPLAY_PRESS) {
+            presses++;
+            ghosts += e.ghost;
+            if (e.ghost) {
+                ghostsignored += !found;
+                duplicated += downs > 1 ? downs - 1 : 0;
+            }
+            else {
+                dropped += !found;
+                duplicated += downs > 1 ? downs - 1 : 0;
+            }
+            if (found) {
+                presslatency.push_back(latency);
+            }
+            sent[k] = found;
+            ghost[k] = e.ghost;
+        }
+        else if (ghost[k]) {
+            leaked += downs; // sent late, e.g. as the rectangle came apart
+            if (found) {
+                releaselatency.push_back(latency);
+            }
+        }
+        else {
+            phantom += downs; // sent while it wasn't pressed
+            if (found) {
+                releaselatency.push_back(latency);
+            }
+            else if (!reported[k].empty() && reported[k].back().down) {
+                stuck++;
+            }
+        }
+        if (verbose) {
+            printf("  %10.3f %s %d %d %02x%s ", e.time / 1000.0, e.type == REPLAY_PRESS ? "press" : "release",
+                    e.down, e.across, k, e.ghost ? " ghost" : "");
+            if (found) {
+                printf("%lu us\n", latency);
+            }
+            else if (e.type == REPLAY_PRESS) {
+                printf("%s\n", e.ghost ? "ignored" : "missing");
+            }
+            else {
+                printf("%s\n", sent[k] ? "missing" : "not pressed");
+            }
+        }
+    }
+    for (uint16_t k = 0; k < 256; k++) {
+        for (const keyChange &r : reported[k]) {
+            if (!intended[k] || r.time < first[k]) {
+                phantom += r.down;
+            }
+        }
+    }
+
+    uint32_t reports = 0, changed = 0;
+    const simReport *last = NULL;
+    for (const simReport &r : Sim.host.reports) {
+        if (r.interface != 0 || r.id != RID_KEYBOARD || r.time < REPLAY_START) {
+            continue;
+        }
+        reports++;
+        if (last == NULL || memcmp(last->data, r.data, r.length) != 0) {
+            changed++;
+        }
+        last = &r;
+    }
+
+    printf("  %u presses, %u ghosting, over %.3f s\n", presses, ghosts, end / 1e6);
+    printf("  %u reports, %.1f a second, %u changed\n", reports, reports * 1e6 / end, changed);
+    printLatency("press", presslatency);
+    printLatency("release", releaselatency);
+    printf("  dropped %u duplicated %u stuck %u phantom %u ghosting ignored %u of %u leaked %u\n", dropped, duplicated, stuck,
+            phantom, ghostsignored, ghosts, leaked);
+    return dropped || duplicated || stuck || phantom || ghostsignored != ghosts || leaked;
+}
+
+int main(int argc, char **argv) {
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; first++) {
+        if (strcmp(argv[first], "-v") == 0) {
+            verbose = true;
+        }
+        else if (strcmp(argv[first], "-r") == 0) {
+            showreports = true;
+        }
+        else if (strcmp(argv[first], "-m") == 0) {
+            membrane = true;
+        }
+        else if (first + 1 < argc && strcmp(argv[first], "-p") == 0) {
+            char name[32];
+            double value;
+            first++;
+            if (sscanf(argv[first], "%31[^=]=%lf", name, &value) != 2 || !params.set(name, value)) {
+                fprintf(stderr, "%s: not a membrane parameter, see sim/Membrane.h\n", argv[first]);
+                return 2;
+            }
+            membrane = true;
+        }
+        else if (first + 1 < argc && strcmp(argv[first], "-s") == 0) {
+            settledelay = atoi(argv[++first]);
+        }
+        else if (first + 1 < argc && strcmp(argv[first], "-d") == 0) {
+            debouncedelay = atoi(argv[++first]);
+        }
+        else if (first + 1 < argc && strcmp(argv[first], "-i") == 0) {
+            scaninterval = atoi(argv[++first]);
+        }
+        else {
+            first = argc;
+        }
+    }
+    if (first >= argc) {
+        fprintf(stderr, "usage: %s [-v] [-r] [-m] [-p name=value] [-s us] [-d ms] [-i us] trace...\n", argv[0]);
+        return 2;
+    }
+
+    // the firmware can only start once, so each trace gets a new process
+    int result = 0;
+    for (int c = first; c < argc; c++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            int r = replay(argv[c]);
+            fflush(stdout);
+            _exit(r);
+        }
+        int status = 1;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            result = 1;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,166 @@
+/*
+ * sim.cpp - run the firmware on Linux from a script of things happening to
+ *           the keyboard, and print the reports the computer gets
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+// usage: modelm-sim [script]
+//
+// each line of the script (or stdin) is a time in ms and something happening
+// at that time, blank lines and anything after # are ignored
+//   plug                  the cable is plugged in (the computer takes a
+//                         little while to set the keyboard up)
+//   unplug
+//   suspend [0|1]         the computer goes to sleep, 1 if it allows remote wakeup
+//   resume
+//   press down across     a key on the matrix
+//   release down across
+//   leds n                the computer sets the lock lights (KEYBOARD_LED_*)
+//   end                   stop here, otherwise it's 1 s after the last line
+//
+// the keyboard sends a report every time round the main loop, each one that's
+// different to the last with the same interface and report id is printed as
+// the time it was received (ms), the interface, the report id, and then the
+// report in hex. the total number of reports is printed at the end
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+
+#include "Simulator.h"
+
+static void fail(int lineno, const char *msg) {
+    fprintf(stderr, "line %d: %s\n", lineno, msg);
+    exit(1);
+}
+
+static simReport last[2][4];
+
+static void printReport(const simReport &r) {
+    simReport *l = &last[r.interface & 1][r.id & 3];
+    if (l->length == r.length && memcmp(l->data, r.data, r.length) == 0) {
+        return;
+    }
+    memcpy(l, &r, sizeof(simReport));
+    printf("%10.3f %d %d", r.time / 1000.0, r.interface, r.id);
+    for (uint8_t c = 0; c < r.length; c++) {
+        printf(" %02x", r.data[c]);
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    FILE *script = stdin;
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [script]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 2 && strcmp(argv[1], "-") != 0) {
+        script = fopen(argv[1], "r");
+        if (script == NULL) {
+            perror(argv[1]);
+            return 1;
+        }
+    }
+
+    Sim.begin();
+    Sim.host.listener = printReport;
+
+    char line[256], event[32];
+    int lineno = 0;
+    uint64_t end = 0;
+    bool ended = false;
+    while (!ended && fgets(line, sizeof(line), script) != NULL) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash != NULL) {
+            *hash = 0;
+        }
+        double ms;
+        int a = -1, b = -1;
+        int n = sscanf(line, "%lf %31s %d %d", &ms, event, &a, &b);
+        if (n <= 0) {
+            continue;
+        }
+        if (n < 2 || ms < 0) {
+            fail(lineno, "expected a time and an event");
+        }
+        uint64_t t = ms * 1000;
+        end = t + 1000000;
+
+        if (strcmp(event, "plug") == 0) {
+            Sim.at(t, []() { Sim.host.plugIn(); });
+        }
+        else if (strcmp(event, "unplug") == 0) {
+            Sim.at(t, []() { Sim.host.unplug(); });
+        }
+        else if (strcmp(event, "suspend") == 0) {
+            bool remote = n < 3 || a != 0;
+            Sim.at(t, [remote]() { Sim.host.suspend(remote); });
+        }
+        else if (strcmp(event, "resume") == 0) {
+            Sim.at(t, []() { Sim.host.resume(); });
+        }
+        else if (strcmp(event, "press") == 0 || strcmp(event, "release") == 0) {
+            if (n != 4 || a < 0 || a >= NUM_DOWN || b < 0 || b >= NUM_ACROSS) {
+                fail(lineno, "expected a down and across inside the matrix");
+            }
+            bool pressed = event[1] == 'r'; // press, not release
+            Sim.at(t, [a, b, pressed]() {
+                if (pressed) {
+                    Sim.matrix->press(a, b);
+                }
+                else {
+                    Sim.matrix->release(a, b);
+                }
+            });
+        }
+        else if (strcmp(event, "leds") == 0) {
+            if (n != 3) {
+                fail(lineno, "expected the lock lights");
+            }
+            uint8_t leds = a;
+            Sim.at(t, [leds]() { Sim.host.setLeds(leds); });
+        }
+        else if (strcmp(event, "end") == 0) {
+            end = t;
+            ended = true;
+        }
+        else {
+            fail(lineno, "unknown event");
+        }
+    }
+
+    int result = 0;
+    try {
+        Sim.run(end);
+    }
+    catch (const SimHalt &h) {
+        printf("%10.3f halted: %s\n", Sim.now() / 1000.0, h.reason);
+        result = 2;
+    }
+    printf("%zu reports\n", Sim.host.reports.size());
+    return result;
+}
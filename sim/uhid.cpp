@@ -0,0 +1,309 @@
+/*
+ * uhid.cpp - play a trace through the firmware and on through the Linux
+ *            input stack, and measure the latency all the way to evdev
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 guruthree
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+// usage: modelm-uhid [-v] [-m] [-p name=value] trace
+//
+// the firmware runs in the simulator as with modelm-replay (see replay.cpp,
+// -m and -p are the same), but kept to the pace of the real clock, and every
+// report on the keyboard and mouse interface is written to a uhid device (see
+// Uhid.h) as it's sent. the kernel parses them with the firmware's own report
+// descriptor and what comes out of evdev is timestamped and matched up with
+// the reports: firmware latency is from the change on the matrix to the first
+// report that has it (simulated), kernel latency from writing that report to
+// the key event coming out of evdev (measured), and end to end the two added
+// together. mouse reports (scrolling) are counted too, as is how many
+// reports the kernel turned into input events, as it drops any that don't
+// change anything. -v prints every key event. needs root, or access to
+// /dev/uhid and /dev/input
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/input.h>
+
+#include "Simulator.h"
+#include "Membrane.h"
+#include "Trace.h"
+#include "Uhid.h"
+#include "Keymap.h"
+#include "USBKeyboard.h"
+
+// a key going down or up in the reports
+struct keyChange {
+    uint64_t time; // us, simulated
+    uint64_t written; // CLOCK_MONOTONIC when the report was written to uhid
+    uint64_t delivered; // and when evdev had it, 0 if it didn't
+    uint8_t usage;
+    bool down;
+};
+
+// and out of evdev
+struct keyEvent {
+    uint64_t time; // CLOCK_MONOTONIC
+    uint8_t usage;
+    bool down;
+};
+
+static bool verbose = false;
+static UhidDevice device;
+static std::vector<keyChange> reported;
+static std::vector<keyEvent> delivered;
+static uint32_t keyboardreports = 0, mousereports = 0, wheels = 0, frames = 0, scrolled = 0;
+
+static uint64_t monotonic() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+// send on a report from the firmware, and note which keys it changed
+static void forward(const simReport &r) {
+    static bool down[256] = {};
+    if (r.interface != 0) {
+        return;
+    }
+    uint64_t now = monotonic();
+    if (!device.input(r.id, r.data, r.length)) {
+        perror("uhid input");
+    }
+    if (r.id == RID_MOUSE) {
+        mousereports++;
+        scrolled += r.length >= 4 && r.data[3] != 0;
+        return;
+    }
+    keyboardreports++;
+    if (r.id != RID_KEYBOARD || r.length < 8 || r.data[2] == 0x01) { // ErrorRollOver changes nothing
+        return;
+    }
+    bool pressed[256] = {};
+    for (uint8_t b = 0; b < 8; b++) {
+        pressed[HID_KEY_CONTROL_LEFT + b] = r.data[0] & (1 << b);
+    }
+    for (uint8_t c = 2; c < 8; c++) {
+        pressed[r.data[c]] = true;
+    }
+    pressed[HID_KEY_NONE] = false;
+    for (uint16_t k = 0; k < 256; k++) {
+        if (pressed[k] != down[k]) {
+            reported.push_back({r.time, now, 0, (uint8_t)k, pressed[k]});
+            down[k] = pressed[k];
+        }
+    }
+}
+
+// key events come after a MSC_SCAN with the HID usage, which is what they're
+// matched to the reports with
+static void readEvents(int fd) {
+    static uint32_t scan = 0;
+    struct input_event ev;
+    while (read(fd, &ev, sizeof(ev)) == sizeof(ev)) {
+        uint64_t time = ev.input_event_sec * 1000000ull + ev.input_event_usec;
+        if (ev.type == EV_MSC && ev.code == MSC_SCAN) {
+            scan = ev.value;
+        }
+        else if (ev.type == EV_KEY && ev.value != 2 && (scan >> 16) == 0x07) { // not auto repeat
+            delivered.push_back({time, (uint8_t)scan, ev.value == 1});
+        }
+        else if (ev.type == EV_REL && (ev.code == REL_WHEEL || ev.code == REL_HWHEEL)) {
+            wheels++;
+        }
+        else if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+            frames++;
+        }
+    }
+}
+
+// everything from uhid and evdev, waiting up to timeout ms for something
+static void service(int timeout) {
+    std::vector<struct pollfd> fds;
+    fds.push_back({device.getFd(), POLLIN, 0});
+    for (int e : device.getEvents()) {
+        fds.push_back({e, POLLIN, 0});
+    }
+    if (poll(fds.data(), fds.size(), timeout) <= 0) {
+        return;
+    }
+    device.handle();
+    for (int e : device.getEvents()) {
+        readEvents(e);
+    }
+}
+
+int main(int argc, char **argv) {
+    membraneParams params;
+    bool membrane = false;
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; first++) {
+        if (strcmp(argv[first], "-v") == 0) {
+            verbose = true;
+        }
+        else if (strcmp(argv[first], "-m") == 0) {
+            membrane = true;
+        }
+        else if (first + 1 < argc && strcmp(argv[first], "-p") == 0) {
+            char name[32];
+            double value;
+            first++;
+            if (sscanf(argv[first], "%31[^=]=%lf", name, &value) != 2 || !params.set(name, value)) {
+                fprintf(stderr, "%s: not a membrane parameter, see sim/Membrane.h\n", argv[first]);
+                return 2;
+            }
+            membrane = true;
+        }
+        else {
+            first = argc;
+        }
+    }
+    if (first != argc - 1) {
+        fprintf(stderr, "usage: %s [-v] [-m] [-p name=value] trace\n", argv[0]);
+        return 2;
+    }
+    std::vector<replayEvent> events;
+    if (!loadTrace(argv[first], events)) {
+        return 2;
+    }
+
+    static MembraneMatrix matrix(params);
+    if (membrane) {
+        Sim.matrix = &matrix;
+    }
+    Sim.begin();
+    Sim.at(0, []() { Sim.host.plugIn(); });
+    uint64_t end = scheduleTrace(events, !membrane) + REPLAY_START + REPLAY_END;
+
+    // the descriptor is only known once the firmware has set up USB
+    uint64_t ready = REPLAY_START / 2;
+    try {
+        Sim.run(ready);
+    }
+    catch (const SimHalt &h) {
+        printf("halted: %s\n", h.reason);
+        return 1;
+    }
+    Adafruit_USBD_HID *hid = Sim.host.getInterface(0);
+    if (hid == NULL || !Sim.host.isMounted()) {
+        fprintf(stderr, "the keyboard didn't start\n");
+        return 1;
+    }
+    if (!device.create("pico-model-m sim", hid->descriptor, hid->descriptorlength, USB_VID, USB_PID)) {
+        perror("/dev/uhid");
+        return 1;
+    }
+    Sim.host.listener = forward;
+
+    // the simulated time is kept to the real time, a ms at a time
+    printf("%s\n", argv[first]);
+    fflush(stdout);
+    uint64_t start = monotonic() - ready;
+    try {
+        for (uint64_t t = ready; t < end; ) {
+            t = monotonic() - start;
+            Sim.run(t < end ? t : end);
+            service(1);
+        }
+    }
+    catch (const SimHalt &h) {
+        printf("  halted: %s\n", h.reason);
+        return 1;
+    }
+    // and whatever the kernel still has
+    for (uint8_t c = 0; c < 100; c++) {
+        service(1);
+    }
+    device.destroy();
+
+    // the kernel doesn't reorder anything, so each key event from evdev is the
+    // next change of that key in the reports
+    std::vector<uint64_t> kernel;
+    uint32_t unexpected = 0, missing = 0;
+    for (const keyEvent &d : delivered) {
+        bool found = false;
+        for (keyChange &r : reported) {
+            if (r.delivered == 0 && r.usage == d.usage && r.down == d.down) {
+                r.delivered = d.time > r.written ? d.time : r.written;
+                kernel.push_back(r.delivered - r.written);
+                found = true;
+                break;
+            }
+        }
+        unexpected += !found;
+    }
+    for (const keyChange &r : reported) {
+        missing += r.delivered == 0;
+    }
+
+    // and each change on the matrix goes with the first report after it
+    // that has it, before the next change of the same key
+    std::vector<uint64_t> firmware, endtoend;
+    for (size_t c = 0; c < events.size(); c++) {
+        const replayEvent &e = events[c];
+        if (e.type == REPLAY_CONTACT) {
+            continue;
+        }
+        uint8_t k = keymap[0][e.down][e.across];
+        uint64_t when = REPLAY_START + e.time, next = UINT64_MAX;
+        for (size_t c2 = c + 1; c2 < events.size(); c2++) {
+            if (events[c2].type != REPLAY_CONTACT && keymap[0][events[c2].down][events[c2].across] == k) {
+                next = REPLAY_START + events[c2].time;
+                break;
+            }
+        }
+        for (const keyChange &r : reported) {
+            if (r.usage != k || r.down != (e.type == REPLAY_PRESS) || r.time < when || r.time >= next) {
+                continue;
+            }
+            firmware.push_back(r.time - when);
+            if (r.delivered != 0) {
+                endtoend.push_back(r.time - when + r.delivered - r.written);
+            }
+            if (verbose) {
+                printf("  %10.3f %s %d %d %02x firmware %lu us", e.time / 1000.0, e.type == REPLAY_PRESS ? "press" : "release",
+                        e.down, e.across, k, r.time - when);
+                if (r.delivered != 0) {
+                    printf(" kernel %lu us\n", r.delivered - r.written);
+                }
+                else {
+                    printf(" not from evdev\n");
+                }
+            }
+            break;
+        }
+    }
+
+    printf("  %u keyboard and %u mouse reports (%u scrolling) written to uhid\n", keyboardreports, mousereports, scrolled);
+    printf("  %u input frames from evdev, %lu key events, %u wheel events\n", frames, delivered.size(), wheels);
+    printLatency("firmware", firmware);
+    printLatency("kernel", kernel);
+    printLatency("end to end", endtoend);
+    printf("  missing %u unexpected %u\n", missing, unexpected);
+    return missing || unexpected;
+}
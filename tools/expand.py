@@ -0,0 +1,238 @@
+#!/usr/bin/env python3
+#
+# expand.py - generate Expansions.h and Expansions.cpp from a list of text
+#             expansions (see boards/)
+#
+# The MIT License (MIT)
+#
+# Copyright (c) 2022 guruthree
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+#
+# usage: expand.py board.expand Expansions.h Expansions.cpp
+#
+# The triggers are compiled into one state machine (an Aho-Corasick automaton
+# with the failure links followed at build time), so the firmware moves on a
+# state with a single table lookup for each key pressed, however many
+# expansions there are and wherever in the typing a trigger starts. Key codes
+# are first mapped to a small alphabet of the keys used in any trigger, every
+# other key goes back to the start. Everything ends up as const tables in
+# flash, see TextExpander.h.
+
+import os
+import sys
+
+MAX_STEPS = 64 # TEXT_QUEUE_LENGTH in TextQueue.h, backspaces and text have to fit
+
+# HID key codes for ASCII on a US layout (HID_ASCII_TO_KEYCODE in tinyusb),
+# character -> (shift, key code)
+KEYS = {"\b": (0, 0x2A), "\t": (0, 0x2B), "\n": (0, 0x28), " ": (0, 0x2C)}
+for n, c in enumerate("abcdefghijklmnopqrstuvwxyz"):
+    KEYS[c] = (0, 0x04 + n)
+    KEYS[c.upper()] = (1, 0x04 + n)
+for n, (c, s) in enumerate(zip("1234567890", "!@#$%^&*()")):
+    KEYS[c] = (0, 0x1E + n)
+    KEYS[s] = (1, 0x1E + n)
+for k, (c, s) in zip((0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38), zip(r"-=[]\;'`,./", "_+{}|:\"~<>?")):
+    KEYS[c] = (0, k)
+    KEYS[s] = (1, k)
+
+ESCAPES = {"n": "\n", "t": "\t", "\\": "\\"}
+
+
+def fail(path, lineno, msg):
+    sys.exit("%s:%d: %s" % (path, lineno, msg))
+
+
+def unescape(path, lineno, text):
+    out = ""
+    c = 0
+    while c < len(text):
+        if text[c] == "\\":
+            if c + 1 == len(text) or text[c + 1] not in ESCAPES:
+                fail(path, lineno, "only \\n, \\t, and \\\\ can be escaped")
+            out += ESCAPES[text[c + 1]]
+            c += 2
+        else:
+            out += text[c]
+            c += 1
+    return out
+
+
+def parse(path):
+    entries = []
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            line = line.rstrip("\n")
+            if not line.strip() or line.lstrip().startswith("#"):
+                continue
+            words = line.split(None, 1)
+            if len(words) != 2:
+                fail(path, lineno, "expected a trigger and then the text it expands to")
+            trigger, text = words[0], unescape(path, lineno, words[1])
+            for c in trigger:
+                if c not in KEYS or KEYS[c][0]:
+                    fail(path, lineno, "'%s' in a trigger isn't a key that can be typed without shift" % c)
+            for c in text:
+                if c not in KEYS:
+                    fail(path, lineno, "'%s' can't be typed" % c)
+            if len(trigger) + len(text) > MAX_STEPS:
+                fail(path, lineno, "trigger and text are too long, at most %d characters together" % MAX_STEPS)
+            for other, otherlineno, _ in entries:
+                if trigger in other or other in trigger:
+                    fail(path, lineno, "'%s' and '%s' (line %d), one is inside the other, the shorter would always win" % (trigger, other, otherlineno))
+            entries.append((trigger, lineno, text))
+    return entries
+
+
+def build(entries):
+    # the key codes used in triggers become symbols 1 onwards, 0 is everything else
+    symbols = {}
+    for trigger, _, _ in entries:
+        for c in trigger:
+            symbols.setdefault(KEYS[c][1], len(symbols) + 1)
+    nsymbols = len(symbols) + 1
+
+    # a trie of the triggers
+    goto = [{}]
+    match = [0]
+    for n, (trigger, _, _) in enumerate(entries):
+        state = 0
+        for c in trigger:
+            s = symbols[KEYS[c][1]]
+            if s not in goto[state]:
+                goto[state][s] = len(goto)
+                goto.append({})
+                match.append(0)
+            state = goto[state][s]
+        match[state] = n + 1
+
+    # breadth first so the failure state is always done first, then every
+    # missing edge goes where the failure state's edge does
+    table = [[0] * nsymbols for _ in goto]
+    fail_to = [0] * len(goto)
+    order = [goto[0][s] for s in sorted(goto[0])]
+    for s, t in goto[0].items():
+        table[0][s] = t
+    while order:
+        state = order.pop(0)
+        for s in range(1, nsymbols):
+            if s in goto[state]:
+                t = goto[state][s]
+                fail_to[t] = table[fail_to[state]][s]
+                table[state][s] = t
+                order.append(t)
+            else:
+                table[state][s] = table[fail_to[state]][s]
+        # a trigger ending partway through another one still counts
+        if match[state] == 0:
+            match[state] = match[fail_to[state]]
+    return symbols, table, match
+
+
+def cstring(text):
+    out = ""
+    for c in text:
+        out += {"\n": "\\n", "\t": "\\t", "\\": "\\\\", "\"": "\\\""}.get(c, c)
+    return '"' + out + '"'
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit("usage: %s board.expand Expansions.h Expansions.cpp" % sys.argv[0])
+    entries = parse(sys.argv[1])
+    symbols, table, match = build(entries)
+    source = os.path.basename(sys.argv[1])
+    statetype = "uint8_t" if len(table) <= 256 else "uint16_t"
+    steps = max([len(t) + len(x) for t, _, x in entries] + [0])
+
+    header = """// generated by tools/expand.py from %s, do not edit
+
+#ifndef Expansions_h
+#define Expansions_h
+
+#include <cstdint>
+
+#define NUM_EXPANSIONS %d
+#define EXPANSION_STATES %d
+#define EXPANSION_SYMBOLS %d
+// the most backspaces and characters any one expansion needs
+#define EXPANSION_MAX_STEPS %d
+
+typedef %s expansionState;
+
+struct expansionDefinition {
+    uint8_t triggerlength; // backspaces needed to get rid of the trigger
+    uint8_t length;
+    const char *text;
+};
+
+// key code to symbol, 0 for keys that aren't in any trigger
+extern const uint8_t expansionsymbol[256];
+// the state after each symbol
+extern const expansionState expansionnext[EXPANSION_STATES][EXPANSION_SYMBOLS];
+// 1 + the expansion a trigger that ends here is for, or 0
+extern const uint8_t expansionmatch[EXPANSION_STATES];
+extern const expansionDefinition expansions[%s];
+
+#endif
+""" % (source, len(entries), len(table), len(symbols) + 1, steps, statetype, "NUM_EXPANSIONS" if entries else "1")
+
+    symbolrows = []
+    codes = [0] * 256
+    for k, s in symbols.items():
+        codes[k] = s
+    for row in range(0, 256, 16):
+        symbolrows.append("    " + ", ".join("%d" % v for v in codes[row:row + 16]) + ",")
+    nextrows = ["    /*%d*/{%s}," % (n, ", ".join(str(t) for t in row)) for n, row in enumerate(table)]
+    matchrow = ", ".join(str(m) for m in match)
+    if entries:
+        definitions = ["    {%d, %d, %s}, // %s" % (len(t), len(x), cstring(x), t) for t, _, x in entries]
+    else:
+        definitions = ["    {0, 0, \"\"},"]
+
+    table = """// generated by tools/expand.py from %s, do not edit
+
+#include "Expansions.h"
+
+const uint8_t expansionsymbol[256] = {
+%s
+};
+
+const expansionState expansionnext[EXPANSION_STATES][EXPANSION_SYMBOLS] = {
+%s
+};
+
+const uint8_t expansionmatch[EXPANSION_STATES] = {%s};
+
+const expansionDefinition expansions[%s] = {
+%s
+};
+""" % (source, "\n".join(symbolrows), "\n".join(nextrows), matchrow,
+       "NUM_EXPANSIONS" if entries else "1", "\n".join(definitions))
+
+    for path, text in ((sys.argv[2], header), (sys.argv[3], table)):
+        os.makedirs(os.path.dirname(os.path.abspath(path)), exist_ok=True)
+        with open(path, "w") as f:
+            f.write(text)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,193 @@
+#!/usr/bin/env python3
+#
+# gentrace.py - generate the key press traces in sim/traces for modelm-replay
+#
+# The MIT License (MIT)
+#
+# Copyright (c) 2022 guruthree
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+# usage: gentrace.py board.keymap typing|rollover|bounce|ghost [seed] > name.trace
+#
+# The traces are what happens on the matrix, see sim/replay.cpp for the
+# format. Timing comes from a random number generator started from the seed,
+# so the same seed always gives the same trace. Typing is modelled from text
+# rather than recorded: each key is held for a while and the next one is
+# pressed a little after, sooner the faster the typing, so at high speeds
+# several keys are down at once.
+
+import os
+import random
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import keymap
+
+TEXT = ("The quick brown fox jumps over the lazy dog. Pack my box with five dozen "
+        "liquor jugs! How vexingly quick daft zebras jump; the five boxing wizards "
+        "jump quickly. Sphinx of black quartz, judge my vow: 1234567890 times.")
+
+# characters that need shift, and the key they're on
+SHIFTED = {"!": "1", "@": "2", "#": "3", "$": "4", "%": "5", "^": "6", "&": "7", "*": "8",
+           "(": "9", ")": "0", ":": "SEMICOLON", "?": "SLASH", "\"": "APOSTROPHE",
+           "_": "MINUS", "+": "EQUAL", "<": "COMMA", ">": "PERIOD"}
+UNSHIFTED = {" ": "SPACE", ".": "PERIOD", ",": "COMMA", ";": "SEMICOLON", "'": "APOSTROPHE",
+             "-": "MINUS", "=": "EQUAL", "/": "SLASH", "\n": "ENTER"}
+MODIFIERS = ("CONTROL_LEFT", "SHIFT_LEFT", "ALT_LEFT", "GUI_LEFT",
+             "CONTROL_RIGHT", "SHIFT_RIGHT", "ALT_RIGHT", "GUI_RIGHT")
+
+
+class Trace:
+    def __init__(self, board):
+        layers, self.down, self.across = keymap.parse(board)
+        self.positions = {} # first position of each key in layer 0
+        self.names = {} # of each position, None if there's no key switch or it's special
+        self.layout = {}
+        for j, row in enumerate(layers[0]):
+            for i, code in enumerate(row):
+                name = code[len("HID_KEY_"):] if code.startswith("HID_KEY_") and code != "HID_KEY_NONE" else None
+                self.names[(j, i)] = name
+                self.layout[(j, i)] = code
+                if name is not None and name not in self.positions:
+                    self.positions[name] = (j, i)
+        self.lines = []
+
+    def add(self, t, what, pos, extra=""):
+        self.lines.append((round(t, 3), len(self.lines), "%.3f %s %d %d%s" % (t, what, pos[0], pos[1], extra)))
+
+    def write(self, comment):
+        print("# %s" % comment)
+        for t, n, line in sorted(self.lines):
+            print(line)
+
+
+def keys_for(trace, c):
+    if c.isalpha():
+        return c.isupper(), trace.positions[c.upper()]
+    if c.isdigit():
+        return False, trace.positions[c]
+    if c in UNSHIFTED:
+        return False, trace.positions[UNSHIFTED[c]]
+    return True, trace.positions[SHIFTED[c]]
+
+
+# wpm is words (of 5 characters) a minute
+def typing(trace, rng, wpm, text, start=0.0):
+    interval = 60000.0 / (wpm * 5)
+    t = start
+    free = {} # when each key can be pressed again
+    shift = trace.positions["SHIFT_LEFT"]
+    shiftuntil = None
+    for c in text:
+        shifted, pos = keys_for(trace, c)
+        t = max(t + max(rng.gauss(interval, interval / 4), interval / 3), free.get(pos, 0))
+        hold = min(max(rng.gauss(95, 20), 40), 200)
+        if shifted:
+            if shiftuntil is None:
+                trace.add(t - rng.uniform(25, 60), "press", shift)
+            shiftuntil = t + hold + rng.uniform(10, 40)
+        elif shiftuntil is not None:
+            trace.add(min(shiftuntil, t - 5), "release", shift)
+            shiftuntil = None
+        trace.add(t, "press", pos)
+        trace.add(t + hold, "release", pos)
+        free[pos] = t + hold + 15
+    if shiftuntil is not None:
+        trace.add(shiftuntil, "release", shift)
+    return t + 300
+
+
+# the contact opens and closes a few times after each change, for up to
+# maxbounce ms, settling where the key was going
+def bouncing(trace, rng, maxbounce):
+    changes = [l for l in trace.lines]
+    for t, n, line in changes:
+        words = line.split()
+        pos = (int(words[2]), int(words[3]))
+        settled = 1 if words[1] == "press" else 0
+        bounces = rng.randint(1, 4)
+        times = sorted(rng.uniform(0.05, maxbounce) for b in range(bounces * 2))
+        for b, bt in enumerate(times):
+            trace.add(t + bt, "contact", pos, " %d" % (settled if b % 2 else 1 - settled))
+
+
+# a key that's only in one place, so it can be told apart in the reports
+def normal(trace, pos):
+    name = trace.names[pos]
+    return name is not None and name not in MODIFIERS and list(trace.names.values()).count(name) == 1
+
+
+# three corners of a rectangle on the matrix connect the fourth too, with no
+# diodes on the membrane. if the fourth corner has a key switch there's no way
+# to tell which keys are really down, so the third key is expected to be
+# ignored, if it doesn't the third key is sent as normal
+def ghosts(trace, rng):
+    rectangles = {True: [], False: []}
+    for j1 in range(trace.down):
+        for j2 in range(j1 + 1, trace.down):
+            for i1 in range(trace.across):
+                for i2 in range(i1 + 1, trace.across):
+                    corners = [(j1, i1), (j1, i2), (j2, i1), (j2, i2)]
+                    if all(normal(trace, p) for p in corners[:3]):
+                        if normal(trace, corners[3]):
+                            rectangles[True].append(corners)
+                        elif trace.layout[corners[3]] == "HID_KEY_NONE":
+                            rectangles[False].append(corners)
+    t = 0.0
+    for n in range(24):
+        switch = n % 3 != 2 # mostly the case that has to be ignored
+        corners = rng.choice(rectangles[switch])
+        pressed = corners[:3]
+        rng.shuffle(pressed)
+        k1, k2, k3 = pressed
+        phantom = corners[3]
+        trace.add(t, "press", k1)
+        trace.add(t + 40, "press", k2)
+        trace.add(t + 80, "press", k3, " ghost" if switch else "")
+        trace.add(t + 80, "contact", phantom, " 1")
+        trace.add(t + 200, "release", k3)
+        trace.add(t + 200, "contact", phantom, " 0")
+        trace.add(t + 240, "release", k2)
+        trace.add(t + 280, "release", k1)
+        t += 400
+    return t
+
+
+def main():
+    if len(sys.argv) not in (3, 4) or sys.argv[2] not in ("typing", "rollover", "bounce", "ghost"):
+        sys.exit("usage: %s board.keymap typing|rollover|bounce|ghost [seed]" % sys.argv[0])
+    kind = sys.argv[2]
+    seed = int(sys.argv[3]) if len(sys.argv) == 4 else 1
+    rng = random.Random(seed)
+    trace = Trace(sys.argv[1])
+    if kind == "typing":
+        typing(trace, rng, 70, TEXT)
+    elif kind == "rollover":
+        typing(trace, rng, 150, TEXT.lower())
+    elif kind == "bounce":
+        typing(trace, rng, 60, TEXT.lower())
+        bouncing(trace, rng, 4.0) # inside DEBOUNCE_DELAY
+    else:
+        ghosts(trace, rng)
+    trace.write("generated by tools/gentrace.py %s %s %d, do not edit" % (os.path.basename(sys.argv[1]), kind, seed))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+#
+# keymap.py - generate Keymap.h and Keymap.cpp from a board keymap (see boards/)
+#
+# The MIT License (MIT)
+#
+# Copyright (c) 2022 guruthree
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+# usage: keymap.py board.keymap Keymap.h Keymap.cpp
+#
+# Every layer becomes a [NUM_DOWN][NUM_ACROSS] table of one byte codes in
+# flash, so working out what a key does is one lookup per active layer. The
+# codes for layer keys and transparent entries are defined in KeyboardLayout.h.
+
+import os
+import re
+import sys
+
+MAX_LAYERS = 4 # layers are tracked as bits of a byte, with room for the codes
+
+
+def fail(path, lineno, msg):
+    sys.exit("%s:%d: %s" % (path, lineno, msg))
+
+
+def entry(path, lineno, word, layer):
+    if word == "SPECIAL":
+        return "0xFF"
+    if word == "____":
+        if layer == 0:
+            fail(path, lineno, "layer 0 can't be transparent")
+        return "KEY_TRANSPARENT"
+    m = re.fullmatch(r"(MO|TG|OSL)\((\d+)\)", word)
+    if m:
+        target = int(m.group(2))
+        if target == 0 or target >= MAX_LAYERS:
+            fail(path, lineno, "%s must be to a layer from 1 to %d" % (word, MAX_LAYERS - 1))
+        kind = {"MO": "KEY_LAYER_MOMENTARY", "TG": "KEY_LAYER_TOGGLE", "OSL": "KEY_LAYER_ONESHOT"}[m.group(1)]
+        return "%s(%d)" % (kind, target)
+    if re.fullmatch(r"[A-Z0-9_]+", word):
+        return "HID_KEY_" + word
+    fail(path, lineno, "'%s' is not a key" % word)
+
+
+def parse(path):
+    layers = []
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            words = line.split("#", 1)[0].split()
+            if not words:
+                continue
+            if words[0] == "layer":
+                if len(words) != 2 or words[1] != str(len(layers)):
+                    fail(path, lineno, "expected 'layer %d'" % len(layers))
+                if len(layers) == MAX_LAYERS:
+                    fail(path, lineno, "at most %d layers are supported" % MAX_LAYERS)
+                layers.append([])
+                continue
+            if not layers:
+                fail(path, lineno, "keys before the first 'layer'")
+            layers[-1].append(([entry(path, lineno, w, len(layers) - 1) for w in words], lineno))
+
+    if not layers:
+        fail(path, 0, "no layers")
+    down, across = len(layers[0]), len(layers[0][0][0])
+    for layer in layers:
+        if len(layer) != down:
+            fail(path, layer[-1][1], "every layer needs %d rows" % down)
+        for row, lineno in layer:
+            if len(row) != across:
+                fail(path, lineno, "every row needs %d columns" % across)
+    for layer in layers:
+        for row, lineno in layer:
+            for code in row:
+                m = re.fullmatch(r"KEY_LAYER_\w+\((\d+)\)", code)
+                if m and int(m.group(1)) >= len(layers):
+                    fail(path, lineno, "there is no layer %s" % m.group(1))
+    return [[row for row, lineno in layer] for layer in layers], down, across
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit("usage: %s board.keymap Keymap.h Keymap.cpp" % sys.argv[0])
+    layers, down, across = parse(sys.argv[1])
+    source = os.path.basename(sys.argv[1])
+
+    header = """// generated by tools/keymap.py from %s, do not edit
+
+#ifndef Keymap_h
+#define Keymap_h
+
+#include "PinMap.h"
+
+#define NUM_LAYERS %d
+
+extern const uint8_t keymap[NUM_LAYERS][NUM_DOWN][NUM_ACROSS];
+
+#endif
+""" % (source, len(layers))
+
+    widths = [max(len(layer[j][i]) for layer in layers for j in range(down)) for i in range(across)]
+    body = []
+    for n, layer in enumerate(layers):
+        body.append("    { // layer %d" % n)
+        for j, row in enumerate(layer):
+            cells = ", ".join(code.rjust(widths[i]) for i, code in enumerate(row))
+            body.append("        /*%d*/{%s}," % (j, cells))
+        body.append("    },")
+
+    table = """// generated by tools/keymap.py from %s, do not edit
+
+#include "usb.h"
+
+#include "KeyboardLayout.h"
+
+static_assert(NUM_DOWN == %d && NUM_ACROSS == %d, "%s doesn't match the size of the board's matrix");
+
+const uint8_t keymap[NUM_LAYERS][NUM_DOWN][NUM_ACROSS] = {
+%s
+};
+""" % (source, down, across, source, "\n".join(body))
+
+    for path, text in ((sys.argv[2], header), (sys.argv[3], table)):
+        os.makedirs(os.path.dirname(os.path.abspath(path)), exist_ok=True)
+        with open(path, "w") as f:
+            f.write(text)
+
+
+if __name__ == "__main__":
+    main()
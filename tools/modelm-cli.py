@@ -0,0 +1,399 @@
+#!/usr/bin/env python3
+#
+# modelm-cli.py - configure a running keyboard through its vendor HID interface
+#
+# The MIT License (MIT)
+#
+# Copyright (c) 2022 guruthree
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+# usage: modelm-cli.py [--device /dev/hidrawN] command ...
+#
+#   info
+#   counters
+#   keymap get LAYER DOWN ACROSS
+#   keymap set LAYER DOWN ACROSS KEY    (staged until commit)
+#   keymap dump [LAYER]
+#   keymap commit | save | defaults
+#   param get [NAME]
+#   param set NAME VALUE
+#   macro get N | clear N | set N KEY:1 KEY:0 ...
+#   stream                              (live view of the matrix, ctrl-c to stop)
+#   recorder [CORE]                     (recent events, both cores if not given)
+#   stats [csv] | stats clear           (per key bounce statistics)
+#
+# KEY is a number or a HID_KEY_ name without the prefix (e.g. CAPS_LOCK), names
+# are read from tinyusb's hid.h in the Adafruit_TinyUSB_Arduino submodule.
+# Talks to /dev/hidraw* directly so nothing needs installing, the device is
+# found by its vendor usage page. The protocol is described in VendorHID.h.
+
+import argparse
+import glob
+import os
+import re
+import struct
+import sys
+import time
+
+VENDOR_ID, PRODUCT_ID = 0x2E8A, 0xB475 # USB_VID and USB_PID in CMakeLists.txt
+REPORT_SIZE = 32
+PROTOCOL_VERSION = 1
+
+INFO, KEYMAP_READ, KEYMAP_WRITE, KEYMAP_COMMIT, KEYMAP_SAVE, KEYMAP_DEFAULTS = 0x01, 0x10, 0x11, 0x12, 0x13, 0x14
+PARAM_GET, PARAM_SET, MACRO_READ, MACRO_CLEAR, MACRO_APPEND, COUNTERS = 0x20, 0x21, 0x30, 0x31, 0x32, 0x40
+STREAM, STREAM_DATA = 0x50, 0x51
+RECORDER_READ = 0x60
+KEY_STATS, KEY_STATS_CLEAR = 0x70, 0x71
+BOUNCE_BUCKETS = ["<0.5ms", "<1ms", "<2ms", "<3ms", "<5ms", "<8ms", "<13ms", ">13ms"] # MatrixScanner.h
+
+STATUS = ["ok", "unknown command", "bad argument", "busy", "failed"]
+PARAMS = ["debounce_ms", "settle_us", "scan_interval_us", "scroll_delay_ms", "scroll_timeout_s",
+          "adaptive_debounce", "debounce_min_ms", "debounce_max_ms",
+          "clock_governor", "expansions", "resolve_max_ms", "text_packing"]
+COUNTER_NAMES = ["uptime_ms", "scans", "max_scan_us", "lock_misses", "reports", "overflow_reports",
+                 "vendor_requests", "vendor_dropped", "stream_lost", "core1_restarts",
+                 "mounted_us", "first_report_us", "suspends", "key_wakes",
+                 "clock_khz", "clock_changes", "resolve_held", "resolve_max_us",
+                 "live_reports", "slow_keys", "ignored_keys"]
+
+# FlightRecorder.h, the names of the arguments of each event
+EVENTS = [("none", ()), ("boot", ("watchdog", "count_lo", "count_hi")), ("raw", ("down", "across", "state")),
+          ("accept", ("down", "across", "state")), ("reject", ("down", "across", "state")),
+          ("ghost", ("down", "across", "ignored")), ("lock_miss", ()),
+          ("report", ("modifiers", "key", "keys")), ("mount", ()), ("unmount", ()),
+          ("suspend", ("remote_wakeup",)), ("resume", ()), ("macro", ("action", "macro", "length")),
+          ("keymap_swap", ()), ("debounce_time", ("down", "across", "half_ms")),
+          ("core1_restart", ("restarts", "scans")), ("key_wake", ("remote_wakeup",)),
+          ("clock", ("profile", "mhz", "ok")), ("resolve", ("special", "outcome", "ms")),
+          ("keymap_stale", ())]
+MACRO_ACTIONS = ["record_start", "record_stop", "select", "play"]
+
+SPECIAL_CODES = {"SPECIAL": 0xFF, "____": 0xE8}
+LAYER_KEYS = {"MO": 0xF0, "TG": 0xF4, "OSL": 0xF8}
+
+
+def key_names():
+    names = {}
+    here = os.path.dirname(os.path.abspath(__file__))
+    for path in glob.glob(os.path.join(here, "..", "Adafruit_TinyUSB_Arduino", "src", "**", "hid.h"), recursive=True):
+        with open(path) as f:
+            for m in re.finditer(r"#define\s+HID_KEY_(\w+)\s+(0x[0-9A-Fa-f]+)", f.read()):
+                names.setdefault(m.group(1), int(m.group(2), 16))
+    return names
+
+
+class Keyboard:
+    def __init__(self, device=None):
+        self.fd = os.open(device or self.find(), os.O_RDWR)
+        self.seq = 0
+
+    @staticmethod
+    def find():
+        # the vendor interface is the hidraw node whose descriptor starts on usage page 0xFF00
+        for node in sorted(glob.glob("/sys/class/hidraw/hidraw*")):
+            try:
+                with open(os.path.join(node, "device", "uevent")) as f:
+                    uevent = f.read()
+                with open(os.path.join(node, "device", "report_descriptor"), "rb") as f:
+                    descriptor = f.read()
+            except OSError:
+                continue
+            m = re.search(r"HID_ID=\w+:0*([0-9A-Fa-f]+):0*([0-9A-Fa-f]+)", uevent)
+            if not m or (int(m.group(1), 16), int(m.group(2), 16)) != (VENDOR_ID, PRODUCT_ID):
+                continue
+            if descriptor[:3] == b"\x06\x00\xff":
+                return "/dev/" + os.path.basename(node)
+        sys.exit("no keyboard found (is it plugged in, and can you read /dev/hidraw*?)")
+
+    def request(self, command, args=b""):
+        self.seq = (self.seq + 1) & 0xFF
+        packet = bytes([command, self.seq]) + bytes(args)
+        # the leading 0 is the report ID, which hidraw wants even when there isn't one
+        os.write(self.fd, b"\x00" + packet.ljust(REPORT_SIZE, b"\x00"))
+        while True:
+            response = os.read(self.fd, REPORT_SIZE)
+            if response[0] == command and response[1] == self.seq:
+                break
+        if response[2] != 0:
+            status = STATUS[response[2]] if response[2] < len(STATUS) else response[2]
+            raise RuntimeError("command 0x%02x: %s" % (command, status))
+        return response[3:]
+
+    def info(self):
+        d = self.request(INFO)
+        if d[0] != PROTOCOL_VERSION:
+            sys.exit("the keyboard speaks protocol %d, this tool speaks %d" % (d[0], PROTOCOL_VERSION))
+        info = dict(zip(("down", "across", "max_layers", "macros", "max_specials", "special_length",
+                         "special_size"), d[1:8]))
+        info["image_size"], info["keymap_offset"], info["specials_offset"] = struct.unpack_from("<HHH", d, 8)
+        info["staged"], info["swap_pending"] = bool(d[14] & 1), bool(d[14] & 2)
+        info["params"], info["counters"] = d[15], d[16]
+        info["firmware"] = bytes(d[17:]).split(b"\x00", 1)[0].decode(errors="replace")
+        return info
+
+    def read(self, offset, length):
+        data = b""
+        while length > 0:
+            n = min(length, REPORT_SIZE - 3)
+            data += bytes(self.request(KEYMAP_READ, struct.pack("<HB", offset, n))[:n])
+            offset += n
+            length -= n
+        return data
+
+    def write(self, offset, data):
+        while data:
+            n = min(len(data), REPORT_SIZE - 5)
+            self.request(KEYMAP_WRITE, struct.pack("<HB", offset, n) + data[:n])
+            offset += n
+            data = data[n:]
+
+
+def parse_key(word, names):
+    word = word.upper()
+    if word in SPECIAL_CODES:
+        return SPECIAL_CODES[word]
+    m = re.fullmatch(r"(MO|TG|OSL)\((\d)\)", word)
+    if m:
+        return LAYER_KEYS[m.group(1)] + int(m.group(2))
+    if word.startswith("HID_KEY_"):
+        word = word[8:]
+    if word in names:
+        return names[word]
+    try:
+        return int(word, 0)
+    except ValueError:
+        sys.exit("'%s' is not a key" % word)
+
+
+def key_name(code, names):
+    for word, value in SPECIAL_CODES.items():
+        if code == value:
+            return word
+    for kind, base in LAYER_KEYS.items():
+        if base <= code < base + 4:
+            return "%s(%d)" % (kind, code - base)
+    for word, value in names.items():
+        if value == code:
+            return word
+    return "0x%02x" % code
+
+
+def stream(kb, info):
+    # records are [scan offset, column, raw, debounced, ghosted], see MatrixStream.h
+    down, across = info["down"], info["across"]
+    raw, debounced, ghosted = [0]*across, [0]*across, [0]*across
+    edges = [[0]*across for j in range(down)] # raw changes, bouncing keys stand out
+    scan, lost, drawn = 0, 0, 0
+
+    def draw():
+        out = ["\x1b[H\x1b[2J", "scan %d, packets lost %d" % (scan, lost),
+               "# pressed  g ghosting  r raw only (bouncing or debouncing)  . up", ""]
+        out.append("    " + "".join("%3d" % i for i in range(across)))
+        for j in range(down):
+            cells = []
+            for i in range(across):
+                bit = 1 << j
+                cell = "g" if ghosted[i] & bit else "#" if debounced[i] & bit else "r" if raw[i] & bit else "."
+                cells.append("%3s" % cell)
+            out.append("%3d " % j + "".join(cells))
+        busiest = sorted(((edges[j][i], j, i) for j in range(down) for i in range(across)), reverse=True)[:5]
+        out.append("")
+        out.append("most raw changes: " + ", ".join("%d,%d: %d" % (j, i, n) for n, j, i in busiest if n))
+        sys.stdout.write("\n".join(out) + "\n")
+        sys.stdout.flush()
+
+    kb.request(STREAM, [1])
+    try:
+        while True:
+            packet = os.read(kb.fd, REPORT_SIZE)
+            if packet[0] != STREAM_DATA:
+                continue
+            first, count = struct.unpack_from("<IB", packet, 2)
+            if count & 0x80:
+                lost += 1
+            for n in range(count & 0x7F):
+                offset, column, r, d, g = packet[7 + 5*n:12 + 5*n]
+                changed = raw[column] ^ r
+                for j in range(down):
+                    if changed & (1 << j):
+                        edges[j][column] += 1
+                raw[column], debounced[column], ghosted[column] = r, d, g
+                scan = first + offset
+            if time.monotonic() - drawn > 0.05:
+                draw()
+                drawn = time.monotonic()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        kb.request(STREAM, [0])
+
+
+def recorder(kb, core):
+    d = kb.request(RECORDER_READ, struct.pack("<BI", core, 0xFFFFFFFF))
+    head = struct.unpack_from("<I", d)[0]
+    n = max(0, head - 512) # RECORDER_LENGTH
+    records = []
+    while n < head:
+        try:
+            d = kb.request(RECORDER_READ, struct.pack("<BI", core, n))
+        except RuntimeError:
+            n += 16 # overwritten while reading, skip ahead
+            continue
+        count = d[4]
+        if count == 0:
+            break
+        for c in range(count):
+            records.append((n + c,) + struct.unpack_from("<II", d, 5 + 8*c))
+        n += count
+
+    print("core %d, %d events recorded" % (core, head))
+    for n, t, data in records:
+        kind = data & 0xFF
+        name, argnames = EVENTS[kind] if kind < len(EVENTS) else ("0x%02x" % kind, ("a", "b", "c"))
+        values = [(data >> (8*(c + 1))) & 0xFF for c in range(3)]
+        if name == "boot":
+            text = "watchdog=%d count=%d" % (values[0], values[1] | (values[2] << 8))
+        elif name == "macro":
+            action = MACRO_ACTIONS[values[0]] if values[0] < len(MACRO_ACTIONS) else values[0]
+            text = "%s macro=%d length=%d" % (action, values[1], values[2])
+        else:
+            text = " ".join("%s=%d" % (a, v) for a, v in zip(argnames, values))
+        print("%8d %12.6f %-12s %s" % (n, t/1e6, name, text))
+
+
+def stats(kb, info, csv):
+    rows = []
+    for j in range(info["down"]):
+        for i in range(info["across"]):
+            d = kb.request(KEY_STATS, [j, i])
+            values = struct.unpack_from("<%dH" % (3 + len(BOUNCE_BUCKETS)), d)
+            rows.append((j, i) + values)
+
+    header = ["down", "across", "rejected", "chatter"] + BOUNCE_BUCKETS + ["debounce_us"]
+    if csv:
+        print(",".join(header))
+        for row in rows:
+            print(",".join(str(v) for v in row))
+        return
+    # only the keys that have bounced, worst first
+    print(" ".join("%8s" % h for h in header))
+    for row in sorted(rows, key=lambda r: (r[2] + r[3], r[-1]), reverse=True):
+        if row[2] or row[3]:
+            print(" ".join("%8d" % v for v in row))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="configure a pico-model-m keyboard while it's running")
+    parser.add_argument("--device", help="hidraw device, found automatically if not given")
+    parser.add_argument("command", nargs="+")
+    args = parser.parse_args()
+    names = key_names()
+    kb = Keyboard(args.device)
+    info = kb.info()
+    cmd = args.command
+
+    def position(words):
+        layer, down, across = (int(w) for w in words)
+        if layer >= info["max_layers"] or down >= info["down"] or across >= info["across"]:
+            sys.exit("that key is outside the keymap")
+        return info["keymap_offset"] + (layer*info["down"] + down)*info["across"] + across
+
+    if cmd[0] == "info":
+        for k, v in info.items():
+            print("%s: %s" % (k, v))
+    elif cmd[0] == "counters":
+        values = []
+        while len(values) < info["counters"]:
+            d = kb.request(COUNTERS, [len(values)])
+            if d[0] == 0:
+                break
+            values += struct.unpack_from("<%dI" % d[0], d, 1)
+        for n, value in enumerate(values):
+            print("%s: %d" % (COUNTER_NAMES[n] if n < len(COUNTER_NAMES) else n, value))
+    elif cmd[:2] == ["keymap", "get"] and len(cmd) == 5:
+        print(key_name(kb.read(position(cmd[2:5]), 1)[0], names))
+    elif cmd[:2] == ["keymap", "set"] and len(cmd) == 6:
+        kb.write(position(cmd[2:5]), bytes([parse_key(cmd[5], names)]))
+        print("staged, use 'keymap commit' to start using it")
+    elif cmd[:2] == ["keymap", "dump"] and len(cmd) <= 3:
+        numlayers = kb.read(8, 1)[0] # keymapImage.numlayers
+        layers = [int(cmd[2])] if len(cmd) == 3 else range(numlayers)
+        size = info["down"]*info["across"]
+        for layer in layers:
+            codes = kb.read(info["keymap_offset"] + layer*size, size)
+            print("layer %d" % layer)
+            for j in range(info["down"]):
+                row = codes[j*info["across"]:(j + 1)*info["across"]]
+                print(" ".join(key_name(c, names) for c in row))
+    elif cmd[:2] == ["keymap", "commit"]:
+        kb.request(KEYMAP_COMMIT)
+    elif cmd[:2] == ["keymap", "save"]:
+        kb.request(KEYMAP_SAVE)
+    elif cmd[:2] == ["keymap", "defaults"]:
+        kb.request(KEYMAP_DEFAULTS)
+        print("staged, use 'keymap commit' to start using it")
+    elif cmd[:2] == ["param", "get"]:
+        for n, name in enumerate(PARAMS):
+            if len(cmd) == 2 or cmd[2] == name:
+                print("%s: %d" % (name, struct.unpack_from("<I", kb.request(PARAM_GET, [n]))[0]))
+    elif cmd[:2] == ["param", "set"] and len(cmd) == 4:
+        if cmd[2] not in PARAMS:
+            sys.exit("parameters are: " + ", ".join(PARAMS))
+        kb.request(PARAM_SET, struct.pack("<BI", PARAMS.index(cmd[2]), int(cmd[3], 0)))
+    elif cmd[:2] == ["macro", "get"] and len(cmd) == 3:
+        steps, index = [], 0
+        while True:
+            d = kb.request(MACRO_READ, struct.pack("<BH", int(cmd[2]), index))
+            length, count = struct.unpack_from("<HB", d)
+            steps += [(d[3 + 2*c], d[4 + 2*c]) for c in range(count)]
+            index += count
+            if count == 0 or index >= length:
+                break
+        print(" ".join("%s:%d" % (key_name(k, names), p) for k, p in steps))
+    elif cmd[:2] == ["macro", "clear"] and len(cmd) == 3:
+        kb.request(MACRO_CLEAR, [int(cmd[2])])
+    elif cmd[:2] == ["macro", "set"] and len(cmd) >= 3:
+        steps = []
+        for word in cmd[3:]:
+            key, _, pressed = word.rpartition(":")
+            steps += [parse_key(key, names), int(pressed)]
+        kb.request(MACRO_CLEAR, [int(cmd[2])])
+        for n in range(0, len(steps), 26):
+            chunk = steps[n:n + 26]
+            kb.request(MACRO_APPEND, bytes([int(cmd[2]), len(chunk)//2] + chunk))
+    elif cmd[0] == "recorder" and len(cmd) <= 2:
+        for core in [int(cmd[1])] if len(cmd) == 2 else [0, 1]:
+            recorder(kb, core)
+    elif cmd[:2] == ["stats", "clear"]:
+        kb.request(KEY_STATS_CLEAR)
+    elif cmd[0] == "stats" and len(cmd) <= 2:
+        stats(kb, info, cmd[1:] == ["csv"])
+    elif cmd[0] == "stream":
+        stream(kb, info)
+    else:
+        parser.print_help()
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except RuntimeError as e:
+        sys.exit(str(e))
@@ -0,0 +1,223 @@
+#!/usr/bin/env python3
+#
+# pinmap.py - generate PinMap.h from a board pin description (see boards/)
+#
+# The MIT License (MIT)
+#
+# Copyright (c) 2022 guruthree
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+# usage: pinmap.py board.pins PinMap.h
+#
+# The generated header has the matrix size, pin masks for bi_decl, and a
+# PinMap_<board> struct for MatrixScanner with the across/down pin lists, the
+# modifier pairs that ghost each other, the arrow keys used for scrolling, and
+# extractRows(), which turns a gpio_get_all() reading into a byte with bit j
+# set when row j is high. Row pins are grouped into 8 bit windows of the reading, each window is a shift
+# and either a mask (if the pins are already in row order) or a 256 entry
+# lookup table.
+
+import os
+import re
+import sys
+
+NUM_GPIO = 30 # GPIO pins on the RP2040 that can be read by gpio_get_all()
+MAX_DOWN = 8 # rows are packed into a byte
+
+
+def fail(path, lineno, msg):
+    sys.exit("%s:%d: %s" % (path, lineno, msg))
+
+
+def parse(path):
+    board = {}
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            words = line.split("#", 1)[0].split()
+            if not words:
+                continue
+            key, values = words[0], words[1:]
+            if key == "pair":
+                board.setdefault("pair", []).append((values, lineno))
+                continue
+            if key in board:
+                fail(path, lineno, "'%s' given more than once" % key)
+            if key == "scroll":
+                board[key] = (values, lineno)
+                continue
+            if key not in ("led", "across", "down"):
+                fail(path, lineno, "unknown key '%s'" % key)
+            try:
+                values = [int(v, 0) for v in values]
+            except ValueError:
+                fail(path, lineno, "pins must be numbers")
+            for v in values:
+                if v < 0 or v >= NUM_GPIO:
+                    fail(path, lineno, "pin %d is not a GPIO pin" % v)
+            if key == "led" and len(values) != 1:
+                fail(path, lineno, "led takes exactly one pin")
+            board[key] = (values, lineno)
+
+    for key in ("led", "across", "down"):
+        if key not in board:
+            fail(path, 0, "missing '%s'" % key)
+    if len(board["down"][0]) > MAX_DOWN:
+        fail(path, board["down"][1], "at most %d down pins are supported" % MAX_DOWN)
+
+    seen = {}
+    for key in ("led", "across", "down"):
+        values, lineno = board[key]
+        for v in values:
+            if v in seen:
+                fail(path, lineno, "pin %d is already used by '%s'" % (v, seen[v]))
+            seen[v] = key
+
+    def positions(key, values, lineno, count):
+        result = []
+        for v in values:
+            m = re.fullmatch(r"(\d+),(\d+)", v)
+            if not m:
+                fail(path, lineno, "%s takes %d down,across positions" % (key, count))
+            d, a = int(m.group(1)), int(m.group(2))
+            if d >= len(board["down"][0]) or a >= len(board["across"][0]):
+                fail(path, lineno, "%s is outside the matrix" % v)
+            result += [d, a]
+        if len(result) != count * 2:
+            fail(path, lineno, "%s takes %d down,across positions" % (key, count))
+        return result
+
+    pairs = [positions("pair", values, lineno, 2) for values, lineno in board.pop("pair", [])]
+    scroll = None
+    if "scroll" in board:
+        scroll = positions("scroll", *board.pop("scroll"), 4)
+
+    board = {k: v[0] for k, v in board.items()}
+    board["pair"] = pairs
+    board["scroll"] = scroll
+    return board
+
+
+def mask(pins):
+    m = 0
+    for p in pins:
+        m |= 1 << p
+    return m
+
+
+def row_windows(down):
+    # group the row pins so each group fits in an 8 bit window of the reading
+    windows = []
+    for p in sorted(down):
+        if windows and p - windows[-1][0] < 8:
+            windows[-1][1].append(p)
+        else:
+            windows.append((p, [p]))
+
+    result = []
+    for base, pins in windows:
+        lut = []
+        for v in range(256):
+            rows = 0
+            for p in pins:
+                if v & (1 << (p - base)):
+                    rows |= 1 << down.index(p)
+            lut.append(rows)
+        winmask = mask(pins) >> base
+        identity = all(lut[v] == v & winmask for v in range(256))
+        result.append((base, winmask, None if identity else lut))
+    return result
+
+
+def generate(board, source):
+    across, down, led, pairs, scroll = board["across"], board["down"], board["led"][0], board["pair"], board["scroll"]
+    name = "PinMap_" + re.sub(r"\W", "_", os.path.splitext(source)[0])
+    out = []
+    out.append("// generated by tools/pinmap.py from %s, do not edit" % source)
+    out.append("")
+    out.append("#ifndef PinMap_h")
+    out.append("#define PinMap_h")
+    out.append("")
+    out.append("#include <cstdint>")
+    out.append("")
+    out.append("// columns of the matrix")
+    out.append("#define NUM_ACROSS %d" % len(across))
+    out.append("// rows of the matrix")
+    out.append("#define NUM_DOWN %d" % len(down))
+    out.append("")
+    out.append("#define PINMAP_LED_PIN %d" % led)
+    out.append("#define PINMAP_ACROSS_MASK 0x%08xu" % mask(across))
+    out.append("#define PINMAP_DOWN_MASK 0x%08xu" % mask(down))
+    out.append("")
+    out.append("struct %s {" % name)
+    out.append("    // GPIO pins for the membrane")
+    out.append("    static constexpr uint8_t across[%d] = {%s};" % (len(across), ", ".join(str(p) for p in across)))
+    out.append("    static constexpr uint8_t down[%d] = {%s};" % (len(down), ", ".join(str(p) for p in down)))
+    out.append("")
+    out.append("    // modifiers that ghost each other, as down, across, down2, across2")
+    out.append("    static constexpr uint8_t numghostpairs = %d;" % len(pairs))
+    rows = ", ".join("{%s}" % ", ".join(str(v) for v in p) for p in pairs) if pairs else "{0, 0, 0, 0}"
+    out.append("    static constexpr uint8_t ghostpairs[%d][4] = {%s};" % (max(len(pairs), 1), rows))
+    out.append("")
+    out.append("    // arrow keys for mouse scrolling, as down, across for up, down, right, left")
+    out.append("    static constexpr bool hasscroll = %s;" % ("true" if scroll else "false"))
+    rows = ", ".join("{%d, %d}" % (scroll[n], scroll[n + 1]) for n in range(0, 8, 2)) if scroll else "{0, 0}, {0, 0}, {0, 0}, {0, 0}"
+    out.append("    static constexpr uint8_t scroll[4][2] = {%s};" % rows)
+    out.append("")
+
+    windows = row_windows(down)
+    terms = []
+    for n, (base, winmask, lut) in enumerate(windows):
+        if lut is None:
+            terms.append("((readings >> %d) & 0x%02x)" % (base, winmask))
+            continue
+        table = "rowlut%d" % n
+        out.append("    // GPIO %d-%d to rows" % (base, base + 7))
+        out.append("    static constexpr uint8_t %s[256] = {" % table)
+        for row in range(0, 256, 16):
+            out.append("        " + ", ".join("0x%02x" % v for v in lut[row:row + 16]) + ",")
+        out.append("    };")
+        out.append("")
+        terms.append("%s[(readings >> %d) & 0xff]" % (table, base))
+
+    out.append("    // turn a gpio_get_all() reading into a byte with bit j set if down[j] is high")
+    out.append("    static inline uint8_t extractRows(uint32_t readings) {")
+    out.append("        return %s;" % "\n            | ".join(terms))
+    out.append("    }")
+    out.append("};")
+    out.append("")
+    out.append("// the board this firmware is being built for")
+    out.append("typedef %s BoardPinMap;" % name)
+    out.append("")
+    out.append("#endif")
+    return "\n".join(out) + "\n"
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: %s board.pins PinMap.h" % sys.argv[0])
+    board = parse(sys.argv[1])
+    text = generate(board, os.path.basename(sys.argv[1]))
+    os.makedirs(os.path.dirname(os.path.abspath(sys.argv[2])), exist_ok=True)
+    with open(sys.argv[2], "w") as f:
+        f.write(text)
+
+
+if __name__ == "__main__":
+    main()
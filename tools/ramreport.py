@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+#
+# keymap.py - generate Keymap.h and Keymap.cpp from a board keymap (see boards/)
+#
+# The MIT License (MIT)
+#
+# Copyright (c) 2022 guruthree
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+#
+# usage: ramreport.py [--sdk path] [--heap-free] pico-model-m.elf.map
+#
+# Reads the map GNU ld writes (linked with --cref) and adds up the .data and
+# .bss of every module that ends up in a writable memory region, so what the
+# firmware needs in RAM is known at build time rather than found out at run
+# time. Modules are grouped into the firmware's own objects, the pico-sdk
+# (anything under --sdk, which includes tinyusb), and library archives, with
+# the stack and heap reservations from crt0 on their own. The cross reference
+# table at the end of the map is used to list everything that references
+# malloc, new, or _sbrk. This is conservative, a reference can be from code
+# that's garbage collected, but nothing that isn't listed can allocate. With
+# --heap-free any firmware object on the list fails the build.
+
+import argparse
+import os
+import re
+import sys
+
+# things that take memory from the heap, also with the pico-sdk's wrappers, and
+# new both mangled and as ld prints it by default
+ALLOCATOR = re.compile(r"(__wrap_|__real_)?(malloc|calloc|realloc|_malloc_r|_calloc_r|_realloc_r|_sbrk|_Zn[wa][jm]\w*)$|operator new(\[\])?\(")
+
+# sections that are zeroed or not loaded, everything else is copied from flash
+ZEROED = re.compile(r"\.bss|\.tbss|COMMON|\.heap|\.stack|\.uninitialized")
+
+HEX = re.compile(r"0x[0-9a-fA-F]+$")
+
+# ld lines up the files in the cross reference table at this column, a symbol
+# too long to fit before it has the file on the next line
+CREF_COLUMN = 50
+
+
+def parse(path):
+    regions = []
+    sections = [] # (output section, input section, address, size, file)
+    references = {} # symbol: [files], the first is where it's defined
+    part = None
+    output, pending, symbol = None, None, None
+    with open(path) as f:
+        for line in f:
+            line = line.rstrip("\n")
+            if line.startswith("Memory Configuration"):
+                part = "memory"
+                continue
+            if line.startswith("Linker script and memory map"):
+                part = "map"
+                continue
+            if line.startswith("Cross Reference Table"):
+                part = "cref"
+                continue
+            words = line.split()
+
+            if part == "memory":
+                if len(words) >= 3 and words[0] != "Name" and HEX.match(words[1]) and HEX.match(words[2]):
+                    attributes = words[3] if len(words) > 3 else ""
+                    if words[0] != "*default*" and "w" in attributes:
+                        regions.append((words[0], int(words[1], 16), int(words[2], 16)))
+
+            elif part == "map":
+                if not words:
+                    pending = None
+                elif not line[0].isspace():
+                    # an output section, the name can be on a line of its own
+                    pending = None
+                    output = words[0]
+                    if len(words) == 1:
+                        pending = ("output", words[0])
+                elif line.startswith(" ") and not line.startswith("  ") and not words[0].startswith("*"):
+                    # an input section, again maybe with the rest on the next line
+                    pending = None
+                    if len(words) >= 4 and HEX.match(words[1]) and HEX.match(words[2]):
+                        sections.append((output, words[0], int(words[1], 16), int(words[2], 16), " ".join(words[3:])))
+                    elif len(words) == 1:
+                        pending = ("input", words[0])
+                elif pending and len(words) >= 2 and HEX.match(words[0]) and HEX.match(words[1]):
+                    if pending[0] == "input" and len(words) >= 3:
+                        sections.append((output, pending[1], int(words[0], 16), int(words[1], 16), " ".join(words[2:])))
+                    pending = None
+                else:
+                    pending = None
+
+            elif part == "cref":
+                if not words or line.startswith("Symbol "):
+                    continue
+                if not line[0].isspace():
+                    # demangled symbols have spaces in them, so go by the column
+                    if len(line) > CREF_COLUMN and line[CREF_COLUMN - 1] == " " and not line[CREF_COLUMN].isspace():
+                        symbol = line[:CREF_COLUMN].rstrip()
+                        references[symbol] = [line[CREF_COLUMN:].strip()]
+                    else:
+                        symbol = line.strip()
+                        references[symbol] = []
+                elif symbol:
+                    references[symbol].append(line.strip())
+
+    if part is None:
+        sys.exit("%s: not a link map" % path)
+    return regions, sections, references
+
+
+def in_ram(regions, output, address):
+    if regions:
+        return any(origin <= address < origin + length for name, origin, length in regions)
+    # no memory regions (e.g. a map from a host build of sim/), go by the section
+    return output in (".data", ".bss", ".tdata", ".tbss")
+
+
+def module(name, path, sdk):
+    # which group and module an input section belongs to
+    if name.startswith(".stack"):
+        return "reserved", "stack"
+    if name.startswith(".heap"):
+        return "reserved", "heap"
+    path = path.replace("\\", "/")
+    m = re.match(r"(.*\.a)\((.*)\)$", path)
+    if m and os.path.isabs(m.group(1)):
+        return "libraries", os.path.basename(m.group(1))
+    if m:
+        path = m.group(2) # an archive from this build, like the sim's firmware
+    m = re.search(r"CMakeFiles/[^/]+\.dir/(.*)$", path)
+    if m:
+        path = m.group(1)
+    elif os.path.isabs(path) and not (sdk or "/pico-sdk/" in path):
+        return "libraries", os.path.basename(path) # crt objects from the toolchain
+    path = re.sub(r"\.obj$|\.o$", "", path)
+    if sdk:
+        sdkpath = os.path.abspath(sdk).replace("\\", "/").lstrip("/").replace(":", "")
+        at = path.find(sdkpath)
+        if at >= 0:
+            return "pico-sdk", path[at + len(sdkpath):].lstrip("/")
+    elif "/pico-sdk/" in "/" + path:
+        return "pico-sdk", path.split("pico-sdk/", 1)[1]
+    return "firmware", path
+
+
+def main():
+    parser = argparse.ArgumentParser(description="RAM used by each module of the firmware, from the link map")
+    parser.add_argument("--sdk", help="path to the pico-sdk, to tell its objects from the firmware's")
+    parser.add_argument("--heap-free", action="store_true", help="fail if any firmware object references malloc, new, or _sbrk")
+    parser.add_argument("map", help="map file written by the linker, with --cref for the allocation check")
+    args = parser.parse_args()
+
+    regions, sections, references = parse(args.map)
+
+    budget = {} # (group, module): [data, bss]
+    used = {} # region: bytes
+    for output, name, address, size, path in sections:
+        if size == 0 or not in_ram(regions, output, address):
+            continue
+        entry = budget.setdefault(module(name, path, args.sdk), [0, 0])
+        entry[1 if ZEROED.match(name) else 0] += size
+        for region, origin, length in regions:
+            if origin <= address < origin + length:
+                used[region] = used.get(region, 0) + size
+
+    print("RAM budget from %s" % os.path.basename(args.map))
+    print()
+    if regions:
+        print("%-36s %8s %8s" % ("region", "used", "size"))
+        for region, origin, length in regions:
+            print("%-36s %8d %8d %5.1f%%" % (region, used.get(region, 0), length, 100.0 * used.get(region, 0) / length))
+        print()
+
+    width = max([len(m) + 2 for g, m in budget] + [36])
+    print("%-*s %8s %8s %8s" % (width, "module", "data", "bss", "total"))
+    for group in ("firmware", "pico-sdk", "libraries", "reserved"):
+        modules = sorted(((m, v) for (g, m), v in budget.items() if g == group), key=lambda mv: (-sum(mv[1]), mv[0]))
+        if not modules:
+            continue
+        data = sum(v[0] for m, v in modules)
+        bss = sum(v[1] for m, v in modules)
+        print("%-*s %8d %8d %8d" % (width, group, data, bss, data + bss))
+        for m, (d, b) in modules:
+            print("  %-*s %8d %8d %8d" % (width - 2, m, d, b, d + b))
+    data = sum(v[0] for v in budget.values())
+    bss = sum(v[1] for v in budget.values())
+    print("%-*s %8d %8d %8d" % (width, "total", data, bss, data + bss))
+    print()
+
+    if not references:
+        print("no cross reference table, link with --cref to check for heap allocation")
+        return 1 if args.heap_free else 0
+    allocating = []
+    print("referencing the heap")
+    for symbol in sorted(references):
+        if not ALLOCATOR.match(symbol):
+            continue
+        for path in references[symbol][1:]:
+            group, m = module("", path, args.sdk)
+            print("  %-34s %s" % (symbol, m if group != "libraries" else path.replace("\\", "/").rsplit("/", 1)[-1]))
+            if group == "firmware":
+                allocating.append((symbol, m))
+    if args.heap_free and allocating:
+        for symbol, m in allocating:
+            print("%s: %s references %s in a heap-free build" % (args.map, m, symbol), file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
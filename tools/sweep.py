@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+#
+# sweep.py - find the quickest settle and debounce delays that don't lose or make
+#            up keys, by replaying traces on the simulated membrane
+#
+# The MIT License (MIT)
+#
+# Copyright (c) 2022 guruthree
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+# usage: sweep.py [--replay sim/build/modelm-replay] [-p name=value]...
+#                 [--settle 2,3,...] [--debounce 1,2,...] [--interval 100] trace...
+#
+# Every combination of settings is tried on every trace with modelm-replay -m
+# (see sim/Membrane.h for what the membrane does and its parameters, which
+# -p passes on). A combination is clean if no key was dropped, duplicated,
+# stuck, made up, or leaked through anti-ghosting in any trace, and the
+# quickest is the clean one with the lowest mean press latency. Keys that
+# were meant to be ghosting but were sent because the membrane didn't show
+# the fourth corner aren't counted, there was nothing for the firmware to go
+# on. The answer is only as good as the membrane parameters, so it's worth
+# leaving a margin above the quickest, e.g. by checking the settings either
+# side are clean too.
+
+import argparse
+import concurrent.futures
+import os
+import re
+import subprocess
+import sys
+
+
+def numbers(text):
+    return [int(v) for v in text.split(",")]
+
+
+def replay(args, settle, debounce, interval):
+    command = [args.replay, "-m"]
+    for p in args.p:
+        command += ["-p", p]
+    command += ["-s", str(settle), "-d", str(debounce), "-i", str(interval)] + args.trace
+    output = subprocess.run(command, stdout=subprocess.PIPE, universal_newlines=True).stdout
+
+    bad, presses, total, worst = 0, 0, 0, 0
+    for line in output.splitlines():
+        m = re.match(r"\s+(\d+) presses", line)
+        if m:
+            n = int(m.group(1))
+            presses += n
+        m = re.match(r"\s+press latency us: min \d+ mean (\d+) p50 \d+ p99 (\d+)", line)
+        if m:
+            total += int(m.group(1)) * n
+            worst = max(worst, int(m.group(2)))
+        m = re.match(r"\s+dropped (\d+) duplicated (\d+) stuck (\d+) phantom (\d+) ghosting ignored \d+ of \d+ leaked (\d+)", line)
+        if m:
+            bad += sum(int(v) for v in m.groups())
+        if "halted" in line:
+            bad += 1
+    if presses == 0:
+        sys.exit("%s didn't replay anything:\n%s" % (" ".join(command), output))
+    return settle, debounce, interval, bad, total // presses, worst
+
+
+def main():
+    parser = argparse.ArgumentParser(description="find the quickest settings that don't lose or make up keys")
+    parser.add_argument("--replay", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "sim", "build", "modelm-replay"))
+    parser.add_argument("-p", action="append", default=[], help="membrane parameter, name=value")
+    parser.add_argument("--settle", type=numbers, default=numbers("2,3,4,5,6,8,10,15,20,30"), help="us")
+    parser.add_argument("--debounce", type=numbers, default=numbers("1,2,3,4,5,6,8"), help="ms")
+    parser.add_argument("--interval", type=numbers, default=numbers("100"), help="scan interval, us")
+    parser.add_argument("trace", nargs="+")
+    args = parser.parse_args()
+
+    runs = [(s, d, i) for s in args.settle for d in args.debounce for i in args.interval]
+    with concurrent.futures.ThreadPoolExecutor(os.cpu_count()) as pool:
+        results = list(pool.map(lambda r: replay(args, *r), runs))
+
+    print("settle us  debounce ms  interval us  bad  mean us  p99 us")
+    for settle, debounce, interval, bad, mean, worst in results:
+        print("%9d  %11d  %11d  %3d  %7d  %6d" % (settle, debounce, interval, bad, mean, worst))
+
+    clean = [r for r in results if r[3] == 0]
+    if not clean:
+        print("nothing tried was clean")
+        sys.exit(1)
+    settle, debounce, interval, bad, mean, worst = min(clean, key=lambda r: (r[4], r[5]))
+    print("quickest clean: settle %d us, debounce %d ms, scan interval %d us (mean %d us, p99 %d us)" % (settle, debounce, interval, mean, worst))
+
+
+if __name__ == "__main__":
+    main()